@@ -6,4 +6,49 @@
 
 #define CACHED_SECTOR_NUM 64
 
+// the size of cache block when caching by page
+#define CACHE_PAGE_SIZE 4096
+
+// write-back: a dirty cache block is written back after DIRTY_EXPIRE_MS, the flusher wakes up every FLUSH_INTERVAL_MS
+// or once the dirty blocks exceed DIRTY_BACKGROUND_RATIO percent of the cache, and readers write back by themselves
+// once they exceed DIRTY_RATIO percent.
+#define DIRTY_EXPIRE_MS 3000
+#define FLUSH_INTERVAL_MS 500
+#define DIRTY_BACKGROUND_RATIO 10
+#define DIRTY_RATIO 40
+
+// the filesystem is synced by the operations freeing clusters once SYNC_INTERVAL_MS passed since the last sync, so that
+// the clusters freed are discarded without waiting for fsync or unmount.
+#define SYNC_INTERVAL_MS 5000
+
+// readahead: the window of a sequential stream starts from READAHEAD_MIN_SECTOR_NUM sectors and doubles up to the max
+// given at mount(READAHEAD_MAX_SECTOR_NUM by default), at most READAHEAD_STREAM_NUM streams are tracked at a time.
+#define READAHEAD_MIN_SECTOR_NUM 16
+#define READAHEAD_MAX_SECTOR_NUM 128
+#define READAHEAD_STREAM_NUM 8
+
+// the cache is split into at most CACHE_SHARD_NUM shards by block number, each with its own lock, a shard holds no
+// fewer than CACHE_SHARD_MIN_BLOCK_NUM blocks so that a small cache still keeps to LRU.
+#define CACHE_SHARD_NUM 8
+#define CACHE_SHARD_MIN_BLOCK_NUM 4
+
+// discard: the freed sectors are discarded in the background once DISCARD_BATCH_SECTOR_NUM of them are queued, or
+// DISCARD_DELAY_MS after the last discard.
+#define DISCARD_BATCH_SECTOR_NUM 2048
+#define DISCARD_DELAY_MS 1000
+
+// the FAT is kept in memory as a whole if it takes at most FAT_MIRROR_MAX_SIZE bytes, otherwise its sectors are read
+// through the cache as needed.
+#define FAT_MIRROR_MAX_SIZE (64 << 20)
+
+// the max number of sectors moved by a single batched read/write
+#define MAX_BATCH_SECTOR_NUM 256
+
+// the size of a huge page used by the cache arena
+#define HUGE_PAGE_SIZE (2 << 20)
+
+// io_uring: the max number of requests in flight, and the max number of sectors carried by each request
+#define URING_QUEUE_DEPTH 32
+#define URING_REQUEST_SECTOR_NUM 32
+
 #endif //STUPID_FAT32_CONFIG_H
@@ -3,39 +3,104 @@
 #include <sys/ioctl.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
 #include "unistd.h"
 #include <fcntl.h>
+#include <algorithm>
+#include <cerrno>
+#include <climits>
 #include <cassert>
 #include <cstring>
+#include <unordered_set>
 #include <vector>
 
 #include "device.h"
 
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define HAVE_IO_URING
+#endif
+
 namespace device {
+    /**
+     * Device
+     * */
+    std::optional<std::vector<std::shared_ptr<Sector>>> Device::readSectors(u32 sec_num, u32 cnt) noexcept {
+        std::vector<std::shared_ptr<Sector>> sectors;
+        sectors.reserve(cnt);
+        for (u32 i = sec_num; i < sec_num + cnt; i++) {
+            auto result = readSector(i);
+            if (!result.has_value()) {
+                return std::nullopt;
+            }
+            sectors.push_back(std::move(result.value()));
+        }
+
+        return {std::move(sectors)};
+    }
+
+    bool Device::writeSectors(u32 sec_num, const std::vector<const u8 *> &bufs) noexcept {
+        for (u32 i = 0; i < bufs.size(); i++) {
+            if (!writeSectorValue(sec_num + i, bufs[i])) {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    bool Device::readSectorsValue(u32 sec_num, const std::vector<u8 *> &bufs) noexcept {
+        auto result = readSectors(sec_num, bufs.size());
+        if (!result.has_value()) {
+            return false;
+        }
+        auto &sectors = result.value();
+        for (u32 i = 0; i < bufs.size(); i++) {
+            memcpy(bufs[i], sectors[i]->read_ptr(0), sectors[i]->size());
+        }
+
+        return true;
+    }
+
     /**
      * Sector
      * */
     Sector::Sector(u32 sec_num, u32 sec_sz, Device &device) noexcept
-            : sec_num_{sec_num}, sec_sz_{sec_sz}, device_{device}, dirty_(false), value_(std::vector<u8>(sec_sz)) {}
+            : sec_num_{sec_num}, sec_sz_{sec_sz}, device_{device}, dirty_(false), value_(std::vector<u8>(sec_sz)),
+              buf_{&value_[0]}, block_{nullptr} {}
+
+    Sector::Sector(u32 sec_num, u32 sec_sz, Device &device, u8 *buf, CacheBlock *block) noexcept
+            : sec_num_{sec_num}, sec_sz_{sec_sz}, device_{device}, dirty_(false), buf_{buf}, block_{block} {}
 
     void Sector::mark_dirty() noexcept {
-        dirty_ = true;
+        if (!dirty_) {
+            dirty_ = true;
+            if (block_ != nullptr) {
+                block_->markDirty();
+            }
+        }
+    }
+
+    void Sector::mark_clean() noexcept {
+        dirty_ = false;
     }
 
     const void *Sector::read_ptr(u32 offset) noexcept {
         assert(offset < sec_sz_); // todo: remove the assert and wrap the result with std::optional
-        return &value_[offset];
+        return &buf_[offset];
     }
 
     void *Sector::write_ptr(u32 offset) noexcept {
         assert(offset < sec_sz_);
-        dirty_ = true;
-        return &value_[offset];
+        mark_dirty();
+        return &buf_[offset];
     }
 
     void Sector::sync() noexcept {
         if (dirty_) {
-            device_.writeSectorValue(sec_num_, &value_[0]);
+            device_.writeSectorValue(sec_num_, buf_);
             dirty_ = false;
         }
     }
@@ -48,93 +113,1803 @@ namespace device {
         sync();
     }
 
+    /**
+     * AlignedBufferPool
+     * */
+    AlignedBufferPool::AlignedBufferPool(u32 buf_sz, u32 alignment) noexcept
+            : buf_sz_{buf_sz}, alignment_{alignment} {}
+
+    AlignedBufferPool::Buffer AlignedBufferPool::acquire() noexcept {
+        u8 *buf = nullptr;
+        {
+            std::lock_guard<std::mutex> guard(mutex_);
+            if (!free_bufs_.empty()) {
+                buf = free_bufs_.back();
+                free_bufs_.pop_back();
+            }
+        }
+        if (buf == nullptr) {
+            int ret = posix_memalign((void **) &buf, alignment_, buf_sz_);
+            assert(ret == 0);
+        }
+
+        return Buffer(buf, Releaser{this});
+    }
+
+    void AlignedBufferPool::release(u8 *buf) noexcept {
+        std::lock_guard<std::mutex> guard(mutex_);
+        free_bufs_.push_back(buf);
+    }
+
+    AlignedBufferPool::~AlignedBufferPool() noexcept {
+        for (u8 *buf: free_bufs_) {
+            free(buf);
+        }
+    }
+
     /**
      * LinuxFileDriver
      * */
-    LinuxFileDriver::LinuxFileDriver(std::string file_path, u32 sec_sz) noexcept
-            : file_path_{std::move(file_path)}, sec_sz_{sec_sz} {
-        int fd = open(file_path_.c_str(), O_RDONLY);
-        assert(fd > 0);
+    LinuxFileDriver::LinuxFileDriver(std::string file_path, u32 sec_sz, bool direct_io) noexcept
+            : file_path_{std::move(file_path)}, sec_sz_{sec_sz}, logical_blk_sz_{sec_sz}, physical_blk_sz_{sec_sz} {
+        fd_ = open(file_path_.c_str(), O_RDWR);
+        assert(fd_ >= 0);
 
         // get device size
         struct stat stat_buf{};
-        assert(fstat(fd, &stat_buf) == 0);
+        assert(fstat(fd_, &stat_buf) == 0);
         if (stat_buf.st_mode & S_IFREG) {
             device_sz_ = stat_buf.st_size;
+            mapHoles();
         } else if (stat_buf.st_mode & S_IFBLK) {
-            assert(ioctl(fd, BLKGETSIZE64, &device_sz_) == 0);
+            blk_dev_ = true;
+            assert(ioctl(fd_, BLKGETSIZE64, &device_sz_) == 0);
+            int logical_blk_sz = 0;
+            unsigned int physical_blk_sz = 0;
+            bool blk_sz_known = ioctl(fd_, BLKSSZGET, &logical_blk_sz) == 0 &&
+                                ioctl(fd_, BLKPBSZGET, &physical_blk_sz) == 0 && logical_blk_sz > 0;
+            if (blk_sz_known) {
+                logical_blk_sz_ = logical_blk_sz;
+                physical_blk_sz_ = std::max(physical_blk_sz, (unsigned int) logical_blk_sz);
+            }
+
+            // without the block sizes the alignment of O_DIRECT is unknown, so the device stays buffered.
+            if (direct_io && blk_sz_known && fcntl(fd_, F_SETFL, fcntl(fd_, F_GETFL) | O_DIRECT) == 0) {
+                // the bounce buffer must hold the sectors of a batch together with the partial blocks around them
+                u32 max_io_sz = MAX_BATCH_SECTOR_NUM * sec_sz_ + 2 * physical_blk_sz_;
+                u32 buf_sz = (max_io_sz + physical_blk_sz_ - 1) / physical_blk_sz_ * physical_blk_sz_;
+                buf_pool_ = std::make_unique<AlignedBufferPool>(buf_sz, physical_blk_sz_);
+            }
         } else { // doesn't allow other device.
             assert(false);
         }
-
-        close(fd);
     }
 
     std::optional<std::shared_ptr<Sector>> LinuxFileDriver::readSector(u32 sec_num) noexcept {
-        if ((sec_num + 1) * sec_sz_ > device_sz_) {
+        if (isOutOfBound(sec_num, 1)) {
             return std::nullopt;
         }
 
-        int fd = open(file_path_.c_str(), O_RDONLY);
-        assert(fd > 0);
-        off_t offset = lseek(fd, sec_num * sec_sz_, SEEK_SET);
-        assert(offset == sec_num * sec_sz_);
         std::shared_ptr<Sector> sector = std::make_shared<Sector>(sec_num, sec_sz_, *this);
-        ssize_t cnt = read(fd, (char *) sector->read_ptr(0), sec_sz_);
-        assert(cnt == sec_sz_);
-        assert(close(fd) == 0);
+        readValues(sec_num, {(u8 *) sector->read_ptr(0)});
         return {sector};
     }
 
     bool LinuxFileDriver::writeSectorValue(u32 sec_num, const u8 *buf) noexcept {
-        if ((sec_num + 1) * sec_sz_ > device_sz_) {
+        if (isOutOfBound(sec_num, 1)) {
             return false;
         }
 
-        int fd = open(file_path_.c_str(), O_WRONLY);
-        assert(fd > 0);
-        off_t offset = lseek(fd, sec_num * sec_sz_, SEEK_SET);
-        assert(offset == sec_num * sec_sz_);
-        ssize_t cnt = write(fd, buf, sec_sz_);
-        assert(cnt == sec_sz_);
-        assert(close(fd) == 0);
+        writeValues(sec_num, {buf});
+        return true;
+    }
 
+    std::optional<std::vector<std::shared_ptr<Sector>>> LinuxFileDriver::readSectors(u32 sec_num, u32 cnt) noexcept {
+        if (isOutOfBound(sec_num, cnt)) {
+            return std::nullopt;
+        }
+
+        std::vector<std::shared_ptr<Sector>> sectors;
+        std::vector<u8 *> bufs;
+        sectors.reserve(cnt);
+        bufs.reserve(cnt);
+        for (u32 i = sec_num; i < sec_num + cnt; i++) {
+            sectors.push_back(std::make_shared<Sector>(i, sec_sz_, *this));
+            bufs.push_back((u8 *) sectors.back()->read_ptr(0));
+        }
+        readValues(sec_num, bufs);
+        return {std::move(sectors)};
+    }
+
+    bool LinuxFileDriver::writeSectors(u32 sec_num, const std::vector<const u8 *> &bufs) noexcept {
+        if (isOutOfBound(sec_num, bufs.size())) {
+            return false;
+        }
+
+        writeValues(sec_num, bufs);
+        return true;
+    }
+
+    bool LinuxFileDriver::readSectorsValue(u32 sec_num, const std::vector<u8 *> &bufs) noexcept {
+        if (isOutOfBound(sec_num, bufs.size())) {
+            return false;
+        }
+
+        readValues(sec_num, bufs);
         return true;
     }
 
+    void LinuxFileDriver::readValues(u32 sec_num, const std::vector<u8 *> &bufs) noexcept {
+        util::LatencyTimer timer(io_stats_.read_latency);
+        io_stats_.read_cnt++;
+        io_stats_.read_bytes += (u64) bufs.size() * sec_sz_;
+        if (isHole(sec_num, bufs.size())) {
+            for (auto buf: bufs) {
+                memset(buf, 0, sec_sz_);
+            }
+            return;
+        }
+        if (isDirectIO()) {
+            directReadValues(sec_num, bufs);
+            return;
+        }
+
+        u32 cnt = bufs.size();
+        std::vector<iovec> iov(std::min(cnt, (u32) IOV_MAX));
+        for (u32 done = 0; done < cnt;) { // a single preadv accepts at most IOV_MAX buffers
+            u32 batch = std::min(cnt - done, (u32) IOV_MAX);
+            for (u32 i = 0; i < batch; i++) {
+                iov[i] = {bufs[done + i], sec_sz_};
+            }
+            ssize_t rd_sz = preadv(fd_, &iov[0], (int) batch, (off_t) (sec_num + done) * sec_sz_);
+            io_stats_.syscall_cnt++;
+            assert(rd_sz == (ssize_t) batch * sec_sz_);
+            done += batch;
+        }
+    }
+
+    void LinuxFileDriver::writeValues(u32 sec_num, const std::vector<const u8 *> &bufs) noexcept {
+        util::LatencyTimer timer(io_stats_.write_latency);
+        io_stats_.write_cnt++;
+        io_stats_.written_bytes += (u64) bufs.size() * sec_sz_;
+        fillHoles(sec_num, bufs.size());
+        if (isDirectIO()) {
+            directWriteValues(sec_num, bufs);
+            return;
+        }
+
+        u32 cnt = bufs.size();
+        std::vector<iovec> iov(std::min(cnt, (u32) IOV_MAX));
+        for (u32 done = 0; done < cnt;) {
+            u32 batch = std::min(cnt - done, (u32) IOV_MAX);
+            for (u32 i = 0; i < batch; i++) {
+                iov[i] = {(void *) bufs[done + i], sec_sz_};
+            }
+            ssize_t wrt_sz = pwritev(fd_, &iov[0], (int) batch, (off_t) (sec_num + done) * sec_sz_);
+            io_stats_.syscall_cnt++;
+            assert(wrt_sz == (ssize_t) batch * sec_sz_);
+            done += batch;
+        }
+    }
+
+    void LinuxFileDriver::directReadValues(u32 sec_num, const std::vector<u8 *> &bufs) noexcept {
+        auto bounce = buf_pool_->acquire();
+        u32 max_sec_cnt = (buf_pool_->bufSz() - 2 * physical_blk_sz_) / sec_sz_;
+        for (u32 done = 0; done < bufs.size();) {
+            u32 batch = std::min((u32) bufs.size() - done, max_sec_cnt);
+            u64 start = (u64) (sec_num + done) * sec_sz_;
+            u64 end = start + (u64) batch * sec_sz_;
+            u64 aligned_start = start / logical_blk_sz_ * logical_blk_sz_;
+            u64 aligned_end = (end + logical_blk_sz_ - 1) / logical_blk_sz_ * logical_blk_sz_;
+
+            ssize_t rd_sz = pread(fd_, bounce.get(), aligned_end - aligned_start, (off_t) aligned_start);
+            io_stats_.syscall_cnt++;
+            assert(rd_sz == (ssize_t) (aligned_end - aligned_start));
+            for (u32 i = 0; i < batch; i++) {
+                memcpy(bufs[done + i], bounce.get() + (start - aligned_start) + (u64) i * sec_sz_, sec_sz_);
+            }
+            done += batch;
+        }
+    }
+
+    void LinuxFileDriver::directWriteValues(u32 sec_num, const std::vector<const u8 *> &bufs) noexcept {
+        auto bounce = buf_pool_->acquire();
+        u32 max_sec_cnt = (buf_pool_->bufSz() - 2 * physical_blk_sz_) / sec_sz_;
+        for (u32 done = 0; done < bufs.size();) {
+            u32 batch = std::min((u32) bufs.size() - done, max_sec_cnt);
+            u64 start = (u64) (sec_num + done) * sec_sz_;
+            u64 end = start + (u64) batch * sec_sz_;
+            u64 aligned_start = start / logical_blk_sz_ * logical_blk_sz_;
+            u64 aligned_end = (end + logical_blk_sz_ - 1) / logical_blk_sz_ * logical_blk_sz_;
+
+            // read-modify-write the logical blocks which are partially covered
+            if (aligned_start != start) {
+                ssize_t rd_sz = pread(fd_, bounce.get(), logical_blk_sz_, (off_t) aligned_start);
+                io_stats_.syscall_cnt++;
+                assert(rd_sz == logical_blk_sz_);
+            }
+            if (aligned_end != end && (aligned_start == start || aligned_end - aligned_start > logical_blk_sz_)) {
+                u64 lst_blk = aligned_end - logical_blk_sz_;
+                ssize_t rd_sz = pread(fd_, bounce.get() + (lst_blk - aligned_start), logical_blk_sz_, (off_t) lst_blk);
+                io_stats_.syscall_cnt++;
+                assert(rd_sz == logical_blk_sz_);
+            }
+            for (u32 i = 0; i < batch; i++) {
+                memcpy(bounce.get() + (start - aligned_start) + (u64) i * sec_sz_, bufs[done + i], sec_sz_);
+            }
+            ssize_t wrt_sz = pwrite(fd_, bounce.get(), aligned_end - aligned_start, (off_t) aligned_start);
+            io_stats_.syscall_cnt++;
+            assert(wrt_sz == (ssize_t) (aligned_end - aligned_start));
+            done += batch;
+        }
+    }
+
+    bool LinuxFileDriver::discardSectors(u32 sec_num, u32 cnt) noexcept {
+        if (isOutOfBound(sec_num, cnt)) {
+            return false;
+        }
+
+        u64 start = ((u64) sec_num * sec_sz_ + logical_blk_sz_ - 1) / logical_blk_sz_ * logical_blk_sz_;
+        u64 end = ((u64) sec_num + cnt) * sec_sz_ / logical_blk_sz_ * logical_blk_sz_;
+        if (start >= end) {
+            return true;
+        }
+        int ret;
+        if (blk_dev_) {
+            u64 range[2] = {start, end - start};
+            ret = ioctl(fd_, BLKDISCARD, range);
+        } else {
+            ret = fallocate(fd_, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, (off_t) start, (off_t) (end - start));
+        }
+        io_stats_.syscall_cnt++;
+        if (ret != 0) {
+            return false;
+        }
+        io_stats_.discard_cnt++;
+        io_stats_.discarded_bytes += end - start;
+        addHoles(start, end);
+        return true;
+    }
+
+    bool LinuxFileDriver::zeroSectors(u32 sec_num, u32 cnt) noexcept {
+        if (isOutOfBound(sec_num, cnt)) {
+            return false;
+        }
+
+        u64 start = ((u64) sec_num * sec_sz_ + logical_blk_sz_ - 1) / logical_blk_sz_ * logical_blk_sz_;
+        u64 end = ((u64) sec_num + cnt) * sec_sz_ / logical_blk_sz_ * logical_blk_sz_;
+        if (start >= end) { // no whole logical block for the device to zero
+            return false;
+        }
+        int ret;
+        if (blk_dev_) {
+            u64 range[2] = {start, end - start};
+            ret = ioctl(fd_, BLKZEROOUT, range);
+        } else {
+            ret = fallocate(fd_, FALLOC_FL_ZERO_RANGE | FALLOC_FL_KEEP_SIZE, (off_t) start, (off_t) (end - start));
+        }
+        io_stats_.syscall_cnt++;
+        if (ret != 0) {
+            return false;
+        }
+        io_stats_.zero_cnt++;
+        io_stats_.zeroed_bytes += end - start;
+        addHoles(start, end);
+
+        // write the partial logical blocks at both ends with zeros
+        std::vector<u8> zero(sec_sz_, 0);
+        for (auto [run_start, run_end]: {std::pair(sec_num, (u32) (start / sec_sz_)),
+                                         std::pair((u32) (end / sec_sz_), sec_num + cnt)}) {
+            if (run_start < run_end) {
+                writeValues(run_start, std::vector<const u8 *>(run_end - run_start, &zero[0]));
+            }
+        }
+        return true;
+    }
+
+    bool LinuxFileDriver::isHole(u32 sec_num, u32 cnt) noexcept {
+        if (hole_sec_cnt_ == 0) {
+            return false;
+        }
+        std::lock_guard<std::mutex> guard(holes_mutex_);
+        if (!holes_.contains(sec_num, sec_num + cnt)) {
+            return false;
+        }
+        io_stats_.hole_read_cnt++;
+        return true;
+    }
+
+    void LinuxFileDriver::fillHoles(u32 sec_num, u32 cnt) noexcept {
+        if (hole_sec_cnt_ == 0) {
+            return;
+        }
+        // the holes are filled before the write, so that a read after the write never takes them
+        std::lock_guard<std::mutex> guard(holes_mutex_);
+        holes_.remove(sec_num, sec_num + cnt);
+        hole_sec_cnt_ = holes_.size();
+    }
+
+    void LinuxFileDriver::addHoles(u64 start, u64 end) noexcept {
+        std::lock_guard<std::mutex> guard(holes_mutex_);
+        if (map_holes_) {
+            holes_.add((start + sec_sz_ - 1) / sec_sz_, end / sec_sz_);
+            hole_sec_cnt_ = holes_.size();
+        }
+    }
+
+    void LinuxFileDriver::forgetHoles() noexcept {
+        std::lock_guard<std::mutex> guard(holes_mutex_);
+        map_holes_ = false;
+        holes_ = util::RangeSet();
+        hole_sec_cnt_ = 0;
+    }
+
+    void LinuxFileDriver::mapHoles() noexcept {
+        std::lock_guard<std::mutex> guard(holes_mutex_);
+        off_t data = 0;
+        while ((u64) data < device_sz_) {
+            off_t hole = lseek(fd_, data, SEEK_HOLE); // the end of file counts as a hole
+            if (hole < 0 || (u64) hole >= device_sz_) {
+                break;
+            }
+            data = lseek(fd_, hole, SEEK_DATA);
+            if (data < 0) { // no data after the hole
+                data = (off_t) device_sz_;
+            }
+            holes_.add(((u64) hole + sec_sz_ - 1) / sec_sz_, (u64) data / sec_sz_);
+        }
+        hole_sec_cnt_ = holes_.size();
+        map_holes_ = true;
+    }
+
+    void LinuxFileDriver::dumpStats(FILE *out) const noexcept {
+        fprintf(out, "%s: %llu reads(%llu bytes, %llu from holes), %llu writes(%llu bytes), "
+                     "%llu discards(%llu bytes), %llu zero-outs(%llu bytes), %llu system calls\n", file_path_.c_str(),
+                (u64) io_stats_.read_cnt, (u64) io_stats_.read_bytes, (u64) io_stats_.hole_read_cnt,
+                (u64) io_stats_.write_cnt, (u64) io_stats_.written_bytes, (u64) io_stats_.discard_cnt,
+                (u64) io_stats_.discarded_bytes, (u64) io_stats_.zero_cnt, (u64) io_stats_.zeroed_bytes,
+                (u64) io_stats_.syscall_cnt);
+        fprintf(out, "  read latency: %s\n", io_stats_.read_latency.toString().c_str());
+        fprintf(out, "  write latency: %s\n", io_stats_.write_latency.toString().c_str());
+    }
+
+    LinuxFileDriver::~LinuxFileDriver() noexcept {
+        close(fd_);
+    }
+
     /**
-     * CacheManger
+     * MmapFileDriver
      * */
-    CacheManager::CacheManager(std::shared_ptr<Device> device, u32 cache_sz) noexcept
-            : inner_device_{std::move(device)}, sector_cache_(cache_sz) {}
+    MmapFileDriver::MmapFileDriver(std::string file_path, u32 sec_sz) noexcept
+            : LinuxFileDriver(std::move(file_path), sec_sz) {
+        if (blk_dev_ || device_sz_ == 0) { // only a regular file is mapped, as classified by `LinuxFileDriver`
+            return;
+        }
 
-    std::optional<std::shared_ptr<Sector>> CacheManager::readSector(u32 sec_num) noexcept {
-        auto result = sector_cache_.get(sec_num);
-        if (result.has_value()) {
-            return {result.value()};
+        void *addr = mmap(nullptr, device_sz_, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+        if (addr != MAP_FAILED) {
+            map_ = (u8 *) addr;
+            forgetHoles(); // the writes through the mapping don't fill the holes, and reading a hole costs nothing
         }
+    }
 
-        result = inner_device_->readSector(sec_num);
-        if (result.has_value()) {
-            auto sector = result.value();
-            sector->modify_device(*this);
-            sector_cache_.put(sec_num, sector);
-            return sector;
+    std::optional<std::shared_ptr<Sector>> MmapFileDriver::readSector(u32 sec_num) noexcept {
+        if (!isMapped()) {
+            return LinuxFileDriver::readSector(sec_num);
+        }
+        if (isOutOfBound(sec_num, 1)) {
+            return std::nullopt;
+        }
+
+        return {std::make_shared<Sector>(sec_num, sec_sz_, *this, map_ + (u64) sec_num * sec_sz_)};
+    }
+
+    bool MmapFileDriver::writeSectorValue(u32 sec_num, const u8 *buf) noexcept {
+        if (!isMapped()) {
+            return LinuxFileDriver::writeSectorValue(sec_num, buf);
+        }
+        if (isOutOfBound(sec_num, 1)) {
+            return false;
+        }
+
+        util::LatencyTimer timer(io_stats_.write_latency);
+        io_stats_.write_cnt++;
+        io_stats_.written_bytes += sec_sz_;
+        u8 *dst = map_ + (u64) sec_num * sec_sz_;
+        if (dst != buf) { // views of the mapping are already written in place
+            memcpy(dst, buf, sec_sz_);
+        }
+        markDirty(sec_num, 1);
+        return true;
+    }
+
+    std::optional<std::vector<std::shared_ptr<Sector>>> MmapFileDriver::readSectors(u32 sec_num, u32 cnt) noexcept {
+        if (!isMapped()) {
+            return LinuxFileDriver::readSectors(sec_num, cnt);
+        }
+        if (isOutOfBound(sec_num, cnt)) {
+            return std::nullopt;
+        }
+
+        std::vector<std::shared_ptr<Sector>> sectors;
+        sectors.reserve(cnt);
+        for (u32 i = sec_num; i < sec_num + cnt; i++) {
+            sectors.push_back(std::make_shared<Sector>(i, sec_sz_, *this, map_ + (u64) i * sec_sz_));
+        }
+        return {std::move(sectors)};
+    }
+
+    bool MmapFileDriver::readSectorsValue(u32 sec_num, const std::vector<u8 *> &bufs) noexcept {
+        if (!isMapped()) {
+            return LinuxFileDriver::readSectorsValue(sec_num, bufs);
+        }
+        if (isOutOfBound(sec_num, bufs.size())) {
+            return false;
+        }
+
+        util::LatencyTimer timer(io_stats_.read_latency);
+        io_stats_.read_cnt++;
+        io_stats_.read_bytes += (u64) bufs.size() * sec_sz_;
+        for (u32 i = 0; i < bufs.size(); i++) {
+            memcpy(bufs[i], map_ + (u64) (sec_num + i) * sec_sz_, sec_sz_);
+        }
+        return true;
+    }
+
+    bool MmapFileDriver::writeSectors(u32 sec_num, const std::vector<const u8 *> &bufs) noexcept {
+        if (!isMapped()) {
+            return LinuxFileDriver::writeSectors(sec_num, bufs);
+        }
+        if (isOutOfBound(sec_num, bufs.size())) {
+            return false;
+        }
+
+        util::LatencyTimer timer(io_stats_.write_latency);
+        io_stats_.write_cnt++;
+        io_stats_.written_bytes += (u64) bufs.size() * sec_sz_;
+        for (u32 i = 0; i < bufs.size(); i++) {
+            u8 *dst = map_ + (u64) (sec_num + i) * sec_sz_;
+            if (dst != bufs[i]) {
+                memcpy(dst, bufs[i], sec_sz_);
+            }
+        }
+        markDirty(sec_num, bufs.size());
+        return true;
+    }
+
+    void MmapFileDriver::markDirty(u32 sec_num, u32 cnt) noexcept {
+        std::lock_guard<std::mutex> guard(dirty_mutex_);
+        u32 start = sec_num, end = sec_num + cnt;
+        auto it = dirty_runs_.upper_bound(start);
+        if (it != dirty_runs_.begin() && std::prev(it)->second >= start) { // merge with the previous run
+            it--;
+            start = it->first;
+            end = std::max(end, it->second);
+            it = dirty_runs_.erase(it);
+        }
+        while (it != dirty_runs_.end() && it->first <= end) { // merge with the following runs
+            end = std::max(end, it->second);
+            it = dirty_runs_.erase(it);
+        }
+        dirty_runs_[start] = end;
+    }
+
+    void MmapFileDriver::flush() noexcept {
+        if (!isMapped()) {
+            return;
+        }
+
+        std::map<u32, u32> dirty_runs;
+        {
+            std::lock_guard<std::mutex> guard(dirty_mutex_);
+            dirty_runs.swap(dirty_runs_);
+        }
+        u64 page_sz = sysconf(_SC_PAGESIZE);
+        for (const auto &run: dirty_runs) {
+            u64 start = (u64) run.first * sec_sz_ / page_sz * page_sz; // msync requires a page aligned address
+            u64 end = (u64) run.second * sec_sz_;
+            // out of the assert, which is compiled away with NDEBUG, as it's what makes the writes durable
+            int ret = msync(map_ + start, end - start, MS_SYNC);
+            assert(ret == 0);
+            io_stats_.syscall_cnt++;
+        }
+    }
+
+    void MmapFileDriver::clear() noexcept {
+        flush();
+    }
+
+    MmapFileDriver::~MmapFileDriver() noexcept {
+        if (isMapped()) {
+            clear();
+            munmap(map_, device_sz_);
+        }
+    }
+
+    /**
+     * UringFileDriver
+     * */
+#ifdef HAVE_IO_URING
+    struct UringFileDriver::Ring {
+        int fd = -1;
+        u32 sq_entries = 0;
+        void *sq_ptr = MAP_FAILED, *cq_ptr = MAP_FAILED, *sqes_ptr = MAP_FAILED;
+        size_t sq_sz = 0, cq_sz = 0, sqes_sz = 0;
+        u32 *sq_tail = nullptr, *sq_mask = nullptr, *sq_array = nullptr;
+        u32 *cq_head = nullptr, *cq_tail = nullptr, *cq_mask = nullptr;
+        io_uring_sqe *sqes = nullptr;
+        io_uring_cqe *cqes = nullptr;
+
+        ~Ring() noexcept {
+            if (sqes_ptr != MAP_FAILED) {
+                munmap(sqes_ptr, sqes_sz);
+            }
+            if (cq_ptr != MAP_FAILED && cq_ptr != sq_ptr) {
+                munmap(cq_ptr, cq_sz);
+            }
+            if (sq_ptr != MAP_FAILED) {
+                munmap(sq_ptr, sq_sz);
+            }
+            if (fd >= 0) {
+                close(fd);
+            }
+        }
+    };
+
+    std::unique_ptr<UringFileDriver::Ring> UringFileDriver::setupRing(u32 queue_depth) noexcept {
+        io_uring_params params{};
+        int fd = (int) syscall(__NR_io_uring_setup, queue_depth, &params);
+        if (fd < 0) {
+            return nullptr;
+        }
+
+        auto ring = std::make_unique<UringFileDriver::Ring>();
+        ring->fd = fd;
+        ring->sq_entries = params.sq_entries;
+        ring->sq_sz = params.sq_off.array + params.sq_entries * sizeof(u32);
+        ring->cq_sz = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+        if (single_mmap) {
+            ring->sq_sz = ring->cq_sz = std::max(ring->sq_sz, ring->cq_sz);
+        }
+        ring->sq_ptr = mmap(nullptr, ring->sq_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                            fd, IORING_OFF_SQ_RING);
+        if (ring->sq_ptr == MAP_FAILED) {
+            return nullptr;
+        }
+        ring->cq_ptr = single_mmap ? ring->sq_ptr : mmap(nullptr, ring->cq_sz, PROT_READ | PROT_WRITE,
+                                                         MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ptr == MAP_FAILED) {
+            return nullptr;
+        }
+        ring->sqes_sz = params.sq_entries * sizeof(io_uring_sqe);
+        ring->sqes_ptr = mmap(nullptr, ring->sqes_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                              fd, IORING_OFF_SQES);
+        if (ring->sqes_ptr == MAP_FAILED) {
+            return nullptr;
+        }
+
+        auto *sq = (u8 *) ring->sq_ptr;
+        auto *cq = (u8 *) ring->cq_ptr;
+        ring->sq_tail = (u32 *) (sq + params.sq_off.tail);
+        ring->sq_mask = (u32 *) (sq + params.sq_off.ring_mask);
+        ring->sq_array = (u32 *) (sq + params.sq_off.array);
+        ring->cq_head = (u32 *) (cq + params.cq_off.head);
+        ring->cq_tail = (u32 *) (cq + params.cq_off.tail);
+        ring->cq_mask = (u32 *) (cq + params.cq_off.ring_mask);
+        ring->sqes = (io_uring_sqe *) ring->sqes_ptr;
+        ring->cqes = (io_uring_cqe *) (cq + params.cq_off.cqes);
+        return ring;
+    }
+#else
+    struct UringFileDriver::Ring {
+    };
+
+    std::unique_ptr<UringFileDriver::Ring> UringFileDriver::setupRing(u32 queue_depth) noexcept {
+        return nullptr;
+    }
+#endif
+
+    UringFileDriver::UringFileDriver(std::string file_path, u32 sec_sz, u32 queue_depth) noexcept
+            : LinuxFileDriver(std::move(file_path), sec_sz), queue_depth_{queue_depth} {
+        auto ring = setupRing(queue_depth);
+        uring_enabled_ = ring != nullptr;
+        if (ring != nullptr) {
+            idle_rings_.push_back(std::move(ring));
+        }
+    }
+
+    std::unique_ptr<UringFileDriver::Ring> UringFileDriver::takeRing() noexcept {
+        {
+            std::lock_guard<std::mutex> guard(ring_mutex_);
+            if (!idle_rings_.empty()) {
+                auto ring = std::move(idle_rings_.back());
+                idle_rings_.pop_back();
+                return ring;
+            }
+        }
+        return setupRing(queue_depth_);
+    }
+
+    void UringFileDriver::putRing(std::unique_ptr<Ring> ring) noexcept {
+        std::lock_guard<std::mutex> guard(ring_mutex_);
+        idle_rings_.push_back(std::move(ring));
+    }
+
+    std::optional<std::vector<std::shared_ptr<Sector>>> UringFileDriver::readSectors(u32 sec_num, u32 cnt) noexcept {
+        if (!isUringEnabled()) {
+            return LinuxFileDriver::readSectors(sec_num, cnt);
+        }
+        if (isOutOfBound(sec_num, cnt)) {
+            return std::nullopt;
+        }
+
+        std::vector<std::shared_ptr<Sector>> sectors;
+        std::vector<iovec> iov(cnt);
+        sectors.reserve(cnt);
+        for (u32 i = 0; i < cnt; i++) {
+            sectors.push_back(std::make_shared<Sector>(sec_num + i, sec_sz_, *this));
+            iov[i] = {(void *) sectors.back()->read_ptr(0), sec_sz_};
+        }
+        submitAndWait(false, sec_num, iov);
+        return {std::move(sectors)};
+    }
+
+    bool UringFileDriver::writeSectors(u32 sec_num, const std::vector<const u8 *> &bufs) noexcept {
+        if (!isUringEnabled()) {
+            return LinuxFileDriver::writeSectors(sec_num, bufs);
+        }
+        if (isOutOfBound(sec_num, bufs.size())) {
+            return false;
+        }
+
+        std::vector<iovec> iov(bufs.size());
+        for (u32 i = 0; i < bufs.size(); i++) {
+            iov[i] = {(void *) bufs[i], sec_sz_};
+        }
+        submitAndWait(true, sec_num, iov);
+        return true;
+    }
+
+    bool UringFileDriver::readSectorsValue(u32 sec_num, const std::vector<u8 *> &bufs) noexcept {
+        if (!isUringEnabled()) {
+            return LinuxFileDriver::readSectorsValue(sec_num, bufs);
+        }
+        if (isOutOfBound(sec_num, bufs.size())) {
+            return false;
+        }
+
+        std::vector<iovec> iov(bufs.size());
+        for (u32 i = 0; i < bufs.size(); i++) {
+            iov[i] = {bufs[i], sec_sz_};
+        }
+        submitAndWait(false, sec_num, iov);
+        return true;
+    }
+
+    void UringFileDriver::submitAndWait(bool is_write, u32 sec_num, std::vector<iovec> &iov) noexcept {
+#ifdef HAVE_IO_URING
+        util::LatencyTimer timer(is_write ? io_stats_.write_latency : io_stats_.read_latency);
+        (is_write ? io_stats_.write_cnt : io_stats_.read_cnt)++;
+        (is_write ? io_stats_.written_bytes : io_stats_.read_bytes) += (u64) iov.size() * sec_sz_;
+        if (is_write) {
+            fillHoles(sec_num, iov.size());
+        } else if (isHole(sec_num, iov.size())) {
+            for (auto &vec: iov) {
+                memset(vec.iov_base, 0, vec.iov_len);
+            }
+            return;
+        }
+        u32 cnt = iov.size();
+        std::unique_ptr<Ring> ring = takeRing();
+        if (ring == nullptr) { // no ring for one more thread, do it synchronously
+            for (u32 i = 0; i < cnt; i += URING_REQUEST_SECTOR_NUM) {
+                redoRequest(is_write, sec_num, iov, i, std::min(cnt - i, (u32) URING_REQUEST_SECTOR_NUM));
+            }
+            return;
+        }
+        for (u32 submitted = 0; submitted < cnt;) {
+            // fill the submission queue with as many requests as possible
+            u32 tail = *ring->sq_tail;
+            u32 req_cnt = 0;
+            u32 batch_start = submitted;
+            for (; req_cnt < ring->sq_entries && submitted < cnt; req_cnt++, tail++) {
+                u32 req_sec_cnt = std::min(cnt - submitted, (u32) URING_REQUEST_SECTOR_NUM);
+                u32 index = tail & *ring->sq_mask;
+                io_uring_sqe *sqe = &ring->sqes[index];
+                memset(sqe, 0, sizeof(io_uring_sqe));
+                sqe->opcode = is_write ? IORING_OP_WRITEV : IORING_OP_READV;
+                sqe->fd = fd_;
+                sqe->addr = (u64) &iov[submitted];
+                sqe->len = req_sec_cnt;
+                sqe->off = (u64) (sec_num + submitted) * sec_sz_;
+                sqe->user_data = ((u64) submitted << 32) | req_sec_cnt;
+                ring->sq_array[index] = index;
+                submitted += req_sec_cnt;
+            }
+            __atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+
+            // submit them with a single system call and wait for all the completions
+            int ret;
+            do {
+                ret = (int) syscall(__NR_io_uring_enter, ring->fd, req_cnt, req_cnt, IORING_ENTER_GETEVENTS,
+                                    nullptr, 0);
+                io_stats_.syscall_cnt++;
+            } while (ret < 0 && errno == EINTR);
+            u32 enter_cnt = ret < 0 ? 0 : std::min((u32) ret, req_cnt);
+            if (enter_cnt < req_cnt) {
+                // the requests not taken by the kernel are taken back from the queue, and done synchronously
+                __atomic_store_n(ring->sq_tail, tail - (req_cnt - enter_cnt), __ATOMIC_RELEASE);
+                u32 req_start = batch_start + enter_cnt * URING_REQUEST_SECTOR_NUM;
+                for (; req_start < submitted; req_start += URING_REQUEST_SECTOR_NUM) {
+                    redoRequest(is_write, sec_num, iov, req_start,
+                                std::min(submitted - req_start, (u32) URING_REQUEST_SECTOR_NUM));
+                }
+            }
+
+            u32 head = *ring->cq_head;
+            for (u32 reaped = 0; reaped < enter_cnt; reaped++, head++) {
+                while (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+                    // interrupted before all the completions were posted, wait for the rest
+                    syscall(__NR_io_uring_enter, ring->fd, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+                    io_stats_.syscall_cnt++;
+                }
+                io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+                u32 req_start = cqe->user_data >> 32;
+                u32 req_sec_cnt = cqe->user_data & 0xffffffff;
+                if (cqe->res != (int) (req_sec_cnt * sec_sz_)) { // short or failed request, redo it synchronously
+                    redoRequest(is_write, sec_num, iov, req_start, req_sec_cnt);
+                }
+            }
+            __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+        }
+        putRing(std::move(ring));
+#endif
+    }
+
+    void UringFileDriver::redoRequest(bool is_write, u32 sec_num, std::vector<iovec> &iov, u32 req_start,
+                                      u32 req_sec_cnt) noexcept {
+        off_t offset = (off_t) (sec_num + req_start) * sec_sz_;
+        ssize_t sz = is_write ? pwritev(fd_, &iov[req_start], (int) req_sec_cnt, offset)
+                              : preadv(fd_, &iov[req_start], (int) req_sec_cnt, offset);
+        io_stats_.syscall_cnt++;
+        assert(sz == (ssize_t) req_sec_cnt * sec_sz_);
+    }
+
+    UringFileDriver::~UringFileDriver() noexcept = default;
+
+    /**
+     * CacheBlock
+     * */
+    CacheBlock::CacheBlock(u32 fst_sec, u32 sec_cnt, u32 sec_sz, u8 *value,
+                           std::shared_ptr<util::SlabArena> value_arena, const SectorAllocator &sector_alloc,
+                           CacheManager &manager) noexcept
+            : fst_sec_{fst_sec}, sec_sz_{sec_sz}, value_{value}, value_arena_{std::move(value_arena)},
+              sectors_(sector_alloc), manager_{manager} {
+        sectors_.reserve(sec_cnt); // never reallocate, sectors are referred by the users of block
+        for (u32 i = 0; i < sec_cnt; i++) {
+            sectors_.emplace_back(fst_sec_ + i, sec_sz_, manager_, value_ + (u64) i * sec_sz_, this);
+        }
+    }
+
+    void CacheBlock::markDirty() noexcept {
+        manager_.markDirty(*this);
+    }
+
+    void CacheBlock::update(u32 sec_num, const u8 *buf) noexcept {
+        u32 i = sec_num - fst_sec_;
+        assert(i < sectors_.size());
+        u8 *dst = value_ + (u64) i * sec_sz_;
+        if (dst != buf) { // the sector may be written back by itself
+            memcpy(dst, buf, sec_sz_);
+        }
+        sectors_[i].mark_clean();
+    }
+
+    void CacheBlock::takeDirty(std::vector<u8> &values, std::vector<std::pair<u32, u32>> &runs) noexcept {
+        for (u32 i = 0; i < sectors_.size();) {
+            if (!sectors_[i].is_dirty()) {
+                i++;
+                continue;
+            }
+            u32 run_start = i;
+            for (; i < sectors_.size() && sectors_[i].is_dirty(); i++) {
+                sectors_[i].mark_clean();
+            }
+            values.insert(values.end(), value_ + (u64) run_start * sec_sz_, value_ + (u64) i * sec_sz_);
+            runs.emplace_back(fst_sec_ + run_start, i - run_start);
+        }
+    }
+
+    void CacheBlock::sync() noexcept {
+        for (u32 i = 0; i < sectors_.size();) {
+            if (!sectors_[i].is_dirty()) {
+                i++;
+                continue;
+            }
+            std::vector<const u8 *> bufs;
+            u32 run_start = i;
+            for (; i < sectors_.size() && sectors_[i].is_dirty(); i++) {
+                bufs.push_back(value_ + (u64) i * sec_sz_);
+            }
+            manager_.writeSectors(fst_sec_ + run_start, bufs);
+        }
+    }
+
+    void CacheBlock::releaseValue(util::SlabArena &value_arena, u8 *value) noexcept {
+        if (value_arena.owns(value)) {
+            value_arena.deallocate(value);
         } else {
+            delete[] value;
+        }
+    }
+
+    CacheBlock::~CacheBlock() noexcept {
+        sync();
+        sectors_.clear();
+        releaseValue(*value_arena_, value_);
+    }
+
+    /**
+     * CacheManger
+     * */
+    static bool takeReferenced(std::shared_ptr<CacheBlock> &block) noexcept {
+        return block->takeReferenced();
+    }
+
+    CacheManager::Shard::Shard(u32 blk_cnt, util::ReplacePolicy policy) noexcept
+            : blk_cnt{blk_cnt}, block_cache(blk_cnt, policy) {
+        block_cache.setSecondChance(takeReferenced);
+        // at most half of the slots are taken, so that few blocks miss their slots
+        u32 slot_cnt = 1;
+        while (slot_cnt < 2 * blk_cnt) {
+            slot_cnt *= 2;
+        }
+        hit_slots = std::vector<std::atomic<CacheBlock *>>(slot_cnt);
+        for (auto &slot: hit_slots) {
+            slot.store(nullptr, std::memory_order_relaxed);
+        }
+    }
+
+    CacheManager::CacheManager(std::shared_ptr<Device> device, u32 cache_sz, u32 blk_sec_cnt, bool huge_page,
+                               util::ReplacePolicy policy) noexcept
+            : inner_device_{std::move(device)}, blk_sec_cnt_{blk_sec_cnt},
+              blk_cnt_{std::max(cache_sz / blk_sec_cnt, 1u)}, policy_{policy},
+              dirty_expire_{DIRTY_EXPIRE_MS}, flush_interval_{FLUSH_INTERVAL_MS} {
+        assert(blk_sec_cnt_ > 0);
+        // evicted blocks may still be in use, and a batched read holds the blocks it loads, leave room for them.
+        u32 slot_cnt = blk_cnt_ + (MAX_BATCH_SECTOR_NUM + blk_sec_cnt_ - 1) / blk_sec_cnt_ + 1;
+        value_arena_ = std::make_shared<util::SlabArena>(blk_sec_cnt_ * SECTOR_SIZE, slot_cnt, huge_page);
+        // the block shares a slot with the control block of `std::shared_ptr`, which is freed only after the
+        // weak references to the evicted block are gone, up to another `blk_cnt_` of them
+        block_arena_ = std::make_shared<util::SlabArena>(sizeof(CacheBlock) + 64, slot_cnt + blk_cnt_);
+        sector_arena_ = std::make_shared<util::SlabArena>(blk_sec_cnt_ * sizeof(Sector), slot_cnt);
+        // block `i` goes to shard `i % shard_cnt`, so the capacity is divided evenly
+        u32 shard_cnt = std::min(std::max(blk_cnt_ / CACHE_SHARD_MIN_BLOCK_NUM, 1u), (u32) CACHE_SHARD_NUM);
+        for (u32 i = 0; i < shard_cnt; i++) {
+            shards_.push_back(std::make_unique<Shard>(blk_cnt_ / shard_cnt + (i < blk_cnt_ % shard_cnt), policy_));
+        }
+        streams_.resize(READAHEAD_STREAM_NUM);
+        flusher_ = std::thread(&CacheManager::runFlusher, this);
+        readahead_thread_ = std::thread(&CacheManager::runReadahead, this);
+    }
+
+    std::optional<std::shared_ptr<Sector>> CacheManager::readSector(u32 sec_num) noexcept {
+        util::LatencyTimer timer(cache_stats_.read_latency);
+        throttle();
+        std::shared_ptr<CacheBlock> block;
+        bool ra_hit = false;
+        bool missed = getBlocks(sec_num / blk_sec_cnt_, 1, &block, ra_hit);
+        if (block == nullptr || sec_num - block->fstSec() >= block->secCnt()) {
             return std::nullopt;
         }
+        if (missed || ra_hit) {
+            readahead(sec_num, 1, missed);
+        }
+
+        // the sector shares the ownership of its block
+        return {std::shared_ptr<Sector>(block, &block->sector(sec_num - block->fstSec()))};
     }
 
     bool CacheManager::writeSectorValue(u32 sec_num, const u8 *buf) noexcept {
-        return inner_device_->writeSectorValue(sec_num, buf);
+        return writeSectors(sec_num, {buf});
+    }
+
+    std::optional<std::vector<std::shared_ptr<Sector>>> CacheManager::readSectors(u32 sec_num, u32 cnt) noexcept {
+        if (cnt == 0) {
+            return {std::vector<std::shared_ptr<Sector>>()};
+        }
+        util::LatencyTimer timer(cache_stats_.read_latency);
+        throttle();
+        u32 fst_blk = sec_num / blk_sec_cnt_;
+        u32 blk_cnt = (sec_num + cnt - 1) / blk_sec_cnt_ - fst_blk + 1;
+        std::vector<std::shared_ptr<CacheBlock>> blocks(blk_cnt);
+        bool ra_hit = false;
+        bool missed = getBlocks(fst_blk, blk_cnt, blocks.data(), ra_hit);
+
+        std::vector<std::shared_ptr<Sector>> sectors;
+        sectors.reserve(cnt);
+        for (u32 i = sec_num; i < sec_num + cnt; i++) {
+            auto &block = blocks[i / blk_sec_cnt_ - fst_blk];
+            if (block == nullptr || i - block->fstSec() >= block->secCnt()) {
+                return std::nullopt;
+            }
+            sectors.emplace_back(block, &block->sector(i - block->fstSec()));
+        }
+        if (missed || ra_hit) {
+            readahead(sec_num, cnt, missed);
+        }
+
+        return {std::move(sectors)};
+    }
+
+    bool CacheManager::writeSectors(u32 sec_num, const std::vector<const u8 *> &bufs) noexcept {
+        util::LatencyTimer timer(cache_stats_.write_latency);
+        std::lock_guard<std::mutex> flush_guard(flush_mutex_);
+        if (!inner_device_->writeSectors(sec_num, bufs)) {
+            return false;
+        }
+        if (bufs.empty()) {
+            return true;
+        }
+
+        // keep the cached copies up to date, and tell the loads in progress that they may be stale
+        u32 end_sec = sec_num + bufs.size();
+        for (u32 blk_num = sec_num / blk_sec_cnt_; blk_num <= (end_sec - 1) / blk_sec_cnt_; blk_num++) {
+            Shard &shard = shardOf(blk_num);
+            std::lock_guard<std::mutex> guard(shard.mutex);
+            shard.write_gen++;
+            auto block = findBlock(shard, blk_num);
+            if (block == nullptr) {
+                continue;
+            }
+            u32 to = std::min(end_sec, block->fstSec() + block->secCnt());
+            for (u32 i = std::max(sec_num, block->fstSec()); i < to; i++) {
+                block->update(i, bufs[i - sec_num]);
+            }
+        }
+        return true;
+    }
+
+    bool CacheManager::discardSectors(u32 sec_num, u32 cnt) noexcept {
+        // the blocks made clean are destroyed after the locks are released, since they may write by themselves
+        std::vector<std::shared_ptr<CacheBlock>> cleaned_blocks;
+        std::lock_guard<std::mutex> flush_guard(flush_mutex_);
+        u32 fst_sec = (sec_num + blk_sec_cnt_ - 1) / blk_sec_cnt_ * blk_sec_cnt_;
+        u32 end_sec = (sec_num + cnt) / blk_sec_cnt_ * blk_sec_cnt_;
+        std::vector<std::pair<u32, const CacheBlock *>> keys;
+        {
+            std::lock_guard<std::mutex> dirty_guard(dirty_mutex_);
+            for (auto it = dirty_blocks_.lower_bound({fst_sec, nullptr});
+                 it != dirty_blocks_.end() && it->first.first < end_sec; ++it) {
+                keys.push_back(it->first);
+            }
+        }
+
+        for (auto &key: keys) {
+            Shard &shard = shardOf(key.first / blk_sec_cnt_);
+            std::lock_guard<std::mutex> guard(shard.mutex);
+            std::lock_guard<std::mutex> dirty_guard(dirty_mutex_);
+            auto it = dirty_blocks_.find(key);
+            if (it == dirty_blocks_.end()) {
+                continue;
+            }
+            auto &block = it->second.block;
+            bool available = block->available();
+            if (!takeOver(shard, key.first / blk_sec_cnt_, block, available)) {
+                continue;
+            }
+            for (u32 i = 0; i < block->secCnt(); i++) {
+                block->sector(i).mark_clean();
+            }
+            block->setAvailable(available);
+            cleaned_blocks.push_back(std::move(block));
+            dirty_blocks_.erase(it);
+            dirty_blk_cnt_ = dirty_blocks_.size();
+        }
+        return inner_device_->discardSectors(sec_num, cnt);
+    }
+
+    bool CacheManager::zeroSectors(u32 sec_num, u32 cnt) noexcept {
+        if (cnt == 0) {
+            return true;
+        }
+        std::unique_lock<std::mutex> flush_lock(flush_mutex_);
+        if (!inner_device_->zeroSectors(sec_num, cnt)) {
+            flush_lock.unlock();
+            std::vector<u8> zero(SECTOR_SIZE, 0);
+            for (u32 i = 0; i < cnt; i += MAX_BATCH_SECTOR_NUM) {
+                if (!writeSectors(sec_num + i, std::vector<const u8 *>(std::min(cnt - i, (u32) MAX_BATCH_SECTOR_NUM),
+                                                                       &zero[0]))) {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        // the same as `writeSectors`, except that the blocks missing are made instead of being left to load
+        std::vector<u8> zero(SECTOR_SIZE, 0);
+        u32 end_sec = sec_num + cnt;
+        for (u32 blk_num = sec_num / blk_sec_cnt_; blk_num <= (end_sec - 1) / blk_sec_cnt_; blk_num++) {
+            Shard &shard = shardOf(blk_num);
+            std::lock_guard<std::mutex> guard(shard.mutex);
+            shard.write_gen++;
+            auto block = findBlock(shard, blk_num);
+            if (block != nullptr) {
+                u32 to = std::min(end_sec, block->fstSec() + block->secCnt());
+                for (u32 i = std::max(sec_num, block->fstSec()); i < to; i++) {
+                    block->update(i, &zero[0]);
+                }
+                continue;
+            }
+            u32 blk_fst_sec = blk_num * blk_sec_cnt_;
+            if (blk_fst_sec < sec_num || blk_fst_sec + blk_sec_cnt_ > end_sec) {
+                continue;
+            }
+            auto value = (u8 *) value_arena_->allocate();
+            if (value == nullptr) {
+                continue;
+            }
+            memset(value, 0, (u64) blk_sec_cnt_ * SECTOR_SIZE);
+            cacheBlock(shard, blk_num, makeBlock(blk_fst_sec, blk_sec_cnt_, value));
+        }
+        return true;
     }
 
     void CacheManager::clear() noexcept {
-        sector_cache_.clear();
+        flush();
+        {
+            std::lock_guard<std::mutex> guard(ra_mutex_);
+            ra_queue_.clear();
+        }
+        for (auto &shard: shards_) {
+            std::unique_lock<std::mutex> lock(shard->mutex);
+            auto cached_blocks = std::move(shard->block_cache);
+            shard->block_cache = util::LRUCacheMap<u32, std::shared_ptr<CacheBlock>>(shard->blk_cnt, policy_);
+            shard->block_cache.setSecondChance(takeReferenced);
+            shard->evicted_blocks.clear();
+            for (auto &[blk_num, block]: cached_blocks) {
+                retireBlock(*shard, blk_num, block);
+            }
+            reclaimBlocks(*shard);
+            lock.unlock(); // the blocks are destroyed without the lock, since they may write back by themselves
+            cached_blocks.clear();
+        }
         inner_device_->clear();
     }
 
+    void CacheManager::flush() noexcept {
+        writeBack(true, true);
+        inner_device_->flush();
+    }
+
     bool CacheManager::contains(u32 sec_num) noexcept {
-        return sector_cache_.get(sec_num).has_value();
+        Shard &shard = shardOf(sec_num / blk_sec_cnt_);
+        std::lock_guard<std::mutex> guard(shard.mutex);
+        return shard.block_cache.get(sec_num / blk_sec_cnt_).has_value();
+    }
+
+    void CacheManager::setWriteBack(u32 expire_ms, u32 interval_ms) noexcept {
+        {
+            std::lock_guard<std::mutex> guard(flusher_mutex_);
+            dirty_expire_ = std::chrono::milliseconds(expire_ms);
+            flush_interval_ = std::chrono::milliseconds(interval_ms);
+        }
+        flusher_cv_.notify_one();
+    }
+
+    void CacheManager::setReadahead(u32 max_sec_cnt) noexcept {
+        std::lock_guard<std::mutex> guard(ra_mutex_);
+        ra_max_blk_cnt_ = std::min(max_sec_cnt / blk_sec_cnt_, blk_cnt_ / 2);
+        ra_min_blk_cnt_ = std::min(std::max(READAHEAD_MIN_SECTOR_NUM / blk_sec_cnt_, 1u), ra_max_blk_cnt_);
+        if (ra_max_blk_cnt_ == 0) {
+            ra_queue_.clear();
+        }
+    }
+
+    CacheManager::ReadaheadStats CacheManager::readaheadStats() const noexcept {
+        return {ra_issued_blk_cnt_, ra_hit_blk_cnt_, ra_miss_cnt_};
+    }
+
+    void CacheManager::dumpStats(FILE *out) const noexcept {
+        u64 hit_cnt = cache_stats_.hit_cnt, miss_cnt = cache_stats_.miss_cnt;
+        double hit_ratio = hit_cnt + miss_cnt == 0 ? 0 : 100.0 * hit_cnt / (hit_cnt + miss_cnt);
+        fprintf(out, "cache: %u blocks of %u sectors in %zu shards, %llu hits, %llu misses(%.1f%% hit), "
+                     "%llu evictions(%llu dirty)\n", blk_cnt_, blk_sec_cnt_, shards_.size(), hit_cnt, miss_cnt,
+                hit_ratio, (u64) cache_stats_.evict_cnt, (u64) cache_stats_.dirty_evict_cnt);
+        fprintf(out, "  readahead: %llu blocks issued, %llu hits, %llu misses\n", (u64) ra_issued_blk_cnt_,
+                (u64) ra_hit_blk_cnt_, (u64) ra_miss_cnt_);
+        if (warm_blk_cnt_ > 0) {
+            fprintf(out, "  warm-up: %llu blocks loaded\n", (u64) warm_blk_cnt_);
+        }
+        fprintf(out, "  read latency: %s\n", cache_stats_.read_latency.toString().c_str());
+        fprintf(out, "  write latency: %s\n", cache_stats_.write_latency.toString().c_str());
+        inner_device_->dumpStats(out);
+    }
+
+    CacheManager::~CacheManager() noexcept {
+        {
+            std::lock_guard<std::mutex> guard(flusher_mutex_);
+            stop_flusher_ = true;
+        }
+        {
+            std::lock_guard<std::mutex> guard(ra_mutex_);
+            stop_readahead_ = true;
+        }
+        flusher_cv_.notify_one();
+        ra_cv_.notify_one();
+        stop_warm_up_ = true;
+        flusher_.join();
+        readahead_thread_.join();
+        if (warm_up_thread_.joinable()) {
+            warm_up_thread_.join();
+        }
+        clear();
+    }
+
+    bool CacheManager::getBlocks(u32 fst_blk, u32 blk_cnt, std::shared_ptr<CacheBlock> *blocks,
+                                 bool &ra_hit) noexcept {
+        for (u32 i = 0; i < blk_cnt; i++) {
+            blocks[i] = lookupBlock(fst_blk + i);
+            if (blocks[i] == nullptr) {
+                Shard &shard = shardOf(fst_blk + i);
+                std::lock_guard<std::mutex> guard(shard.mutex);
+                blocks[i] = findBlock(shard, fst_blk + i);
+            }
+            if (blocks[i] == nullptr) {
+                continue;
+            }
+            cache_stats_.hit_cnt++;
+            if (blocks[i]->takePrefetched()) {
+                ra_hit_blk_cnt_++;
+                ra_hit = true;
+            }
+        }
+
+        // fetch each run of missing blocks with one request
+        bool missed = false;
+        for (u32 i = 0; i < blk_cnt;) {
+            if (blocks[i] != nullptr) {
+                i++;
+                continue;
+            }
+            u32 run_start = i;
+            while (i < blk_cnt && blocks[i] == nullptr) {
+                i++;
+            }
+            loadBlocks(fst_blk + run_start, i - run_start, &blocks[run_start], LoadMode::Read);
+            cache_stats_.miss_cnt += i - run_start;
+            missed = true;
+        }
+        return missed;
+    }
+
+    u32 CacheManager::loadBlocks(u32 fst_blk, u32 blk_cnt, std::shared_ptr<CacheBlock> *blocks,
+                                 LoadMode mode) noexcept {
+        bool prefetch = mode != LoadMode::Read;
+        std::vector<u8 *> values;
+        std::vector<u8 *> bufs;
+        for (u32 i = 0; i < blk_cnt; i++) {
+            auto value = (u8 *) value_arena_->allocate();
+            if (value == nullptr) { // too many blocks are in use, readahead and warm-up never take memory from the heap
+                if (prefetch) {
+                    break;
+                }
+                value = new u8[(u64) blk_sec_cnt_ * SECTOR_SIZE];
+            }
+            values.push_back(value);
+            for (u32 j = 0; j < blk_sec_cnt_; j++) {
+                bufs.push_back(value + (u64) j * SECTOR_SIZE);
+            }
+        }
+        if (values.empty()) {
+            return 0;
+        }
+        blk_cnt = values.size();
+
+        // a write to the shard after this point may not be seen by the load
+        std::vector<u64> write_gens;
+        for (u32 i = 0; i < blk_cnt; i++) {
+            write_gens.push_back(shardOf(fst_blk + i).write_gen);
+        }
+
+        // the number of sectors loaded for each block
+        std::vector<u32> sec_cnts;
+        u32 fst_sec = fst_blk * blk_sec_cnt_;
+        if (inner_device_->readSectorsValue(fst_sec, bufs)) {
+            sec_cnts.assign(blk_cnt, blk_sec_cnt_);
+        } else if (!prefetch) {
+            // reach the end of device, load the blocks one by one and the last one sector by sector
+            for (u32 i = 0; i < blk_cnt; i++) {
+                u32 blk_fst_sec = fst_sec + i * blk_sec_cnt_;
+                auto blk_bufs_begin = bufs.begin() + i * blk_sec_cnt_;
+                u32 loaded = 0;
+                if (inner_device_->readSectorsValue(blk_fst_sec, {blk_bufs_begin, blk_bufs_begin + blk_sec_cnt_})) {
+                    loaded = blk_sec_cnt_;
+                }
+                while (loaded < blk_sec_cnt_ && inner_device_->readSectorsValue(blk_fst_sec + loaded,
+                                                                                 {blk_bufs_begin[loaded]})) {
+                    loaded++;
+                }
+                if (loaded == 0) {
+                    break;
+                }
+                sec_cnts.push_back(loaded);
+                if (loaded < blk_sec_cnt_) {
+                    break;
+                }
+            }
+        }
+
+        u32 loaded_blk_cnt = sec_cnts.size();
+        for (u32 i = 0; i < loaded_blk_cnt; i++) {
+            u32 blk_num = fst_blk + i;
+            Shard &shard = shardOf(blk_num);
+            std::lock_guard<std::mutex> guard(shard.mutex);
+            auto block = findBlock(shard, blk_num);
+            if (block != nullptr || (prefetch && shard.write_gen != write_gens[i])) {
+                // the block is loaded by others in the meantime, or the value read ahead may be stale
+                CacheBlock::releaseValue(*value_arena_, values[i]);
+                if (!prefetch) {
+                    if (block->takePrefetched()) {
+                        ra_hit_blk_cnt_++;
+                    }
+                    blocks[i] = std::move(block);
+                }
+                continue;
+            }
+            if (shard.write_gen != write_gens[i]) {
+                // the sectors are written during the load, read them again. A write going on now updates the block
+                // after it's cached, since it takes the lock of the shard after writing the device.
+                auto blk_bufs_begin = bufs.begin() + i * blk_sec_cnt_;
+                inner_device_->readSectorsValue(blk_num * blk_sec_cnt_, {blk_bufs_begin, blk_bufs_begin + sec_cnts[i]});
+            }
+            block = makeBlock(blk_num * blk_sec_cnt_, sec_cnts[i], values[i]);
+            if (mode == LoadMode::Readahead) {
+                block->setPrefetched(true);
+                ra_issued_blk_cnt_++;
+            } else if (mode == LoadMode::WarmUp) {
+                warm_blk_cnt_++;
+            } else {
+                blocks[i] = block;
+            }
+            cacheBlock(shard, blk_num, std::move(block));
+        }
+        for (u32 i = loaded_blk_cnt; i < blk_cnt; i++) {
+            CacheBlock::releaseValue(*value_arena_, values[i]);
+        }
+        return loaded_blk_cnt;
+    }
+
+    std::shared_ptr<CacheBlock> CacheManager::makeBlock(u32 fst_sec, u32 sec_cnt, u8 *value) noexcept {
+        return std::allocate_shared<CacheBlock>(util::SlabAllocator<CacheBlock>(block_arena_), fst_sec, sec_cnt,
+                                                SECTOR_SIZE, value, value_arena_,
+                                                CacheBlock::SectorAllocator(sector_arena_), *this);
+    }
+
+    std::shared_ptr<CacheBlock> CacheManager::findBlock(Shard &shard, u32 blk_num) noexcept {
+        auto result = shard.block_cache.get(blk_num);
+        if (result.has_value()) {
+            return result.value();
+        }
+
+        // an evicted dirty block is still the latest one, bring it back
+        std::shared_ptr<CacheBlock> block;
+        {
+            std::lock_guard<std::mutex> dirty_guard(dirty_mutex_);
+            auto it = dirty_blocks_.lower_bound({blk_num * blk_sec_cnt_, nullptr});
+            if (it != dirty_blocks_.end() && it->first.first == blk_num * blk_sec_cnt_) {
+                block = it->second.block;
+            }
+        }
+        auto it = shard.evicted_blocks.find(blk_num);
+        if (block == nullptr && it != shard.evicted_blocks.end()) {
+            block = it->second.lock();
+        }
+        if (it != shard.evicted_blocks.end()) {
+            shard.evicted_blocks.erase(it);
+        }
+        if (block != nullptr) {
+            cacheBlock(shard, blk_num, block);
+        }
+        return block;
+    }
+
+    void CacheManager::cacheBlock(Shard &shard, u32 blk_num, std::shared_ptr<CacheBlock> block) noexcept {
+        CacheBlock *cached_block = block.get();
+        auto evicted = shard.block_cache.put(blk_num, std::move(block));
+        if (evicted.has_value()) {
+            auto &[evicted_blk_num, evicted_block] = evicted.value();
+            cache_stats_.evict_cnt++;
+            {
+                std::lock_guard<std::mutex> dirty_guard(dirty_mutex_);
+                if (dirty_blocks_.count({evicted_block->fstSec(), evicted_block.get()}) > 0) {
+                    cache_stats_.dirty_evict_cnt++;
+                }
+            }
+            retireBlock(shard, evicted_blk_num, std::move(evicted_block));
+            reclaimBlocks(shard);
+        }
+        cached_block->setAvailable(true);
+        hitSlot(shard, blk_num).store(cached_block, std::memory_order_release);
+    }
+
+    std::shared_ptr<CacheBlock> CacheManager::lookupBlock(u32 blk_num) noexcept {
+        Shard &shard = shardOf(blk_num);
+        util::EpochDomain::Guard guard(epoch_);
+        // the block is alive while the epoch is pinned, since an evicted block is retired rather than freed
+        CacheBlock *block = hitSlot(shard, blk_num).load(std::memory_order_acquire);
+        if (block == nullptr || block->fstSec() != blk_num * blk_sec_cnt_ || !block->available()) {
+            return nullptr;
+        }
+        auto held = block->shared_from_this();
+        // either the block is seen unavailable, or the one making it unavailable sees it's held, see `retireBlock`
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (!block->available()) {
+            return nullptr;
+        }
+        block->reference();
+        return held;
+    }
+
+    void CacheManager::retireBlock(Shard &shard, u32 blk_num, std::shared_ptr<CacheBlock> block) noexcept {
+        block->setAvailable(false);
+        CacheBlock *expected = block.get();
+        hitSlot(shard, blk_num).compare_exchange_strong(expected, nullptr);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        // the block is held by others besides `block` and maybe the readers taking it
+        if (block.use_count() > 1) {
+            // the blocks released since then are forgotten once there are too many
+            if (shard.evicted_blocks.size() >= shard.blk_cnt) {
+                for (auto it = shard.evicted_blocks.begin(); it != shard.evicted_blocks.end();) {
+                    it = it->second.expired() ? shard.evicted_blocks.erase(it) : std::next(it);
+                }
+            }
+            shard.evicted_blocks[blk_num] = block;
+        }
+        shard.retired_blocks.emplace_back(epoch_.retire(), std::move(block));
+    }
+
+    void CacheManager::reclaimBlocks(Shard &shard) noexcept {
+        // a retired block is either dirty and kept by `dirty_blocks_`, or clean, it's safe to drop with the lock
+        u64 safe_epoch = epoch_.safeEpoch();
+        while (!shard.retired_blocks.empty() && shard.retired_blocks.front().first < safe_epoch) {
+            shard.retired_blocks.pop_front();
+        }
+    }
+
+    bool CacheManager::isCached(u32 blk_num) noexcept {
+        Shard &shard = shardOf(blk_num);
+        std::lock_guard<std::mutex> guard(shard.mutex);
+        if (shard.block_cache.peek(blk_num).has_value()) {
+            return true;
+        }
+        std::lock_guard<std::mutex> dirty_guard(dirty_mutex_);
+        auto it = dirty_blocks_.lower_bound({blk_num * blk_sec_cnt_, nullptr});
+        return it != dirty_blocks_.end() && it->first.first == blk_num * blk_sec_cnt_;
+    }
+
+    void CacheManager::markDirty(CacheBlock &block) noexcept {
+        {
+            std::lock_guard<std::mutex> dirty_guard(dirty_mutex_);
+            auto it = dirty_blocks_.find({block.fstSec(), &block});
+            if (it != dirty_blocks_.end()) {
+                it->second.gen++;
+                return;
+            }
+
+            dirty_blocks_.emplace(std::make_pair(block.fstSec(), &block),
+                                  DirtyBlock{block.shared_from_this(), std::chrono::steady_clock::now(), 0});
+            dirty_blk_cnt_ = dirty_blocks_.size();
+        }
+        if (dirty_blk_cnt_ * 100 > blk_cnt_ * DIRTY_BACKGROUND_RATIO) {
+            flusher_cv_.notify_one();
+        }
+    }
+
+    void CacheManager::writeBack(bool all, bool force) noexcept {
+        struct WriteBackItem {
+            std::pair<u32, const CacheBlock *> key;
+            u64 gen;
+            std::vector<u8> values;
+            std::vector<std::pair<u32, u32>> runs;
+        };
+
+        // the blocks written back are destroyed after the locks are released, since they may write by themselves
+        std::vector<std::shared_ptr<CacheBlock>> cleaned_blocks;
+        std::lock_guard<std::mutex> flush_guard(flush_mutex_);
+        std::chrono::milliseconds dirty_expire;
+        {
+            std::lock_guard<std::mutex> guard(flusher_mutex_);
+            dirty_expire = dirty_expire_;
+        }
+        std::vector<std::pair<u32, const CacheBlock *>> keys;
+        {
+            std::lock_guard<std::mutex> dirty_guard(dirty_mutex_);
+            auto now = std::chrono::steady_clock::now();
+            for (auto &[key, dirty_block]: dirty_blocks_) {
+                if (all || now - dirty_block.dirtied_at >= dirty_expire) {
+                    keys.push_back(key);
+                }
+            }
+        }
+
+        // the lock of its shard keeps the block from being handed out while it's checked and taken
+        std::vector<WriteBackItem> items;
+        for (auto &key: keys) {
+            Shard &shard = shardOf(key.first / blk_sec_cnt_);
+            std::lock_guard<std::mutex> guard(shard.mutex);
+            std::lock_guard<std::mutex> dirty_guard(dirty_mutex_);
+            auto it = dirty_blocks_.find(key);
+            if (it == dirty_blocks_.end()) {
+                continue;
+            }
+            auto &block = it->second.block;
+            bool available = block->available();
+            if (!force && !takeOver(shard, key.first / blk_sec_cnt_, block, available)) {
+                continue;
+            }
+            WriteBackItem item{key, it->second.gen};
+            block->takeDirty(item.values, item.runs);
+            block->setAvailable(available);
+            items.push_back(std::move(item));
+        }
+
+        // the items are sorted by their first sector, the runs continuing each other are merged into one request
+        std::vector<const u8 *> bufs;
+        u32 bufs_fst_sec = 0;
+        for (auto &item: items) {
+            u32 off = 0;
+            for (auto [fst_sec, cnt]: item.runs) {
+                if (!bufs.empty() && (bufs_fst_sec + bufs.size() != fst_sec ||
+                                      bufs.size() + cnt > MAX_BATCH_SECTOR_NUM)) {
+                    inner_device_->writeSectors(bufs_fst_sec, bufs);
+                    bufs.clear();
+                }
+                if (bufs.empty()) {
+                    bufs_fst_sec = fst_sec;
+                }
+                for (u32 i = 0; i < cnt; i++, off += SECTOR_SIZE) {
+                    bufs.push_back(&item.values[off]);
+                }
+            }
+        }
+        if (!bufs.empty()) {
+            inner_device_->writeSectors(bufs_fst_sec, bufs);
+        }
+        // a block loaded before the writes may be cached once it's no longer dirty, make it read again
+        for (auto &item: items) {
+            shardOf(item.key.first / blk_sec_cnt_).write_gen++;
+        }
+
+        // forget the blocks which haven't been dirtied again
+        {
+            std::lock_guard<std::mutex> dirty_guard(dirty_mutex_);
+            for (auto &item: items) {
+                auto it = dirty_blocks_.find(item.key);
+                if (it != dirty_blocks_.end() && it->second.gen == item.gen) {
+                    cleaned_blocks.push_back(std::move(it->second.block));
+                    dirty_blocks_.erase(it);
+                }
+            }
+            dirty_blk_cnt_ = dirty_blocks_.size();
+        }
+    }
+
+    bool CacheManager::takeOver(Shard &shard, u32 blk_num, const std::shared_ptr<CacheBlock> &block,
+                                bool available) noexcept {
+        // keep the readers from taking the block without the lock until it's taken, see `lookupBlock`
+        block->setAvailable(false);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        // the block is referred by `dirty_blocks_`, and maybe by the cache, any other owner may write it
+        long use_cnt = block.use_count();
+        auto cached = shard.block_cache.peek(blk_num);
+        if (use_cnt > 1 + (cached.has_value() && cached.value() == block)) {
+            block->setAvailable(available);
+            return false;
+        }
+        // see the writes made by the last owner before it released the block
+        std::atomic_thread_fence(std::memory_order_acquire);
+        return true;
+    }
+
+    void CacheManager::throttle() noexcept {
+        if (dirty_blk_cnt_ * 100 > blk_cnt_ * DIRTY_RATIO) {
+            writeBack(true, false);
+        }
+    }
+
+    void CacheManager::runFlusher() noexcept {
+        std::unique_lock<std::mutex> lock(flusher_mutex_);
+        while (!stop_flusher_) {
+            flusher_cv_.wait_for(lock, flush_interval_);
+            if (stop_flusher_) {
+                break;
+            }
+            bool all = dirty_blk_cnt_ * 100 > blk_cnt_ * DIRTY_BACKGROUND_RATIO;
+            lock.unlock();
+            writeBack(all, false);
+            lock.lock();
+        }
+    }
+
+    void CacheManager::readahead(u32 sec_num, u32 cnt, bool missed) noexcept {
+        std::lock_guard<std::mutex> guard(ra_mutex_);
+        if (ra_max_blk_cnt_ == 0) {
+            return;
+        }
+
+        u32 end_sec = sec_num + cnt;
+        u32 end_blk = (end_sec - 1) / blk_sec_cnt_ + 1;
+        ReadaheadStream *stream = nullptr;
+        for (auto &s: streams_) {
+            if (s.used_at != 0 && s.fst_sec <= sec_num && sec_num <= s.next_sec) {
+                stream = &s;
+                break;
+            }
+        }
+        stream_clock_++;
+
+        if (stream == nullptr) {
+            // a seek inside the window of a stream halves the window, or a new stream replaces the oldest one
+            for (auto &s: streams_) {
+                if (s.used_at != 0 && s.fst_sec <= sec_num && sec_num < s.ra_end_blk * blk_sec_cnt_) {
+                    stream = &s;
+                    break;
+                }
+            }
+            if (stream == nullptr) {
+                stream = &*std::min_element(streams_.begin(), streams_.end(), [](const auto &a, const auto &b) {
+                    return a.used_at < b.used_at;
+                });
+                stream->window = 0;
+            } else {
+                stream->window /= 2;
+            }
+            *stream = {sec_num, end_sec, stream->window, end_blk, end_blk, stream_clock_};
+            return;
+        }
+
+        stream->used_at = stream_clock_;
+        if (end_sec <= stream->next_sec) { // read the last sectors again
+            return;
+        }
+        stream->fst_sec = sec_num;
+        stream->next_sec = end_sec;
+        if (missed) {
+            ra_miss_cnt_++;
+        }
+        if (end_blk <= stream->marker_blk && !missed) {
+            return;
+        }
+
+        // the stream reaches the window read ahead last time, or the window is not loaded in time
+        u32 ra_blk_cnt = std::min(std::max(stream->window, ra_min_blk_cnt_), ra_max_blk_cnt_);
+        u32 ra_fst_blk = missed ? end_blk : std::max(stream->ra_end_blk, end_blk);
+        stream->window = std::min(ra_blk_cnt * 2, ra_max_blk_cnt_);
+        stream->marker_blk = ra_fst_blk;
+        stream->ra_end_blk = ra_fst_blk + ra_blk_cnt;
+        if (ra_queue_.size() >= READAHEAD_STREAM_NUM) {
+            ra_queue_.pop_front();
+        }
+        ra_queue_.emplace_back(ra_fst_blk, ra_blk_cnt);
+        ra_cv_.notify_one();
+    }
+
+    void CacheManager::runReadahead() noexcept {
+        std::unique_lock<std::mutex> lock(ra_mutex_);
+        while (true) {
+            ra_cv_.wait(lock, [this] { return stop_readahead_ || !ra_queue_.empty(); });
+            if (stop_readahead_) {
+                break;
+            }
+            auto [fst_blk, blk_cnt] = ra_queue_.front();
+            ra_queue_.pop_front();
+            lock.unlock();
+
+            // only load the first run of missing blocks, the blocks after a cached one are likely to be cached too
+            while (blk_cnt > 0 && isCached(fst_blk)) {
+                fst_blk++;
+                blk_cnt--;
+            }
+            u32 run_cnt = 0;
+            while (run_cnt < blk_cnt && !isCached(fst_blk + run_cnt)) {
+                run_cnt++;
+            }
+            if (run_cnt > 0) {
+                loadBlocks(fst_blk, run_cnt, nullptr, LoadMode::Readahead);
+            }
+            lock.lock();
+        }
+    }
+
+    bool CacheManager::saveWarmList(const std::string &path, u32 meta_end_sec) noexcept {
+        // the blocks of each shard from the most recently used, which are interleaved so that the list is roughly
+        // in the order of recency
+        std::vector<std::vector<u32>> shard_blk_nums;
+        for (auto &shard: shards_) {
+            std::lock_guard<std::mutex> guard(shard->mutex);
+            shard_blk_nums.emplace_back();
+            for (auto &[blk_num, block]: shard->block_cache) {
+                shard_blk_nums.back().push_back(blk_num);
+            }
+        }
+        std::vector<WarmListEntry> entries;
+        for (u32 rank = 0; entries.size() < blk_cnt_; rank++) {
+            bool found = false;
+            for (auto &blk_nums: shard_blk_nums) {
+                if (rank < blk_nums.size()) {
+                    u32 fst_sec = blk_nums[rank] * blk_sec_cnt_;
+                    entries.push_back({fst_sec, fst_sec < meta_end_sec ? WarmListEntry::METADATA : 0});
+                    found = true;
+                }
+            }
+            if (!found) {
+                break;
+            }
+        }
+
+        std::string tmp_path = path + ".tmp";
+        FILE *file = fopen(tmp_path.c_str(), "wb");
+        if (file == nullptr) {
+            return false;
+        }
+        WarmListHeader header{WarmListHeader::MAGIC, WarmListHeader::VERSION, (u32) entries.size()};
+        bool ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+                  fwrite(entries.data(), sizeof(WarmListEntry), entries.size(), file) == entries.size();
+        ok = fclose(file) == 0 && ok;
+        if (!ok || rename(tmp_path.c_str(), path.c_str()) != 0) {
+            unlink(tmp_path.c_str());
+            return false;
+        }
+        return true;
+    }
+
+    bool CacheManager::warmUp(const std::string &path) noexcept {
+        FILE *file = fopen(path.c_str(), "rb");
+        if (file == nullptr) {
+            return false;
+        }
+        WarmListHeader header{};
+        std::vector<WarmListEntry> entries;
+        bool ok = fread(&header, sizeof(header), 1, file) == 1 && header.magic == WarmListHeader::MAGIC &&
+                  header.version == WarmListHeader::VERSION;
+        // the size is checked before the entries are read, a broken count must not make a huge allocation
+        ok = ok && fseek(file, 0, SEEK_END) == 0 &&
+             ftell(file) == (long) (sizeof(header) + (u64) header.entry_cnt * sizeof(WarmListEntry)) &&
+             fseek(file, sizeof(header), SEEK_SET) == 0;
+        if (ok) {
+            entries.resize(header.entry_cnt);
+            ok = fread(entries.data(), sizeof(WarmListEntry), entries.size(), file) == entries.size();
+        }
+        fclose(file);
+        if (!ok) {
+            return false;
+        }
+
+        // the metadata blocks are taken first, then the others by recency, until the cache is full
+        std::vector<u32> meta_blk_nums;
+        std::vector<u32> data_blk_nums;
+        std::unordered_set<u32> taken;
+        for (bool meta: {true, false}) {
+            for (auto &entry: entries) {
+                u32 blk_num = entry.fst_sec / blk_sec_cnt_;
+                if (taken.size() == blk_cnt_ || ((entry.flags & WarmListEntry::METADATA) != 0) != meta ||
+                    !taken.insert(blk_num).second) {
+                    continue;
+                }
+                (meta ? meta_blk_nums : data_blk_nums).push_back(blk_num);
+            }
+        }
+        std::sort(meta_blk_nums.begin(), meta_blk_nums.end());
+        std::sort(data_blk_nums.begin(), data_blk_nums.end());
+        meta_blk_nums.insert(meta_blk_nums.end(), data_blk_nums.begin(), data_blk_nums.end());
+
+        if (warm_up_thread_.joinable()) {
+            warm_up_thread_.join();
+        }
+        warm_up_thread_ = std::thread(&CacheManager::runWarmUp, this, std::move(meta_blk_nums));
+        return true;
+    }
+
+    void CacheManager::runWarmUp(std::vector<u32> blk_nums) noexcept {
+        u32 max_run_cnt = std::max(MAX_BATCH_SECTOR_NUM / blk_sec_cnt_, 1u);
+        for (u32 i = 0; i < blk_nums.size() && !stop_warm_up_;) {
+            if (isCached(blk_nums[i])) {
+                i++;
+                continue;
+            }
+            u32 run_cnt = 1;
+            while (i + run_cnt < blk_nums.size() && run_cnt < max_run_cnt &&
+                   blk_nums[i + run_cnt] == blk_nums[i] + run_cnt && !isCached(blk_nums[i + run_cnt])) {
+                run_cnt++;
+            }
+            loadBlocks(blk_nums[i], run_cnt, nullptr, LoadMode::WarmUp);
+            i += run_cnt;
+        }
+    }
+
+    /**
+     * DiscardQueue
+     * */
+    DiscardQueue::DiscardQueue(std::shared_ptr<Device> device, u32 batch_sec_cnt, u32 delay_ms) noexcept
+            : device_{std::move(device)}, batch_sec_cnt_{batch_sec_cnt}, delay_{delay_ms} {
+        thread_ = std::thread(&DiscardQueue::run, this);
+    }
+
+    void DiscardQueue::add(u32 sec_num, u32 cnt) noexcept {
+        if (cnt == 0 || !supported_) {
+            return;
+        }
+
+        std::lock_guard<std::mutex> guard(mutex_);
+        held_ranges_.add(sec_num, sec_num + cnt);
+        pending_sec_cnt_ = held_ranges_.size() + ranges_.size();
+    }
+
+    void DiscardQueue::cancel(u32 sec_num, u32 cnt) noexcept {
+        // a discard in flight may cover the range, wait for it before the range is written
+        std::lock_guard<std::mutex> issue_guard(issue_mutex_);
+        std::lock_guard<std::mutex> guard(mutex_);
+        held_ranges_.remove(sec_num, sec_num + cnt);
+        ranges_.remove(sec_num, sec_num + cnt);
+        pending_sec_cnt_ = held_ranges_.size() + ranges_.size();
+    }
+
+    void DiscardQueue::commit() noexcept {
+        std::lock_guard<std::mutex> guard(mutex_);
+        for (auto [start, end]: held_ranges_) {
+            ranges_.add(start, end);
+        }
+        util::RangeSet().swap(held_ranges_);
+        if (ranges_.size() >= batch_sec_cnt_) {
+            cv_.notify_one();
+        }
+    }
+
+    void DiscardQueue::flush() noexcept {
+        std::lock_guard<std::mutex> issue_guard(issue_mutex_);
+        util::RangeSet ranges;
+        {
+            std::lock_guard<std::mutex> guard(mutex_);
+            ranges.swap(ranges_);
+            pending_sec_cnt_ = held_ranges_.size();
+        }
+        for (auto [start, end]: ranges) {
+            if (!supported_) {
+                break;
+            }
+            if (!device_->discardSectors(start, end - start)) {
+                supported_ = false;
+                break;
+            }
+            discarded_sec_cnt_ += end - start;
+        }
+    }
+
+    DiscardQueue::~DiscardQueue() noexcept {
+        {
+            std::lock_guard<std::mutex> guard(mutex_);
+            stop_ = true;
+        }
+        cv_.notify_one();
+        thread_.join();
+        flush();
+    }
+
+    void DiscardQueue::run() noexcept {
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (!stop_) {
+            cv_.wait_for(lock, delay_, [this] { return stop_ || ranges_.size() >= batch_sec_cnt_; });
+            if (stop_) {
+                break;
+            }
+            if (ranges_.empty()) {
+                continue;
+            }
+            lock.unlock();
+            flush();
+            lock.lock();
+        }
     }
 }
@@ -3,9 +3,19 @@
 
 #include <vector>
 
+#include <map>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <deque>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <unordered_map>
 #include <utility>
+#include <sys/uio.h>
 #include "config.h"
 #include "util.h"
 
@@ -14,13 +24,78 @@ namespace device {
 
     class Sector;
 
+    class CacheBlock;
+
     class Device {
     public:
         virtual std::optional<std::shared_ptr<Sector>> readSector(u32) = 0;
 
         virtual bool writeSectorValue(u32, const u8 *) = 0;
 
+        /**
+         * Read `cnt` contiguous sectors starting from `sec_num`, or return none if any of them is out of bound.
+         * The default implementation falls back to `readSector`, devices that can do better should override it.
+         * */
+        virtual std::optional<std::vector<std::shared_ptr<Sector>>> readSectors(u32 sec_num, u32 cnt) noexcept;
+
+        /**
+         * Write `bufs.size()` contiguous sectors starting from `sec_num`, each buffer holds exactly one sector.
+         * */
+        virtual bool writeSectors(u32 sec_num, const std::vector<const u8 *> &bufs) noexcept;
+
+        /**
+         * Read `bufs.size()` contiguous sectors starting from `sec_num` into `bufs` without creating `Sector`,
+         * each buffer holds exactly one sector. Return false if any of them is out of bound.
+         * */
+        virtual bool readSectorsValue(u32 sec_num, const std::vector<u8 *> &bufs) noexcept;
+
+        /**
+         * Tell the device that the sectors in [sec_num, sec_num + cnt) are no longer used, so that it can free the
+         * space behind them. Their values are undefined afterwards. Return false if the device can't do it.
+         * */
+        virtual bool discardSectors(u32 sec_num, u32 cnt) noexcept { return false; }
+
+        /**
+         * Fill the sectors in [sec_num, sec_num + cnt) with zeros without sending them to the device. Return false,
+         * with the sectors left as they are, if the device can't do it, then the caller has to write the zeros.
+         * */
+        virtual bool zeroSectors(u32 sec_num, u32 cnt) noexcept { return false; }
+
+        /**
+         * Write back the sectors written so far to where they are stored, the cached ones are kept.
+         * */
+        virtual void flush() noexcept {}
+
         virtual void clear() noexcept {}
+
+        /**
+         * Print the counters and latency histograms of the device, and of the devices it's built on.
+         * */
+        virtual void dumpStats(FILE *out) const noexcept {}
+
+        virtual ~Device() = default;
+    };
+
+    /**
+     * The I/O counters of a device, which are updated by many threads without locking. An op is a single call
+     * to read or write some contiguous sectors, it may take many system calls.
+     * */
+    struct IOStats {
+        std::atomic<u64> read_cnt{0};
+        std::atomic<u64> write_cnt{0};
+        std::atomic<u64> read_bytes{0};
+        std::atomic<u64> written_bytes{0};
+        std::atomic<u64> syscall_cnt{0};
+        std::atomic<u64> discard_cnt{0};
+        std::atomic<u64> discarded_bytes{0};
+        std::atomic<u64> zero_cnt{0};
+        std::atomic<u64> zeroed_bytes{0};
+        /**
+         * The reads served by the holes of a sparse file without I/O, which are counted as reads too.
+         * */
+        std::atomic<u64> hole_read_cnt{0};
+        util::LatencyHistogram read_latency;
+        util::LatencyHistogram write_latency;
     };
 
     // TODO: comment here.
@@ -28,8 +103,23 @@ namespace device {
     public:
         Sector(u32 sec_num, u32 sec_sz, Device &device) noexcept;
 
+        /**
+         * Make a sector viewing `buf` instead of owning a copy of the value, the caller must keep `buf` valid
+         * until the sector is destroyed. If the sector belongs to `block`, the block is told when it gets dirty.
+         * */
+        Sector(u32 sec_num, u32 sec_sz, Device &device, u8 *buf, CacheBlock *block = nullptr) noexcept;
+
         void mark_dirty() noexcept;
 
+        bool is_dirty() const noexcept { return dirty_; }
+
+        u32 size() const noexcept { return sec_sz_; }
+
+        /**
+         * Drop the dirty flag without writing, it's used when the value has been written back by other ways.
+         * */
+        void mark_clean() noexcept;
+
         const void *read_ptr(u32 offset) noexcept;
 
         void *write_ptr(u32 offset) noexcept;
@@ -44,44 +134,857 @@ namespace device {
         u32 sec_num_;
         u32 sec_sz_;
         std::vector<u8> value_;
+        /**
+         * Point to the value of sector, which is either `value_` or the buffer viewed.
+         * */
+        u8 *buf_;
+        CacheBlock *block_;
         Device &device_;
         bool dirty_;
     };
 
+    /**
+     * A pool of equally sized buffers aligned for direct I/O, the released buffers are kept for reuse
+     * instead of being freed.
+     * */
+    class AlignedBufferPool {
+    public:
+        AlignedBufferPool(u32 buf_sz, u32 alignment) noexcept;
+
+        AlignedBufferPool(const AlignedBufferPool &) = delete;
+
+        AlignedBufferPool &operator=(const AlignedBufferPool &) = delete;
+
+        struct Releaser {
+            AlignedBufferPool *pool;
+
+            void operator()(u8 *buf) const noexcept { pool->release(buf); }
+        };
+
+        typedef std::unique_ptr<u8[], Releaser> Buffer;
+
+        /**
+         * Take a buffer of `bufSz()` bytes from the pool, it's given back when the returned `Buffer` is destroyed.
+         * */
+        Buffer acquire() noexcept;
+
+        u32 bufSz() const noexcept { return buf_sz_; }
+
+        ~AlignedBufferPool() noexcept;
+
+    private:
+        void release(u8 *buf) noexcept;
+
+        u32 buf_sz_;
+        u32 alignment_;
+        std::vector<u8 *> free_bufs_;
+        std::mutex mutex_;
+    };
+
     /**
      * Treat Linux file as a block device using Linux system call.
      *
+     * The file is opened once and kept open until the driver is destroyed, all the I/O is done by positional
+     * system calls(pread/pwrite/preadv/pwritev), so the driver never touches the file offset.
+     *
+     * If `direct_io` is set and the file is a block device, it's opened with O_DIRECT to bypass the kernel page
+     * cache, so that sectors are only cached once by `CacheManager`. Since direct I/O must be aligned to the
+     * logical block size of the device, the data goes through aligned bounce buffers taken from a pool, and
+     * partially covered blocks are read before being written.
+     *
+     * For a regular file, the holes of the sparse image are found by SEEK_HOLE/SEEK_DATA when it's opened, and
+     * kept up to date by the writes, discards and zero-outs of the driver. A read falling entirely in the holes is
+     * served with zeros without I/O. The file mustn't be written by others while it's opened.
+     *
      * When using the `LinuxFileDriver`, the caller must make sure the `file_path_` exist, otherwise it panics.
      * */
     class LinuxFileDriver : public Device {
     public:
-        explicit LinuxFileDriver(std::string file_path, u32 sec_sz) noexcept;
+        explicit LinuxFileDriver(std::string file_path, u32 sec_sz, bool direct_io = false) noexcept;
+
+        LinuxFileDriver(const LinuxFileDriver &) = delete;
+
+        LinuxFileDriver &operator=(const LinuxFileDriver &) = delete;
 
         std::optional<std::shared_ptr<Sector>> readSector(u32 sec_num) noexcept override;
 
         bool writeSectorValue(u32 sec_num, const u8 *buf) noexcept override;
 
-    private:
+        std::optional<std::vector<std::shared_ptr<Sector>>> readSectors(u32 sec_num, u32 cnt) noexcept override;
+
+        bool writeSectors(u32 sec_num, const std::vector<const u8 *> &bufs) noexcept override;
+
+        bool readSectorsValue(u32 sec_num, const std::vector<u8 *> &bufs) noexcept override;
+
+        /**
+         * Issue BLKDISCARD for a block device, or punch a hole for a regular file. The range is shrunk to whole
+         * logical blocks, since the rest can't be dropped by the device.
+         * */
+        bool discardSectors(u32 sec_num, u32 cnt) noexcept override;
+
+        /**
+         * Issue BLKZEROOUT for a block device, or FALLOC_FL_ZERO_RANGE for a regular file. The partial logical
+         * blocks at both ends, less than a logical block each, are written with zeros once the rest is zeroed.
+         * */
+        bool zeroSectors(u32 sec_num, u32 cnt) noexcept override;
+
+        bool isDirectIO() const noexcept { return buf_pool_ != nullptr; }
+
+        u32 logicalBlkSz() const noexcept { return logical_blk_sz_; }
+
+        u32 physicalBlkSz() const noexcept { return physical_blk_sz_; }
+
+        /**
+         * The number of sectors in the holes of the file.
+         * */
+        u64 holeSecCnt() const noexcept { return hole_sec_cnt_; }
+
+        const IOStats &ioStats() const noexcept { return io_stats_; }
+
+        void dumpStats(FILE *out) const noexcept override;
+
+        ~LinuxFileDriver() noexcept override;
+
+    protected:
+        bool isOutOfBound(u32 sec_num, u32 cnt) const noexcept {
+            return ((u64) sec_num + cnt) * sec_sz_ > device_sz_;
+        }
+
+        /**
+         * Read the contiguous sectors starting from `sec_num` into `bufs`, each buffer holds exactly one sector.
+         * */
+        void readValues(u32 sec_num, const std::vector<u8 *> &bufs) noexcept;
+
+        /**
+         * Write the contiguous sectors starting from `sec_num` from `bufs`, each buffer holds exactly one sector.
+         * */
+        void writeValues(u32 sec_num, const std::vector<const u8 *> &bufs) noexcept;
+
+        /**
+         * Whether [sec_num, sec_num + cnt) lies entirely in the holes, so that it reads as zero.
+         * */
+        bool isHole(u32 sec_num, u32 cnt) noexcept;
+
+        /**
+         * Called before [sec_num, sec_num + cnt) is written, the sectors are no longer in the holes.
+         * */
+        void fillHoles(u32 sec_num, u32 cnt) noexcept;
+
+        /**
+         * Called after the bytes in [start, end) are made to read as zero, the whole sectors among them are put
+         * in the holes.
+         * */
+        void addHoles(u64 start, u64 end) noexcept;
+
+        /**
+         * Stop tracking the holes, for a driver which doesn't read through `readValues`.
+         * */
+        void forgetHoles() noexcept;
+
         std::string file_path_;
+        int fd_;
         u64 device_sz_;
         u32 sec_sz_;
+        u32 logical_blk_sz_;
+        u32 physical_blk_sz_;
+        bool blk_dev_ = false;
+        /**
+         * The sectors reading as zero without being allocated in the file, guarded by `holes_mutex_`.
+         * `hole_sec_cnt_` mirrors their number, so that a file without holes doesn't take the lock. The holes are
+         * only tracked for a regular file if `map_holes_` is set.
+         * */
+        util::RangeSet holes_;
+        std::atomic<u64> hole_sec_cnt_{0};
+        bool map_holes_ = false;
+        std::mutex holes_mutex_;
+        /**
+         * Bounce buffers for direct I/O, it's null when the page cache is used.
+         * */
+        std::unique_ptr<AlignedBufferPool> buf_pool_;
+        IOStats io_stats_;
+
+    private:
+        /**
+         * Find the holes of the regular file by SEEK_HOLE and SEEK_DATA.
+         * */
+        void mapHoles() noexcept;
+
+        void directReadValues(u32 sec_num, const std::vector<u8 *> &bufs) noexcept;
+
+        void directWriteValues(u32 sec_num, const std::vector<const u8 *> &bufs) noexcept;
+    };
+
+    /**
+     * A `LinuxFileDriver` mapping the whole regular file into memory. Sectors are handed out as views into the
+     * mapping, so reading a sector neither copies its value nor issues a system call, and the kernel page cache
+     * is the only cache of the image.
+     *
+     * Written sectors are recorded as dirty runs, adjacent runs are coalesced and `clear` writes them back
+     * with one msync for each run. It falls back to `LinuxFileDriver` if the file isn't a regular file or can't
+     * be mapped, use `isMapped` to tell which one is in use.
+     * */
+    class MmapFileDriver : public LinuxFileDriver {
+    public:
+        explicit MmapFileDriver(std::string file_path, u32 sec_sz) noexcept;
+
+        std::optional<std::shared_ptr<Sector>> readSector(u32 sec_num) noexcept override;
+
+        bool writeSectorValue(u32 sec_num, const u8 *buf) noexcept override;
+
+        std::optional<std::vector<std::shared_ptr<Sector>>> readSectors(u32 sec_num, u32 cnt) noexcept override;
+
+        bool writeSectors(u32 sec_num, const std::vector<const u8 *> &bufs) noexcept override;
+
+        bool readSectorsValue(u32 sec_num, const std::vector<u8 *> &bufs) noexcept override;
+
+        /**
+         * Sync the dirty runs of the mapping to the file.
+         * */
+        void flush() noexcept override;
+
+        void clear() noexcept override;
+
+        bool isMapped() const noexcept { return map_ != nullptr; }
+
+        ~MmapFileDriver() noexcept override;
+
+    private:
+        /**
+         * Record [sec_num, sec_num + cnt) as dirty, merging it with the adjacent or overlapped runs.
+         * */
+        void markDirty(u32 sec_num, u32 cnt) noexcept;
+
+        u8 *map_ = nullptr;
+        /**
+         * Dirty sector runs which haven't been synced, mapping from the start sector to the end(exclusive).
+         * */
+        std::map<u32, u32> dirty_runs_;
+        std::mutex dirty_mutex_;
+    };
+
+    /**
+     * A `LinuxFileDriver` submitting the batched reads and writes through io_uring. A batch is split into requests
+     * of at most `URING_REQUEST_SECTOR_NUM` sectors, up to `queue_depth` of them are kept in flight at the same
+     * time and their completions are reaped together.
+     *
+     * When io_uring is unavailable(old kernel, disabled by seccomp or sysctl), it falls back to the synchronous
+     * system calls of `LinuxFileDriver`, use `isUringEnabled` to tell which one is in use.
+     * */
+    class UringFileDriver : public LinuxFileDriver {
+    public:
+        explicit UringFileDriver(std::string file_path, u32 sec_sz, u32 queue_depth = URING_QUEUE_DEPTH) noexcept;
+
+        std::optional<std::vector<std::shared_ptr<Sector>>> readSectors(u32 sec_num, u32 cnt) noexcept override;
+
+        bool writeSectors(u32 sec_num, const std::vector<const u8 *> &bufs) noexcept override;
+
+        bool readSectorsValue(u32 sec_num, const std::vector<u8 *> &bufs) noexcept override;
+
+        bool isUringEnabled() const noexcept { return uring_enabled_; }
+
+        ~UringFileDriver() noexcept override;
+
+    private:
+        struct Ring;
+
+        /**
+         * Set up an io_uring instance with the raw system calls, return nullptr if it's not supported.
+         * */
+        static std::unique_ptr<Ring> setupRing(u32 queue_depth) noexcept;
+
+        /**
+         * Take an idle ring, or set up one more for another thread doing I/O at the same time, nullptr if it fails.
+         * */
+        std::unique_ptr<Ring> takeRing() noexcept;
+
+        void putRing(std::unique_ptr<Ring> ring) noexcept;
+
+        /**
+         * Submit one request for each sector run of `iov`, and wait until all of them are completed.
+         * */
+        void submitAndWait(bool is_write, u32 sec_num, std::vector<iovec> &iov) noexcept;
+
+        /**
+         * Do the request of `req_sec_cnt` sectors from the `req_start`th of `iov` with a synchronous system call.
+         * */
+        void redoRequest(bool is_write, u32 sec_num, std::vector<iovec> &iov, u32 req_start,
+                         u32 req_sec_cnt) noexcept;
+
+        u32 queue_depth_;
+        bool uring_enabled_;
+        /**
+         * The submission and completion queues of a ring can only be used by one thread at a time, so each thread
+         * takes a ring of its own while it waits for the completions, and puts it back here after.
+         * */
+        std::vector<std::unique_ptr<Ring>> idle_rings_;
+        std::mutex ring_mutex_;
     };
 
+    class CacheManager;
+
+    /**
+     * The unit cached by `CacheManager`, which holds `secCnt()` contiguous sectors in a single buffer. The sectors
+     * of a block are views into the buffer, so that a block only costs one allocation and one cache entry.
+     *
+     * When a sector of the block gets dirty, the block registers itself to the `CacheManager`, which keeps it
+     * alive until the dirty sectors are written back.
+     * */
+    class CacheBlock : public std::enable_shared_from_this<CacheBlock> {
+    public:
+        typedef util::SlabAllocator<Sector> SectorAllocator;
+
+        /**
+         * Make a block of `sec_cnt` sectors starting from `fst_sec`. The block takes the ownership of `value`, which
+         * is either a slot of `value_arena` or an array allocated by `new u8[]`.
+         * */
+        CacheBlock(u32 fst_sec, u32 sec_cnt, u32 sec_sz, u8 *value, std::shared_ptr<util::SlabArena> value_arena,
+                   const SectorAllocator &sector_alloc, CacheManager &manager) noexcept;
+
+        CacheBlock(const CacheBlock &) = delete;
+
+        CacheBlock &operator=(const CacheBlock &) = delete;
+
+        u32 fstSec() const noexcept { return fst_sec_; }
+
+        u32 secCnt() const noexcept { return sectors_.size(); }
+
+        Sector &sector(u32 i) noexcept { return sectors_[i]; }
+
+        /**
+         * Called by a sector of the block when it turns from clean to dirty.
+         * */
+        void markDirty() noexcept;
+
+        /**
+         * Replace the value of sector `sec_num` with `buf` which has been written to device, so it's clean.
+         * */
+        void update(u32 sec_num, const u8 *buf) noexcept;
+
+        /**
+         * Copy the values of dirty sectors to the end of `values` and mark them clean. Each run of contiguous dirty
+         * sectors is appended to `runs` as (first sector, sector count).
+         * */
+        void takeDirty(std::vector<u8> &values, std::vector<std::pair<u32, u32>> &runs) noexcept;
+
+        /**
+         * Write back the dirty sectors of the block.
+         * */
+        void sync() noexcept;
+
+        ~CacheBlock() noexcept;
+
+        /**
+         * Give `value` back to `value_arena`, or free it if it doesn't come from the arena.
+         * */
+        static void releaseValue(util::SlabArena &value_arena, u8 *value) noexcept;
+
+        /**
+         * Whether the block is loaded by readahead and hasn't been read yet.
+         * */
+        void setPrefetched(bool prefetched) noexcept { prefetched_ = prefetched; }
+
+        /**
+         * Return whether the block is prefetched, and clear it so that only the first reader counts.
+         * */
+        bool takePrefetched() noexcept {
+            return prefetched_.load(std::memory_order_relaxed) && prefetched_.exchange(false);
+        }
+
+        /**
+         * Whether the block may be taken without the lock of its shard, it's set while the block is cached and
+         * cleared while it's evicted or written back.
+         * */
+        bool available() const noexcept { return available_.load(); }
+
+        void setAvailable(bool available) noexcept { available_.store(available); }
+
+        /**
+         * Set by the readers which take the block without the lock, instead of moving it in the recency list.
+         * */
+        void reference() noexcept {
+            if (!referenced_.load(std::memory_order_relaxed)) {
+                referenced_.store(true, std::memory_order_relaxed);
+            }
+        }
+
+        /**
+         * Return whether the block is referenced since the last call, and clear it.
+         * */
+        bool takeReferenced() noexcept { return referenced_.exchange(false, std::memory_order_relaxed); }
+
+    private:
+        std::atomic<bool> prefetched_{false};
+        std::atomic<bool> available_{false};
+        std::atomic<bool> referenced_{false};
+        u32 fst_sec_;
+        u32 sec_sz_;
+        u8 *value_;
+        std::shared_ptr<util::SlabArena> value_arena_;
+        std::vector<Sector, SectorAllocator> sectors_;
+        CacheManager &manager_;
+    };
+
+    /**
+     * Cache the sectors of the inner device in blocks of `blk_sec_cnt` sectors, so that a page or a cluster is
+     * fetched by one request and occupies one cache entry. A block is aligned to its size, and the sectors handed
+     * out share the ownership of the block they belong to. The inner device must use sectors of `SECTOR_SIZE`.
+     *
+     * The values and headers of blocks are taken from slab arenas sized by the cache capacity, so that a cache
+     * miss reuses the memory of an evicted block instead of going to the heap.
+     *
+     * The cache is write-back: dirty blocks are tracked apart from the cache map, which only ever drops clean ones. A
+     * background flusher writes back the blocks dirty for longer than `DIRTY_EXPIRE_MS`, or all of them once the
+     * dirty blocks exceed `DIRTY_BACKGROUND_RATIO` percent of the cache. Blocks whose sectors are held by others
+     * are skipped by the flusher, since they may be written at the same time. Readers are throttled to write back
+     * by themselves when the dirty blocks exceed `DIRTY_RATIO` percent of the cache.
+     *
+     * Once enabled by `setReadahead`, the reads are grouped into sequential streams by their sectors. A stream
+     * reads ahead asynchronously: when it reaches the first block of the window read ahead last time, the next
+     * window is queued for a background thread, and the window doubles up to the max. An access continuing no
+     * stream starts a new one without readahead, and a seek inside the window of a stream halves its window.
+     *
+     * The manager can be used by many threads. The blocks are split into shards by their numbers, each shard has
+     * its own lock and replacement policy, so that the readers of different blocks don't wait for each other. The
+     * blocks are loaded without holding any lock, a block loaded while its sectors are written is read again.
+     *
+     * A cache hit takes no lock at all: the cached blocks are published in a table of each shard, which is read
+     * under an epoch of `util::EpochDomain`, and an evicted block is kept until no reader may see it. Such a hit
+     * sets the reference bit of the block instead of moving it in the recency list, and the bit gives the block a
+     * second chance when it's about to be evicted. Plain hits don't update the readahead streams either, only the
+     * misses and the hits of blocks read ahead do.
+     *
+     * The blocks cached can be saved to a list file by `saveWarmList` before unmounting, and loaded in the background
+     * by `warmUp` after the next mount, so that the cache doesn't start cold.
+     * */
     class CacheManager : public Device {
     public:
-        explicit CacheManager(std::shared_ptr<Device> device, u32 cache_sz = CACHED_SECTOR_NUM) noexcept;
+        struct ReadaheadStats {
+            /**
+             * The number of blocks loaded by readahead.
+             * */
+            u64 issued_blk_cnt;
+            /**
+             * The number of blocks loaded by readahead and then read.
+             * */
+            u64 hit_blk_cnt;
+            /**
+             * The number of sequential reads which still have to wait for the device.
+             * */
+            u64 miss_cnt;
+        };
+
+        /**
+         * The counters of cache, in blocks. A dirty eviction drops a dirty block from the cache, which is kept
+         * until it's written back. The latencies are measured for reads and writes including the misses.
+         * */
+        struct CacheStats {
+            std::atomic<u64> hit_cnt{0};
+            std::atomic<u64> miss_cnt{0};
+            std::atomic<u64> evict_cnt{0};
+            std::atomic<u64> dirty_evict_cnt{0};
+            util::LatencyHistogram read_latency;
+            util::LatencyHistogram write_latency;
+        };
+
+        /**
+         * `cache_sz` is the max number of cached sectors, which is rounded down to whole blocks(at least one).
+         * `policy` chooses the clean block to evict.
+         * */
+        explicit CacheManager(std::shared_ptr<Device> device, u32 cache_sz = CACHED_SECTOR_NUM,
+                              u32 blk_sec_cnt = 1, bool huge_page = false,
+                              util::ReplacePolicy policy = util::ReplacePolicy::LRU) noexcept;
+
+        CacheManager(const CacheManager &) = delete;
+
+        CacheManager &operator=(const CacheManager &) = delete;
 
         std::optional<std::shared_ptr<Sector>> readSector(u32 sec_num) noexcept override;
 
         bool writeSectorValue(u32 sec_num, const u8 *buf) noexcept override;
 
+        /**
+         * Return the cached sectors directly, the missing ones are fetched from the inner device with as few
+         * `readSectors` calls as possible(one for each contiguous run of missing sectors).
+         * */
+        std::optional<std::vector<std::shared_ptr<Sector>>> readSectors(u32 sec_num, u32 cnt) noexcept override;
+
+        /**
+         * Write through to the inner device, and update the cached copies of the sectors.
+         * */
+        bool writeSectors(u32 sec_num, const std::vector<const u8 *> &bufs) noexcept override;
+
+        /**
+         * Discard the sectors in the inner device. The dirty blocks inside the range are made clean instead of being
+         * written back, unless they are held by others, so that their write back doesn't fill the range again.
+         * */
+        bool discardSectors(u32 sec_num, u32 cnt) noexcept override;
+
+        /**
+         * Zero the sectors in the inner device, or write zeros if it can't. The cached copies are zeroed, and the
+         * blocks fully inside the range are cached as clean zero blocks if the arena has room, so that the sectors
+         * are used without being read.
+         * */
+        bool zeroSectors(u32 sec_num, u32 cnt) noexcept override;
+
+        /**
+         * Write back all the dirty blocks and drop the cache.
+         * */
         void clear() noexcept override;
 
+        /**
+         * Write back all the dirty blocks, the caller must make sure no one is writing the cached sectors.
+         * */
+        void flush() noexcept override;
+
         bool contains(u32 sec_num) noexcept;
 
+        u32 blkSecCnt() const noexcept { return blk_sec_cnt_; }
+
+        u32 shardCnt() const noexcept { return shards_.size(); }
+
+        u32 dirtyBlkCnt() const noexcept { return dirty_blk_cnt_; }
+
+        const util::SlabArena &valueArena() const noexcept { return *value_arena_; }
+
+        /**
+         * Change how long a block can stay dirty and how often the flusher wakes up.
+         * */
+        void setWriteBack(u32 expire_ms, u32 interval_ms) noexcept;
+
+        /**
+         * Read ahead at most `max_sec_cnt` sectors for each sequential stream, which is also limited to half of the
+         * cache. Readahead is disabled by 0, which is the default.
+         * */
+        void setReadahead(u32 max_sec_cnt) noexcept;
+
+        ReadaheadStats readaheadStats() const noexcept;
+
+        /**
+         * Save the numbers of the blocks cached to the list file `path`, the ones used most recently first. The
+         * blocks before sector `meta_end_sec` are flagged as metadata. The list is written to a temporary file which
+         * then replaces `path`, so that a crash never leaves a partial list. Return false if it can't be written.
+         * */
+        bool saveWarmList(const std::string &path, u32 meta_end_sec) noexcept;
+
+        /**
+         * Load the blocks in the list file `path` saved by `saveWarmList` by a background thread, the metadata blocks
+         * first, at most as many as the cache holds. The blocks are sorted and the contiguous ones are loaded by one
+         * request. A block already cached or written during the load is skipped, so that the cache can be used at
+         * once. Return false if the list is missing or broken.
+         * */
+        bool warmUp(const std::string &path) noexcept;
+
+        /**
+         * The number of blocks loaded by `warmUp`.
+         * */
+        u64 warmBlkCnt() const noexcept { return warm_blk_cnt_; }
+
+        const CacheStats &cacheStats() const noexcept { return cache_stats_; }
+
+        void dumpStats(FILE *out) const noexcept override;
+
+        ~CacheManager() noexcept override;
+
     private:
+        friend class CacheBlock;
+
+        struct DirtyBlock {
+            std::shared_ptr<CacheBlock> block;
+            std::chrono::steady_clock::time_point dirtied_at;
+            /**
+             * Bumped each time the block gets dirty again, so that a block dirtied during the write back is kept.
+             * */
+            u64 gen;
+        };
+
+        /**
+         * Why the blocks are loaded. The blocks read ahead or warmed up only take memory from the arena, and aren't
+         * handed out.
+         * */
+        enum class LoadMode {
+            Read,
+            Readahead,
+            WarmUp,
+        };
+
+        /**
+         * The list file of `saveWarmList` is a `WarmListHeader` followed by `entry_cnt` entries. The blocks are
+         * saved by their first sectors, so that the list still works if the block size changes.
+         * */
+        struct WarmListHeader {
+            static constexpr u32 MAGIC = 0x4d524157; // "WARM"
+            static constexpr u32 VERSION = 1;
+
+            u32 magic;
+            u32 version;
+            u32 entry_cnt;
+        };
+
+        struct WarmListEntry {
+            static constexpr u32 METADATA = 1;
+
+            u32 fst_sec;
+            u32 flags;
+        };
+
+        struct ReadaheadStream {
+            /**
+             * The sectors read last time are [fst_sec, next_sec).
+             * */
+            u32 fst_sec;
+            u32 next_sec;
+            /**
+             * The number of blocks to read ahead next time, 0 for a new stream.
+             * */
+            u32 window;
+            /**
+             * The next window is read ahead once the stream reaches `marker_blk`, the blocks before `ra_end_blk`
+             * have been read ahead.
+             * */
+            u32 marker_blk;
+            u32 ra_end_blk;
+            /**
+             * When the stream is used last time, the stream used least recently is replaced by a new one.
+             * */
+            u64 used_at;
+        };
+
+        /**
+         * The blocks whose numbers are congruent modulo the number of shards, `mutex` guards the others.
+         * */
+        struct Shard {
+            Shard(u32 blk_cnt, util::ReplacePolicy policy) noexcept;
+
+            std::mutex mutex;
+            u32 blk_cnt;
+            util::LRUCacheMap<u32, std::shared_ptr<CacheBlock>> block_cache;
+            /**
+             * The blocks evicted while they are held by others, which are brought back instead of being loaded
+             * again, so that a block never has two copies written separately.
+             * */
+            std::unordered_map<u32, std::weak_ptr<CacheBlock>> evicted_blocks;
+            /**
+             * The cached blocks looked up without the lock, block `i` is in slot `i / shard count` modulo the size
+             * unless the slot is taken by another block.
+             * */
+            std::vector<std::atomic<CacheBlock *>> hit_slots;
+            /**
+             * The blocks evicted and the epochs they are retired with, they are kept until no reader may see them.
+             * */
+            std::deque<std::pair<u64, std::shared_ptr<CacheBlock>>> retired_blocks;
+            /**
+             * Bumped after the sectors of the shard are written to the inner device, a block loaded without the
+             * lock isn't cached if it's bumped during the load, since the value read may be stale.
+             * */
+            std::atomic<u64> write_gen{0};
+        };
+
+        Shard &shardOf(u32 blk_num) noexcept { return *shards_[blk_num % shards_.size()]; }
+
+        std::atomic<CacheBlock *> &hitSlot(Shard &shard, u32 blk_num) noexcept {
+            return shard.hit_slots[blk_num / shards_.size() & (shard.hit_slots.size() - 1)];
+        }
+
+        /**
+         * Take block `blk_num` if it's published by its shard, without locking. Return nullptr if it's not found.
+         * */
+        std::shared_ptr<CacheBlock> lookupBlock(u32 blk_num) noexcept;
+
+        /**
+         * Stop handing out the evicted `block` without the lock, and retire it. The lock of `shard` must be held.
+         * */
+        void retireBlock(Shard &shard, u32 blk_num, std::shared_ptr<CacheBlock> block) noexcept;
+
+        /**
+         * Free the retired blocks which no reader may see. The lock of `shard` must be held.
+         * */
+        void reclaimBlocks(Shard &shard) noexcept;
+
+        /**
+         * Find the blocks in [fst_blk, fst_blk + blk_cnt) and load the missing ones, store them in `blocks`. Return
+         * whether some of them are missing, `ra_hit` is set if some of them are read ahead.
+         * */
+        bool getBlocks(u32 fst_blk, u32 blk_cnt, std::shared_ptr<CacheBlock> *blocks, bool &ra_hit) noexcept;
+
+        /**
+         * Load the blocks in [fst_blk, fst_blk + blk_cnt) with one request, cache them and store them in `blocks`.
+         * The block at the end of device may be partial, it's loaded sector by sector when the whole request fails.
+         * No lock is held during the I/O, a block cached by others in the meantime is taken instead.
+         *
+         * For readahead and warm-up, the blocks are given up if the arena is used up, the device ends or they are
+         * written during the load, and the blocks read ahead are marked prefetched. Otherwise such a block is read
+         * again. Return the number of blocks loaded.
+         * */
+        u32 loadBlocks(u32 fst_blk, u32 blk_cnt, std::shared_ptr<CacheBlock> *blocks, LoadMode mode) noexcept;
+
+        std::shared_ptr<CacheBlock> makeBlock(u32 fst_sec, u32 sec_cnt, u8 *value) noexcept;
+
+        /**
+         * Find block `blk_num` in the cache, or among the blocks which have been evicted but are still dirty or held
+         * by others. The lock of `shard` must be held.
+         * */
+        std::shared_ptr<CacheBlock> findBlock(Shard &shard, u32 blk_num) noexcept;
+
+        /**
+         * Put `block` in the cache, and count the block evicted for it. The lock of `shard` must be held.
+         * */
+        void cacheBlock(Shard &shard, u32 blk_num, std::shared_ptr<CacheBlock> block) noexcept;
+
+        /**
+         * Whether block `blk_num` is cached or dirty, without touching it.
+         * */
+        bool isCached(u32 blk_num) noexcept;
+
+        void markDirty(CacheBlock &block) noexcept;
+
+        /**
+         * Keep the readers from taking the dirty `block` without the lock, and return whether it's held by no one
+         * else, so that its dirty sectors can be taken. Otherwise `available` is restored. The locks of `shard` and
+         * `dirty_mutex_` must be held.
+         * */
+        bool takeOver(Shard &shard, u32 blk_num, const std::shared_ptr<CacheBlock> &block, bool available) noexcept;
+
+        /**
+         * Write back the dirty blocks which are expired, or all of them if `all` is set. Unless `force` is set,
+         * the blocks held by others are skipped. The dirty sectors are written in the order of their numbers, and
+         * each contiguous range of them is written by one request of at most `MAX_BATCH_SECTOR_NUM` sectors.
+         * */
+        void writeBack(bool all, bool force) noexcept;
+
+        /**
+         * Write back by the reader itself if there are too many dirty blocks.
+         * */
+        void throttle() noexcept;
+
+        void runFlusher() noexcept;
+
+        /**
+         * Called after [sec_num, sec_num + cnt) is read, `missed` tells whether some of the blocks are loaded from
+         * the device. Update the stream continued by the read, and queue its next window if it's time to read ahead.
+         * */
+        void readahead(u32 sec_num, u32 cnt, bool missed) noexcept;
+
+        void runReadahead() noexcept;
+
+        /**
+         * Load the blocks `blk_nums` in order, each contiguous run of them by one request.
+         * */
+        void runWarmUp(std::vector<u32> blk_nums) noexcept;
+
         std::shared_ptr<Device> inner_device_;
-        util::LRUCacheMap<u32, std::shared_ptr<Sector>> sector_cache_;
+        u32 blk_sec_cnt_;
+        u32 blk_cnt_;
+        util::ReplacePolicy policy_;
+        std::shared_ptr<util::SlabArena> value_arena_;
+        std::shared_ptr<util::SlabArena> block_arena_;
+        std::shared_ptr<util::SlabArena> sector_arena_;
+        std::vector<std::unique_ptr<Shard>> shards_;
+        util::EpochDomain epoch_;
+        /**
+         * Dirty blocks ordered by their first sector, a sector may have two blocks if a block is still held by
+         * others when the cache is cleared.
+         * */
+        std::map<std::pair<u32, const CacheBlock *>, DirtyBlock> dirty_blocks_;
+        std::atomic<u32> dirty_blk_cnt_{0};
+        /**
+         * `dirty_mutex_` guards the dirty blocks. `flush_mutex_` serializes the writes to the inner device, so that
+         * an older value never overwrites a newer one. The locks are taken in the order of `flush_mutex_`, the lock
+         * of a shard and `dirty_mutex_`, at most one shard is locked at a time. Nothing else is locked while holding
+         * `flusher_mutex_` or `ra_mutex_`.
+         * */
+        std::mutex dirty_mutex_;
+        std::mutex flush_mutex_;
+        std::mutex flusher_mutex_;
+        std::condition_variable flusher_cv_;
+        std::chrono::milliseconds dirty_expire_;
+        std::chrono::milliseconds flush_interval_;
+        bool stop_flusher_ = false;
+        std::thread flusher_;
+        /**
+         * The readahead states, guarded by `ra_mutex_`. The windows waiting to be read ahead are queued as
+         * (first block, block count).
+         * */
+        std::mutex ra_mutex_;
+        u32 ra_min_blk_cnt_ = 0;
+        u32 ra_max_blk_cnt_ = 0;
+        std::vector<ReadaheadStream> streams_;
+        u64 stream_clock_ = 0;
+        std::deque<std::pair<u32, u32>> ra_queue_;
+        std::condition_variable ra_cv_;
+        bool stop_readahead_ = false;
+        std::atomic<u64> ra_issued_blk_cnt_{0};
+        std::atomic<u64> ra_hit_blk_cnt_{0};
+        std::atomic<u64> ra_miss_cnt_{0};
+        std::thread readahead_thread_;
+        std::atomic<bool> stop_warm_up_{false};
+        std::atomic<u64> warm_blk_cnt_{0};
+        std::thread warm_up_thread_;
+        CacheStats cache_stats_;
+    };
+
+    /**
+     * Discard the sectors freed by the filesystem in the background, so that freeing them doesn't wait for the
+     * device. The ranges queued are held until `commit`, as the change which freed them may not be on the device
+     * yet, and a crash would leave it pointing at the discarded sectors. The ranges committed are merged, and they are
+     * discarded together once `batch_sec_cnt` sectors are committed or every `delay_ms`.
+     *
+     * A range reused before it's discarded must be taken back by `cancel` before it's written, which waits for the
+     * discards in flight. Once the device fails to discard, the queue stops taking ranges.
+     * */
+    class DiscardQueue {
+    public:
+        explicit DiscardQueue(std::shared_ptr<Device> device, u32 batch_sec_cnt = DISCARD_BATCH_SECTOR_NUM,
+                              u32 delay_ms = DISCARD_DELAY_MS) noexcept;
+
+        DiscardQueue(const DiscardQueue &) = delete;
+
+        DiscardQueue &operator=(const DiscardQueue &) = delete;
+
+        void add(u32 sec_num, u32 cnt) noexcept;
+
+        /**
+         * Take back the sectors in [sec_num, sec_num + cnt) which are going to be used again.
+         * */
+        void cancel(u32 sec_num, u32 cnt) noexcept;
+
+        /**
+         * The change which freed the sectors queued so far is on the device, let them be discarded.
+         * */
+        void commit() noexcept;
+
+        /**
+         * Discard all the sectors committed now.
+         * */
+        void flush() noexcept;
+
+        u32 pendingSecCnt() const noexcept { return pending_sec_cnt_; }
+
+        u64 discardedSecCnt() const noexcept { return discarded_sec_cnt_; }
+
+        bool isSupported() const noexcept { return supported_; }
+
+        ~DiscardQueue() noexcept;
+
+    private:
+        void run() noexcept;
+
+        std::shared_ptr<Device> device_;
+        u32 batch_sec_cnt_;
+        std::chrono::milliseconds delay_;
+        /**
+         * The sector ranges queued and not committed yet, and the ones committed, both guarded by `mutex_`.
+         * `issue_mutex_` is held while the ranges taken out are discarded.
+         * */
+        util::RangeSet held_ranges_;
+        util::RangeSet ranges_;
+        std::atomic<u32> pending_sec_cnt_{0};
+        std::atomic<u64> discarded_sec_cnt_{0};
+        std::atomic<bool> supported_{true};
+        std::mutex mutex_;
+        std::mutex issue_mutex_;
+        std::condition_variable cv_;
+        bool stop_ = false;
+        std::thread thread_;
     };
 
 } // namespace device
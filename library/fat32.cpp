@@ -1,7 +1,11 @@
+#include <algorithm>
 #include <cassert>
 #include <cstring>
 #include <time.h>
 #include <sys/time.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
 
 #include "fat32.h"
 #include "util.h"
@@ -41,6 +45,61 @@ namespace fat32 {
         *((u32 *) &sec_buff[fat_ent_offset]) = (*((u32 *) &sec_buff[fat_ent_offset])) | fat_clus_entry_val;
     }
 
+    static u64 getFreeFATEntryMaskScalar(const u8 *fat_buff, u32 ent_cnt) {
+        u64 mask = 0;
+        for (u32 i = 0; i < ent_cnt; i++) {
+            if (readFATClusEntryVal(fat_buff, i * KFATEntSz) == 0) {
+                mask |= 1ull << i;
+            }
+        }
+        return mask;
+    }
+
+#if defined(__x86_64__)
+    static u64 getFreeFATEntryMaskSSE2(const u8 *fat_buff, u32 ent_cnt) {
+        const __m128i val_mask = _mm_set1_epi32(0x0FFFFFFF);
+        const __m128i zero = _mm_setzero_si128();
+        u64 mask = 0;
+        u32 i = 0;
+        for (; i + 4 <= ent_cnt; i += 4) {
+            __m128i entries = _mm_loadu_si128((const __m128i *) &fat_buff[i * KFATEntSz]);
+            __m128i is_free = _mm_cmpeq_epi32(_mm_and_si128(entries, val_mask), zero);
+            mask |= (u64) _mm_movemask_ps(_mm_castsi128_ps(is_free)) << i;
+        }
+        if (i < ent_cnt) {
+            mask |= getFreeFATEntryMaskScalar(&fat_buff[i * KFATEntSz], ent_cnt - i) << i;
+        }
+        return mask;
+    }
+
+    __attribute__((target("avx2")))
+    static u64 getFreeFATEntryMaskAVX2(const u8 *fat_buff, u32 ent_cnt) {
+        const __m256i val_mask = _mm256_set1_epi32(0x0FFFFFFF);
+        const __m256i zero = _mm256_setzero_si256();
+        u64 mask = 0;
+        u32 i = 0;
+        for (; i + 8 <= ent_cnt; i += 8) {
+            __m256i entries = _mm256_loadu_si256((const __m256i *) &fat_buff[i * KFATEntSz]);
+            __m256i is_free = _mm256_cmpeq_epi32(_mm256_and_si256(entries, val_mask), zero);
+            mask |= (u64) _mm256_movemask_ps(_mm256_castsi256_ps(is_free)) << i;
+        }
+        if (i < ent_cnt) {
+            mask |= getFreeFATEntryMaskScalar(&fat_buff[i * KFATEntSz], ent_cnt - i) << i;
+        }
+        return mask;
+    }
+#endif
+
+    u64 getFreeFATEntryMask(const u8 *fat_buff, u32 ent_cnt) {
+        assert(ent_cnt <= 64);
+#if defined(__x86_64__)
+        static const bool has_avx2 = __builtin_cpu_supports("avx2");
+        return has_avx2 ? getFreeFATEntryMaskAVX2(fat_buff, ent_cnt) : getFreeFATEntryMaskSSE2(fat_buff, ent_cnt);
+#else
+        return getFreeFATEntryMaskScalar(fat_buff, ent_cnt);
+#endif
+    }
+
     void assertFSInfo(FSInfo &fs_info) {
         assert(fs_info.lead_sig == KFsInfoLeadSig);
         assert(fs_info.struc_sig == KStrucSig);
@@ -354,93 +413,438 @@ namespace fat32 {
         return basis_name;
     }
 
+    /**
+     * ClusChain implement
+     * */
+    void ClusChain::push(u32 clus) noexcept {
+        if (!extents_.empty() && extents_.back().fst_clus + extents_.back().len == clus) {
+            extents_.back().len++;
+        } else {
+            extents_.push_back(ClusExtent{clus_cnt_, clus, 1});
+        }
+        clus_cnt_++;
+    }
+
+    void ClusChain::truncate(u32 clus_cnt) noexcept {
+        if (clus_cnt >= clus_cnt_) {
+            return;
+        }
+        if (clus_cnt == 0) {
+            extents_.clear();
+        } else {
+            u32 idx = extentIdx(clus_cnt - 1);
+            extents_.resize(idx + 1);
+            extents_.back().len = clus_cnt - extents_.back().fst_idx;
+        }
+        clus_cnt_ = clus_cnt;
+    }
+
+    u32 ClusChain::extentIdx(u32 n) const noexcept {
+        assert(n < clus_cnt_);
+        auto it = std::upper_bound(extents_.begin(), extents_.end(), n, [](u32 n, const ClusExtent &extent) {
+            return n < extent.fst_idx;
+        });
+        return it - extents_.begin() - 1;
+    }
+
+    u32 ClusChain::operator[](u32 n) const noexcept {
+        const ClusExtent &extent = extents_[extentIdx(n)];
+        return extent.fst_clus + (n - extent.fst_idx);
+    }
+
+    /**
+     * FreeExtents implement
+     * */
+    void FreeExtents::put(u32 fst_clus, u32 len) noexcept {
+        by_addr_.emplace(fst_clus, len);
+        by_len_.emplace(len, fst_clus);
+    }
+
+    void FreeExtents::remove(std::map<u32, u32>::iterator it) noexcept {
+        by_len_.erase({it->second, it->first});
+        by_addr_.erase(it);
+    }
+
+    void FreeExtents::insert(u32 fst_clus, u32 len) noexcept {
+        u32 end_clus = fst_clus + len;
+        auto next = by_addr_.lower_bound(fst_clus);
+        assert(next == by_addr_.end() || next->first >= end_clus);
+        if (next != by_addr_.end() && next->first == end_clus) {
+            end_clus += next->second;
+            remove(next++);
+        }
+        if (next != by_addr_.begin()) {
+            auto prev = std::prev(next);
+            assert(prev->first + prev->second <= fst_clus);
+            if (prev->first + prev->second == fst_clus) {
+                fst_clus = prev->first;
+                remove(prev);
+            }
+        }
+        put(fst_clus, end_clus - fst_clus);
+    }
+
+    void FreeExtents::erase(u32 fst_clus, u32 len) noexcept {
+        auto it = by_addr_.upper_bound(fst_clus);
+        assert(it != by_addr_.begin());
+        it--;
+        u32 ext_fst_clus = it->first, ext_end_clus = it->first + it->second;
+        assert(fst_clus + len <= ext_end_clus);
+        remove(it);
+        if (ext_fst_clus < fst_clus) {
+            put(ext_fst_clus, fst_clus - ext_fst_clus);
+        }
+        if (fst_clus + len < ext_end_clus) {
+            put(fst_clus + len, ext_end_clus - (fst_clus + len));
+        }
+    }
+
+    u32 FreeExtents::runLen(u32 clus) const noexcept {
+        auto it = by_addr_.upper_bound(clus);
+        if (it == by_addr_.begin()) {
+            return 0;
+        }
+        it--;
+        return clus < it->first + it->second ? it->first + it->second - clus : 0;
+    }
+
+    std::optional<u32> FreeExtents::bestFit(u32 len) const noexcept {
+        auto it = by_len_.lower_bound({len, 0});
+        if (it == by_len_.end()) {
+            return std::nullopt;
+        }
+        return {it->second};
+    }
+
+    std::optional<u32> FreeExtents::nextFit(u32 clus, u32 len) const noexcept {
+        if (runLen(clus) >= len) {
+            return {clus};
+        }
+        auto from = by_addr_.upper_bound(clus);
+        for (auto it = from; it != by_addr_.end(); it++) {
+            if (it->second >= len) {
+                return {it->first};
+            }
+        }
+        for (auto it = by_addr_.begin(); it != from; it++) {
+            if (it->second >= len) {
+                return {it->first};
+            }
+        }
+        return std::nullopt;
+    }
+
+    std::vector<std::pair<u32, u32>> FreeExtents::longest(u32 clus_cnt) const noexcept {
+        std::vector<std::pair<u32, u32>> extents;
+        for (auto it = by_len_.rbegin(); it != by_len_.rend() && clus_cnt > 0; it++) {
+            u32 len = std::min(it->first, clus_cnt);
+            extents.emplace_back(it->second, len);
+            clus_cnt -= len;
+        }
+        return extents;
+    }
+
     /**
      * FAT implement
      * */
-    FAT::FAT(BPB bpb, u32 free_count, std::shared_ptr<device::Device> device) noexcept
+    FAT::FAT(BPB bpb, u32 nxt_free, std::shared_ptr<device::Device> device, u32 free_count) noexcept
             : bpb_{bpb}, device_{std::move(device)} {
         start_sec_no_ = getFirstFATSector(bpb, 0);
         fat_sec_num_ = bpb.BPB_FATsz32;
+        // bit 7 of BPB_ext_flags disables the mirroring, then bits 0-3 tell the only active FAT
+        mirroring_ = (bpb.BPB_ext_flags & 0x80) == 0;
+        active_fat_ = mirroring_ || (bpb.BPB_ext_flags & 0x0F) >= bpb.BPB_num_fats ? 0 : bpb.BPB_ext_flags & 0x0F;
+        dirty_sec_bitmap_.assign((fat_sec_num_ + 63) / 64, 0);
         cnt_of_clus_ = getCountOfClusters(bpb);
-        free_count_ = free_count;
+        // the clusters are numbered from 2 to cnt_of_clus_ + 1, as long as the FAT has their entries
+        end_of_clus_ = std::min(cnt_of_clus_ + 2, fat_sec_num_ * (SECTOR_SIZE / KFATEntSz));
+        nxt_free_ = nxt_free;
+        fs_info_valid_ = nxt_free != 0xFFFFFFFF || free_count != 0xFFFFFFFF;
+        if (free_count <= cnt_of_clus_) { // 0xFFFFFFFF means unknown, and it's only a hint anyway
+            avail_clus_cnt_ = {free_count};
+        }
     }
 
     u32 FAT::availClusCnt() noexcept {
-        if (this->avail_clus_cnt_.has_value()) {
-            return this->avail_clus_cnt_.value();
+        if (!this->avail_clus_cnt_.has_value()) {
+            scanFAT(this->fatSecCnt());
         }
+        return this->avail_clus_cnt_.value();
+    }
+
+    u32 FAT::freeCount() const noexcept {
+        return this->avail_clus_cnt_.value_or(0xFFFFFFFF);
+    }
+
+    u32 FAT::nxtFree() noexcept {
+        if (this->nxt_free_ != 0xFFFFFFFF) {
+            return this->nxt_free_;
+        }
+        return findScannedFreeClus().value_or(0xFFFFFFFF);
+    }
+
+    void FAT::writeFSInfo() noexcept {
+        auto fs_info_sec = this->device_->readSector(bpb_.BPB_fs_info).value();
+        auto *fs_info = (FSInfo *) fs_info_sec->write_ptr(0);
+        fs_info->free_count = freeCount();
+        fs_info->nxt_free = nxtFree();
+        this->fs_info_valid_ = true;
+    }
+
+    void FAT::invalidateFSInfo() noexcept {
+        auto fs_info_sec = this->device_->readSector(bpb_.BPB_fs_info).value();
+        auto *fs_info = (FSInfo *) fs_info_sec->write_ptr(0);
+        fs_info->free_count = 0xFFFFFFFF;
+        fs_info->nxt_free = 0xFFFFFFFF;
+        this->fs_info_valid_ = false;
+    }
+
+    u32 FAT::fatSecCnt() const noexcept {
+        u32 ent_per_sec = SECTOR_SIZE / KFATEntSz;
+        return (this->end_of_clus_ + ent_per_sec - 1) / ent_per_sec;
+    }
+
+    bool FAT::isScanned(u32 clus) const noexcept {
+        return clus / (SECTOR_SIZE / KFATEntSz) < this->scanned_sec_cnt_;
+    }
 
-        u32 avail_clus_cnt = 0;
-        u32 cnt_of_clus = 0;
-        for (u32 i = this->start_sec_no_; i < this->end_sec_no() && cnt_of_clus < this->cnt_of_clus_; ++i) {
-            for (u32 j = 0; j < SECTOR_SIZE / KFATEntSz && cnt_of_clus < this->cnt_of_clus_; ++j, ++cnt_of_clus) {
-                if (readFatEntry(i, j * KFATEntSz) == 0) {
-                    avail_clus_cnt += 1;
+    void FAT::scanFAT(u32 sec_cnt) noexcept {
+        // the FAT is read in batches, and the entries of each sector are checked 64 at a time, which fill a word of
+        // the bitmap
+        static_assert(SECTOR_SIZE / KFATEntSz % 64 == 0);
+        u32 ent_per_sec = SECTOR_SIZE / KFATEntSz;
+        u32 end_sec = this->scanned_sec_cnt_ + std::min(sec_cnt, this->fatSecCnt() - this->scanned_sec_cnt_);
+        if (this->free_bitmap_.empty()) {
+            this->free_bitmap_.assign((this->end_of_clus_ + 63) / 64, 0);
+        }
+        for (u32 i = this->scanned_sec_cnt_; i < end_sec; i += MAX_BATCH_SECTOR_NUM) {
+            u32 batch_sec_cnt = std::min((u32) MAX_BATCH_SECTOR_NUM, end_sec - i);
+            std::vector<std::shared_ptr<device::Sector>> sectors;
+            if (this->mirror_.empty()) {
+                sectors = this->device_->readSectors(getFirstFATSector(bpb_, this->active_fat_) + i,
+                                                     batch_sec_cnt).value();
+            }
+            for (u32 j = 0; j < batch_sec_cnt; j++) {
+                auto *sec_buff = this->mirror_.empty() ? (const u8 *) sectors[j]->read_ptr(0)
+                                                       : (const u8 *) &this->mirror_[(i + j) * ent_per_sec];
+                u32 fst_clus = (i + j) * ent_per_sec;
+                for (u32 k = 0; k < ent_per_sec && fst_clus + k < this->end_of_clus_; k += 64) {
+                    u32 ent_cnt = std::min((u32) 64, this->end_of_clus_ - (fst_clus + k));
+                    u64 mask = getFreeFATEntryMask(&sec_buff[k * KFATEntSz], ent_cnt);
+                    if (fst_clus + k == 0) { // the two reserved entries are never free
+                        mask &= ~3ull;
+                    }
+                    this->free_bitmap_[(fst_clus + k) / 64] = mask;
                 }
             }
         }
+        this->scanned_sec_cnt_ = end_sec;
 
-        this->avail_clus_cnt_ = {avail_clus_cnt};
-        return avail_clus_cnt;
+        if (this->scanned_sec_cnt_ == this->fatSecCnt()) { // the count is exact from now on, whatever FSInfo says
+            u32 avail_clus_cnt = 0;
+            for (u64 word: this->free_bitmap_) {
+                avail_clus_cnt += __builtin_popcountll(word);
+            }
+            this->avail_clus_cnt_ = {avail_clus_cnt};
+        }
     }
 
-    void FAT::inc_avail_cnt(u64 no) noexcept {
+    bool FAT::isClusFree(u32 clus) noexcept {
+        if (clus >= this->end_of_clus_ || !isValidCluster(clus)) {
+            return false;
+        }
+        if (isScanned(clus)) {
+            return (this->free_bitmap_[clus / 64] >> (clus % 64) & 1) != 0;
+        }
+        FATPos fat_pos = getClusPosOnFAT(bpb_, clus);
+        return readFatEntry(fat_pos.fat_sec_num, fat_pos.fat_ent_offset) == 0;
+    }
+
+    void FAT::markClusFree(u32 clus) noexcept {
+        // clusters out of the bitmap are never allocated, neither are they counted
+        if (clus >= this->end_of_clus_ || !isValidCluster(clus)) {
+            return;
+        }
+        if (isScanned(clus)) {
+            if (isClusFree(clus)) {
+                return;
+            }
+            this->free_bitmap_[clus / 64] |= 1ull << (clus % 64);
+            this->fst_free_word_ = std::min(this->fst_free_word_, clus / 64);
+        }
         if (this->avail_clus_cnt_.has_value()) {
-            this->avail_clus_cnt_.value() += no;
+            this->avail_clus_cnt_.value() += 1;
         }
     }
 
-    void FAT::dec_avail_cnt(u64 no) noexcept {
+    void FAT::markClusUsed(u32 clus) noexcept {
+        if (isScanned(clus)) {
+            if (!isClusFree(clus)) {
+                return;
+            }
+            this->free_bitmap_[clus / 64] &= ~(1ull << (clus % 64));
+        }
         if (this->avail_clus_cnt_.has_value()) {
-            this->avail_clus_cnt_.value() -= no;
+            this->avail_clus_cnt_.value() -= 1;
+        }
+    }
+
+    std::optional<u32> FAT::findScannedFreeClus() noexcept {
+        u32 scanned_word_cnt = std::min((u32) this->free_bitmap_.size(),
+                                        this->scanned_sec_cnt_ * (SECTOR_SIZE / KFATEntSz) / 64);
+        for (u32 i = this->fst_free_word_; i < scanned_word_cnt; i++) {
+            if (this->free_bitmap_[i] != 0) {
+                this->fst_free_word_ = i;
+                return {i * 64 + __builtin_ctzll(this->free_bitmap_[i])};
+            }
         }
+        this->fst_free_word_ = std::max(this->fst_free_word_, scanned_word_cnt);
+        return std::nullopt;
     }
 
-    std::optional<std::vector<u32>> FAT::allocClus(u32 require_clus_num) noexcept {
+    std::optional<u32> FAT::findFreeClus() noexcept {
+        while (true) {
+            auto clus = findScannedFreeClus();
+            if (clus.has_value() || this->scanned_sec_cnt_ == this->fatSecCnt()) {
+                return clus;
+            }
+            scanFAT(MAX_BATCH_SECTOR_NUM);
+        }
+    }
+
+    FreeExtents FAT::buildFreeExtents() noexcept {
+        scanFAT(this->fatSecCnt());
+        FreeExtents free_extents;
+        u32 run_fst_clus = 0, run_clus_cnt = 0;
+        u32 clus = 0;
+        while (clus < this->end_of_clus_) {
+            u64 word = this->free_bitmap_[clus / 64] >> (clus % 64);
+            u32 used_cnt = word == 0 ? 64 - clus % 64 : __builtin_ctzll(word);
+            if (used_cnt > 0) { // the run ends at `clus`
+                if (run_clus_cnt > 0) {
+                    free_extents.insert(run_fst_clus, run_clus_cnt);
+                    run_clus_cnt = 0;
+                }
+                clus += used_cnt;
+                continue;
+            }
+            u32 free_cnt = ~word == 0 ? 64 : __builtin_ctzll(~word);
+            if (run_clus_cnt == 0) {
+                run_fst_clus = clus;
+            }
+            run_clus_cnt += free_cnt;
+            clus += free_cnt;
+        }
+        if (run_clus_cnt > 0) {
+            free_extents.insert(run_fst_clus, run_clus_cnt);
+        }
+        return free_extents;
+    }
+
+    std::optional<std::vector<u32>> FAT::allocClus(u32 require_clus_num, u32 goal_clus) noexcept {
+        if (this->availClusCnt() < require_clus_num && this->scanned_sec_cnt_ < this->fatSecCnt()) {
+            scanFAT(this->fatSecCnt()); // the free count taken from FSInfo may be too small, count them all
+        }
         if (this->availClusCnt() < require_clus_num) {
             return std::nullopt;
         }
+        if (this->alloc_policy_ != AllocPolicy::FirstFit) {
+            return allocClusExtents(require_clus_num, goal_clus);
+        }
 
-        FATPos fat_pos;
-        u32 alloc_num = 0;
-        u32 cnt_of_clus = 0;
-        u32 pre_clus = 0, cur_clus = 0;
         std::vector<u32> clus_chain;
-        if (this->free_count_ != 0xFFFFFFFF) {
-            cur_clus = this->free_count_;
-            clus_chain.push_back(cur_clus);
-            this->free_count_ = 0xFFFFFFFF;
-            dec_avail_cnt(1);
-            alloc_num += 1;
-            if (alloc_num == require_clus_num) {
-                fat_pos = getClusPosOnFAT(bpb_, cur_clus);
+        clus_chain.reserve(require_clus_num);
+        if (this->nxt_free_ != 0xFFFFFFFF) {
+            // the hint is only taken once, and its entry is written at once, so that a later scan of the FAT won't
+            // find it free
+            if (require_clus_num > 0 && isClusFree(this->nxt_free_)) {
+                clus_chain.push_back(this->nxt_free_);
+                markClusUsed(this->nxt_free_);
+                FATPos fat_pos = getClusPosOnFAT(bpb_, this->nxt_free_);
                 writeFatEntry(fat_pos.fat_sec_num, fat_pos.fat_ent_offset, KFat32EocMark);
-                return {clus_chain};
             }
+            this->nxt_free_ = 0xFFFFFFFF;
         }
-
-        for (u32 i = this->start_sec_no_; i < this->end_sec_no() && cnt_of_clus < this->cnt_of_clus_; ++i) {
-            for (u32 j = 0; j < SECTOR_SIZE / KFATEntSz && cnt_of_clus < this->cnt_of_clus_; ++j, ++cnt_of_clus) {
-                if (readFatEntry(i, j * KFATEntSz) == 0) { // find
-                    pre_clus = cur_clus;
-                    cur_clus = cnt_of_clus;
-                    if (pre_clus != 0) {
-                        fat_pos = getClusPosOnFAT(bpb_, pre_clus);
-                        writeFatEntry(fat_pos.fat_sec_num, fat_pos.fat_ent_offset, cur_clus);
-                    }
-                    clus_chain.push_back(cnt_of_clus);
-                    dec_avail_cnt(1);
-                    alloc_num += 1;
-                    if (alloc_num == require_clus_num) {
-                        fat_pos = getClusPosOnFAT(bpb_, cur_clus);
-                        writeFatEntry(fat_pos.fat_sec_num, fat_pos.fat_ent_offset, KFat32EocMark);
-                        return {clus_chain};
-                    }
+        while (clus_chain.size() < require_clus_num) {
+            auto clus = findFreeClus();
+            if (!clus.has_value()) { // the free count taken from FSInfo was too large
+                for (u32 alloc_clus: clus_chain) {
+                    markClusFree(alloc_clus);
+                    FATPos fat_pos = getClusPosOnFAT(bpb_, alloc_clus);
+                    writeFatEntry(fat_pos.fat_sec_num, fat_pos.fat_ent_offset, 0);
                 }
+                writeThrough();
+                return std::nullopt;
+            }
+            clus_chain.push_back(clus.value());
+            markClusUsed(clus.value());
+        }
+
+        for (u32 i = 0; i < clus_chain.size(); i++) {
+            FATPos fat_pos = getClusPosOnFAT(bpb_, clus_chain[i]);
+            u32 next_clus = i + 1 < clus_chain.size() ? clus_chain[i + 1] : KFat32EocMark;
+            writeFatEntry(fat_pos.fat_sec_num, fat_pos.fat_ent_offset, next_clus);
+        }
+        writeThrough();
+        keepClus(clus_chain);
+        return {clus_chain};
+    }
+
+    std::optional<std::vector<u32>> FAT::allocClusExtents(u32 require_clus_num, u32 goal_clus) noexcept {
+        if (!this->free_extents_.has_value()) {
+            this->free_extents_ = buildFreeExtents();
+        }
+        if (require_clus_num == 0) {
+            return {std::vector<u32>()};
+        }
+        if (this->availClusCnt() < require_clus_num) { // the free count taken from FSInfo was too large
+            return std::nullopt;
+        }
+        if (this->nxt_free_ != 0xFFFFFFFF) { // the hint of FSInfo is where NextFit starts
+            this->nxt_fit_clus_ = this->nxt_free_;
+            this->nxt_free_ = 0xFFFFFFFF;
+        }
+
+        // a single run is taken if there is one long enough, otherwise the longest ones, in the order of clusters
+        FreeExtents &free_extents = this->free_extents_.value();
+        std::optional<u32> fst_clus;
+        if (free_extents.runLen(goal_clus) >= require_clus_num) {
+            fst_clus = {goal_clus};
+        } else if (this->alloc_policy_ == AllocPolicy::BestFit) {
+            fst_clus = free_extents.bestFit(require_clus_num);
+        } else {
+            fst_clus = free_extents.nextFit(this->nxt_fit_clus_, require_clus_num);
+        }
+        std::vector<std::pair<u32, u32>> runs;
+        if (fst_clus.has_value()) {
+            runs.emplace_back(fst_clus.value(), require_clus_num);
+        } else {
+            runs = free_extents.longest(require_clus_num);
+            std::sort(runs.begin(), runs.end());
+        }
+
+        std::vector<u32> clus_chain;
+        clus_chain.reserve(require_clus_num);
+        for (auto [run_fst_clus, run_clus_cnt]: runs) {
+            free_extents.erase(run_fst_clus, run_clus_cnt);
+            for (u32 clus = run_fst_clus; clus < run_fst_clus + run_clus_cnt; clus++) {
+                this->free_bitmap_[clus / 64] &= ~(1ull << (clus % 64));
+                clus_chain.push_back(clus);
             }
+            this->avail_clus_cnt_.value() -= run_clus_cnt;
+        }
+        if (!runs.empty()) {
+            this->nxt_fit_clus_ = runs.back().first + runs.back().second;
         }
 
-        assert(false); // unreachable
+        for (u32 i = 0; i < clus_chain.size(); i++) {
+            FATPos fat_pos = getClusPosOnFAT(bpb_, clus_chain[i]);
+            u32 next_clus = i + 1 < clus_chain.size() ? clus_chain[i + 1] : KFat32EocMark;
+            writeFatEntry(fat_pos.fat_sec_num, fat_pos.fat_ent_offset, next_clus);
+        }
+        writeThrough();
+        keepClus(clus_chain);
+        return {clus_chain};
     }
 
     void FAT::freeClus(u32 fst_clus) noexcept {
@@ -448,12 +852,21 @@ namespace fat32 {
         if (!isValidCluster(fst_clus)) {
             return;
         }
+        u32 run_fst_clus = 0, run_clus_cnt = 0; // the contiguous clusters freed are released together
         while (!isEndOfClusChain(cur_clus)) {
+            if (cur_clus != run_fst_clus + run_clus_cnt) {
+                releaseClus(run_fst_clus, run_clus_cnt);
+                run_fst_clus = cur_clus;
+                run_clus_cnt = 0;
+            }
+            run_clus_cnt++;
             FATPos fat_pos = getClusPosOnFAT(bpb_, cur_clus);
+            markClusFree(cur_clus);
             cur_clus = readFatEntry(fat_pos.fat_sec_num, fat_pos.fat_ent_offset);
             writeFatEntry(fat_pos.fat_sec_num, fat_pos.fat_ent_offset, 0); // free
-            inc_avail_cnt(1);
         }
+        releaseClus(run_fst_clus, run_clus_cnt);
+        writeThrough();
     }
 
     std::vector<u32> FAT::readClusChains(u32 fst_clus) noexcept {
@@ -471,11 +884,27 @@ namespace fat32 {
         return clus_chains;
     }
 
+    ClusChain FAT::readClusExtents(u32 fst_clus) noexcept {
+        ClusChain clus_chain;
+
+        if (isValidCluster(fst_clus)) {
+            u32 cur_clus = fst_clus;
+            while (!isEndOfClusChain(cur_clus)) {
+                clus_chain.push(cur_clus);
+                FATPos fat_pos = getClusPosOnFAT(bpb_, cur_clus);
+                cur_clus = readFatEntry(fat_pos.fat_sec_num, fat_pos.fat_ent_offset);
+            }
+        }
+
+        return clus_chain;
+    }
+
     bool FAT::resize(u32 &fst_clus, u32 clus_num, bool clear) noexcept {
         FATPos fat_pos;
         u32 pre_clus = fst_clus;
         u32 cur_clus = fst_clus;
         u32 clus_cnt = 0;
+        u32 run_fst_clus = 0, run_clus_cnt = 0; // the contiguous clusters freed are released together
         if (isValidCluster(fst_clus)) {
             while (!isEndOfClusChain(cur_clus)) {
                 pre_clus = cur_clus;
@@ -485,16 +914,23 @@ namespace fat32 {
                 if (clus_cnt > clus_num) { // free (clus_cnt - clus_num) sectors
                     fat_pos = getClusPosOnFAT(bpb_, pre_clus);
                     writeFatEntry(fat_pos.fat_sec_num, fat_pos.fat_ent_offset, 0);
-                    dec_avail_cnt(1);
+                    markClusFree(pre_clus);
+                    if (pre_clus != run_fst_clus + run_clus_cnt) {
+                        releaseClus(run_fst_clus, run_clus_cnt);
+                        run_fst_clus = pre_clus;
+                        run_clus_cnt = 0;
+                    }
+                    run_clus_cnt++;
                 } else if (clus_cnt == clus_num) {
                     fat_pos = getClusPosOnFAT(bpb_, pre_clus);
                     writeFatEntry(fat_pos.fat_sec_num, fat_pos.fat_ent_offset, KFat32EocMark);
                 }
             }
         }
+        releaseClus(run_fst_clus, run_clus_cnt);
 
         if (clus_cnt < clus_num) { // alloc (clus_num - clus_cnt) sectors
-            auto result = allocClus(clus_num - clus_cnt);
+            auto result = allocClus(clus_num - clus_cnt, isValidCluster(fst_clus) ? pre_clus + 1 : 0);
             if (!result.has_value()) {
                 return false;
             }
@@ -512,31 +948,254 @@ namespace fat32 {
         } else if (clus_num == 0) {
             fst_clus = 0;
         }
+        writeThrough();
+
+        return true;
+    }
+
+    bool FAT::resize(u32 &fst_clus, ClusChain &clus_chain, u32 clus_num, bool clear) noexcept {
+        FATPos fat_pos;
+        u32 clus_cnt = clus_chain.size();
+        if (clus_num < clus_cnt) { // free (clus_cnt - clus_num) clusters, each extent is released together
+            if (clus_num > 0) {
+                fat_pos = getClusPosOnFAT(bpb_, clus_chain[clus_num - 1]);
+                writeFatEntry(fat_pos.fat_sec_num, fat_pos.fat_ent_offset, KFat32EocMark);
+            }
+            const auto &extents = clus_chain.extents();
+            for (u32 i = clus_chain.extentIdx(clus_num); i < extents.size(); i++) {
+                u32 run_fst_clus = extents[i].fst_clus + (std::max(clus_num, extents[i].fst_idx) - extents[i].fst_idx);
+                u32 run_end_clus = extents[i].fst_clus + extents[i].len;
+                for (u32 clus = run_fst_clus; clus < run_end_clus; clus++) {
+                    fat_pos = getClusPosOnFAT(bpb_, clus);
+                    writeFatEntry(fat_pos.fat_sec_num, fat_pos.fat_ent_offset, 0);
+                    markClusFree(clus);
+                }
+                releaseClus(run_fst_clus, run_end_clus - run_fst_clus);
+            }
+            clus_chain.truncate(clus_num);
+        } else if (clus_num > clus_cnt) { // alloc (clus_num - clus_cnt) clusters and link them to the tail
+            auto result = allocClus(clus_num - clus_cnt, clus_chain.empty() ? 0 : clus_chain.back() + 1);
+            if (!result.has_value()) {
+                return false;
+            }
+            auto &alloc_chain = result.value();
+            if (clear) {
+                clearClusChain(alloc_chain);
+            }
+            if (clus_chain.empty()) {
+                fst_clus = alloc_chain[0];
+            } else {
+                fat_pos = getClusPosOnFAT(bpb_, clus_chain.back());
+                writeFatEntry(fat_pos.fat_sec_num, fat_pos.fat_ent_offset, alloc_chain[0]);
+            }
+            for (u32 clus: alloc_chain) {
+                clus_chain.push(clus);
+            }
+        }
+        if (clus_num == 0) {
+            fst_clus = 0;
+        }
+        writeThrough();
 
         return true;
     }
 
     void FAT::writeFatEntry(u32 sec_no, u32 fat_ent_offset, u32 val) noexcept {
-        u32 fat_sz = bpb_.BPB_FATsz32;
-        for(u16 i = 0; i < bpb_.BPB_num_fats; i++) {
-            auto sector = this->device_->readSector(sec_no + i * fat_sz).value();
+        if (this->fs_info_valid_) { // FSInfo is dirtied no later than the FAT sectors changed from now on
+            invalidateFSInfo();
+        }
+        // only the active FAT is written, the others are brought up to date by `flushFAT`
+        u32 fat_sec_no = sec_no - this->start_sec_no_;
+        if (!this->mirror_.empty()) {
+            writeFATClusEntryVal((u8 *) &this->mirror_[fat_sec_no * (SECTOR_SIZE / KFATEntSz)], fat_ent_offset, val);
+            if (this->unwritten_secs_.empty() || this->unwritten_secs_.back() != fat_sec_no) {
+                this->unwritten_secs_.push_back(fat_sec_no);
+            }
+        } else {
+            auto sector = this->device_->readSector(getFirstFATSector(bpb_, this->active_fat_) + fat_sec_no).value();
             writeFATClusEntryVal((u8 *) sector->write_ptr(0), fat_ent_offset, val);
         }
+        this->dirty_sec_bitmap_[fat_sec_no / 64] |= 1ull << (fat_sec_no % 64);
+    }
+
+    void FAT::writeThrough() noexcept {
+        // the FAT on the device never lags behind the directory entries the caller writes after, which may be
+        // written back by the device at any time
+        std::sort(this->unwritten_secs_.begin(), this->unwritten_secs_.end());
+        auto end = std::unique(this->unwritten_secs_.begin(), this->unwritten_secs_.end());
+        for (auto it = this->unwritten_secs_.begin(); it != end;) {
+            // the contiguous sectors are written together
+            std::vector<const u8 *> bufs;
+            u32 run_fst_sec = *it;
+            for (; it != end && *it == run_fst_sec + bufs.size() && bufs.size() < MAX_BATCH_SECTOR_NUM; ++it) {
+                bufs.push_back((const u8 *) &this->mirror_[(u64) *it * (SECTOR_SIZE / KFATEntSz)]);
+            }
+            bool ok = this->device_->writeSectors(getFirstFATSector(bpb_, this->active_fat_) + run_fst_sec, bufs);
+            assert(ok);
+        }
+        this->unwritten_secs_.clear();
     }
 
     u32 FAT::readFatEntry(u32 sec_no, u32 fat_ent_offset) noexcept {
-        auto sector = this->device_->readSector(sec_no).value();
+        u32 fat_sec_no = sec_no - this->start_sec_no_;
+        if (!this->mirror_.empty()) {
+            return readFATClusEntryVal((const u8 *) &this->mirror_[fat_sec_no * (SECTOR_SIZE / KFATEntSz)],
+                                       fat_ent_offset);
+        }
+        auto sector = this->device_->readSector(getFirstFATSector(bpb_, this->active_fat_) + fat_sec_no).value();
         return readFATClusEntryVal((const u8 *) sector->read_ptr(0), fat_ent_offset);
     }
 
+    bool FAT::loadMirror(u64 max_size) noexcept {
+        if (!this->mirror_.empty()) {
+            return true;
+        }
+        if ((u64) this->fat_sec_num_ * SECTOR_SIZE > max_size) {
+            return false;
+        }
+
+        u32 ent_per_sec = SECTOR_SIZE / KFATEntSz;
+        std::vector<u32> mirror((u64) this->fat_sec_num_ * ent_per_sec);
+        for (u32 i = 0; i < this->fat_sec_num_; i += MAX_BATCH_SECTOR_NUM) {
+            std::vector<u8 *> bufs;
+            for (u32 j = i; j < std::min(this->fat_sec_num_, i + MAX_BATCH_SECTOR_NUM); j++) {
+                bufs.push_back((u8 *) &mirror[j * ent_per_sec]);
+            }
+            if (!this->device_->readSectorsValue(getFirstFATSector(bpb_, this->active_fat_) + i, bufs)) {
+                return false;
+            }
+        }
+        this->mirror_.swap(mirror);
+        return true;
+    }
+
+    void FAT::flushFAT() noexcept {
+        u32 ent_per_sec = SECTOR_SIZE / KFATEntSz;
+        auto is_dirty = [this](u32 fat_sec_no) {
+            return (this->dirty_sec_bitmap_[fat_sec_no / 64] >> (fat_sec_no % 64) & 1) != 0;
+        };
+        for (u32 i = 0; i < this->fat_sec_num_;) {
+            if (this->dirty_sec_bitmap_[i / 64] == 0) { // skip the clean words
+                i = (i / 64 + 1) * 64;
+                continue;
+            }
+            if (!is_dirty(i)) {
+                i++;
+                continue;
+            }
+
+            // the contiguous dirty sectors are copied together, from the mirror or from the active FAT
+            u32 run_end = i;
+            while (run_end < this->fat_sec_num_ && run_end - i < MAX_BATCH_SECTOR_NUM && is_dirty(run_end)) {
+                run_end++;
+            }
+            std::vector<std::shared_ptr<device::Sector>> sectors;
+            std::vector<const u8 *> bufs;
+            if (this->mirror_.empty()) {
+                sectors = this->device_->readSectors(getFirstFATSector(bpb_, this->active_fat_) + i,
+                                                     run_end - i).value();
+            }
+            for (u32 j = i; j < run_end; j++) {
+                bufs.push_back(this->mirror_.empty() ? (const u8 *) sectors[j - i]->read_ptr(0)
+                                                     : (const u8 *) &this->mirror_[j * ent_per_sec]);
+            }
+            for (u16 fat_no = 0; fat_no < bpb_.BPB_num_fats; fat_no++) {
+                if (fat_no != this->active_fat_ && this->mirroring_) {
+                    bool ok = this->device_->writeSectors(getFirstFATSector(bpb_, fat_no) + i, bufs);
+                    assert(ok);
+                }
+            }
+            i = run_end;
+        }
+        std::fill(this->dirty_sec_bitmap_.begin(), this->dirty_sec_bitmap_.end(), 0);
+    }
+
+    void FAT::setDiscardQueue(std::shared_ptr<device::DiscardQueue> discard_queue) noexcept {
+        this->discard_queue_ = std::move(discard_queue);
+    }
+
+    void FAT::commitDiscard() noexcept {
+        if (this->discard_queue_ != nullptr) {
+            this->discard_queue_->commit();
+        }
+    }
+
+    void FAT::flushDiscard() noexcept {
+        if (this->discard_queue_ != nullptr) {
+            this->discard_queue_->commit();
+            this->discard_queue_->flush();
+        }
+    }
+
+    void FAT::setAllocPolicy(AllocPolicy alloc_policy) noexcept {
+        this->alloc_policy_ = alloc_policy;
+        if (alloc_policy == AllocPolicy::FirstFit) { // FirstFit goes through the bitmap only
+            this->free_extents_.reset();
+        }
+    }
+
+    FragStats FAT::fragStats() noexcept {
+        if (!this->free_extents_.has_value()) {
+            FreeExtents free_extents = buildFreeExtents();
+            return FragStats{this->availClusCnt(), free_extents.count(), free_extents.maxLen()};
+        }
+        return FragStats{this->availClusCnt(), this->free_extents_->count(), this->free_extents_->maxLen()};
+    }
+
+    void FAT::dumpStats(FILE *out) noexcept {
+        static const char *policy_names[] = {"first-fit", "best-fit", "next-fit"};
+        FragStats frag_stats = fragStats();
+        // the share of the free clusters out of the longest free extent
+        double frag_ratio = frag_stats.free_clus_cnt == 0 ? 0 :
+                            100.0 * (frag_stats.free_clus_cnt - frag_stats.max_free_extent_len) /
+                            frag_stats.free_clus_cnt;
+        fprintf(out, "fat(%s): %u free clusters in %u extents, the longest of %u clusters(%.1f%% fragmented)\n",
+                policy_names[(int) this->alloc_policy_], frag_stats.free_clus_cnt, frag_stats.free_extent_cnt,
+                frag_stats.max_free_extent_len, frag_ratio);
+    }
+
+    void FAT::releaseClus(u32 fst_clus, u32 cnt) noexcept {
+        if (cnt == 0) {
+            return;
+        }
+        if (this->free_extents_.has_value()) {
+            this->free_extents_->insert(fst_clus, cnt);
+        }
+        if (this->discard_queue_ == nullptr) {
+            return;
+        }
+        u8 sec_per_clus = bpb_.BPB_sec_per_clus;
+        this->discard_queue_->add(getFirstSectorOfCluster(bpb_, fst_clus), cnt * sec_per_clus);
+    }
+
+    void FAT::keepClus(const std::vector<u32> &clus_chain) noexcept {
+        if (this->discard_queue_ == nullptr) {
+            return;
+        }
+        u8 sec_per_clus = bpb_.BPB_sec_per_clus;
+        for (u32 i = 0; i < clus_chain.size();) {
+            u32 run_start = i;
+            for (i++; i < clus_chain.size() && clus_chain[i] == clus_chain[i - 1] + 1; i++);
+            this->discard_queue_->cancel(getFirstSectorOfCluster(bpb_, clus_chain[run_start]),
+                                         (i - run_start) * sec_per_clus);
+        }
+    }
+
     void FAT::clearClusChain(const std::vector<u32> &clus_chain) noexcept {
         u8 sec_per_clus = bpb_.BPB_sec_per_clus;
-        for (const auto &cluster_no: clus_chain) {
-            assert(isValidCluster(cluster_no));
-            u32 fst_sec = getFirstSectorOfCluster(bpb_, cluster_no);
+        for (u32 i = 0; i < clus_chain.size();) {
+            // the contiguous clusters are zeroed together, without being read
+            u32 run_start = i;
+            assert(isValidCluster(clus_chain[i]));
+            for (i++; i < clus_chain.size() && clus_chain[i] == clus_chain[i - 1] + 1; i++);
+            u32 fst_sec = getFirstSectorOfCluster(bpb_, clus_chain[run_start]);
+            u32 sec_cnt = (i - run_start) * sec_per_clus;
+            if (device_->zeroSectors(fst_sec, sec_cnt)) {
+                continue;
+            }
 
-            for (u32 i = fst_sec; i < fst_sec + sec_per_clus; i++) {
-                auto sector = device_->readSector(i).value();
+            for (u32 j = fst_sec; j < fst_sec + sec_cnt; j++) {
+                auto sector = device_->readSector(j).value();
                 auto *wrt_ptr = sector->write_ptr(0);
                 memset(wrt_ptr, 0, bpb_.BPB_bytes_per_sec);
             }
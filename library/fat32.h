@@ -2,6 +2,8 @@
 #define STUPID_FAT32_FAT32_H
 
 #include <ctime>
+#include <map>
+#include <set>
 
 #include "device.h"
 #include "util.h"
@@ -122,6 +124,13 @@ namespace fat32 {
 
     void writeFATClusEntryVal(u8 *sec_buff, u32 fat_ent_offset, u32 fat_clus_entry_val);
 
+    /**
+     * Return the mask of the free entries among the first `ent_cnt`(at most 64) FAT entries of `fat_buff`, whose bit i
+     * is set if the i-th entry is zero after masked with 0x0FFFFFFF. It's vectorized with AVX2 or SSE2 if the cpu
+     * supports.
+     * */
+    u64 getFreeFATEntryMask(const u8 *fat_buff, u32 ent_cnt);
+
     /**
      * EOC checker function
      * */
@@ -282,21 +291,157 @@ namespace fat32 {
 
     BasisName genBasisNameFromLong(util::string_utf8 long_name);
 
+    /**
+     * `len` contiguous clusters starting from `fst_clus`, which are the clusters from `fst_idx` of a chain.
+     * */
+    struct ClusExtent {
+        u32 fst_idx;
+        u32 fst_clus;
+        u32 len;
+    };
+
+    /**
+     * A cluster chain kept as the sorted extents of its contiguous clusters, so a contiguous file takes a single
+     * extent, and the nth cluster is found by a binary search.
+     * */
+    class ClusChain {
+    public:
+        /**
+         * Append `clus` to the chain, it's merged into the last extent if it follows.
+         * */
+        void push(u32 clus) noexcept;
+
+        /**
+         * Keep the first `clus_cnt` clusters.
+         * */
+        void truncate(u32 clus_cnt) noexcept;
+
+        /**
+         * Return the index of the extent which has the nth cluster, n must be in the chain.
+         * */
+        u32 extentIdx(u32 n) const noexcept;
+
+        u32 operator[](u32 n) const noexcept;
+
+        u32 back() const noexcept { return extents_.back().fst_clus + extents_.back().len - 1; }
+
+        u32 size() const noexcept { return clus_cnt_; }
+
+        bool empty() const noexcept { return clus_cnt_ == 0; }
+
+        const std::vector<ClusExtent> &extents() const noexcept { return extents_; }
+
+    private:
+        std::vector<ClusExtent> extents_;
+        u32 clus_cnt_ = 0;
+    };
+
+    /**
+     * How `FAT::allocClus` picks the free clusters. FirstFit takes the lowest free clusters one by one. The others
+     * look for a single free extent long enough for the whole request: BestFit the shortest one, NextFit the first one
+     * from where the last allocation ended. They fall back to the longest extents when there is no such extent.
+     * */
+    enum class AllocPolicy {
+        FirstFit, BestFit, NextFit
+    };
+
+    /**
+     * The free clusters kept as extents, indexed both by their first clusters and by their lengths.
+     * */
+    class FreeExtents {
+    public:
+        /**
+         * Add the free clusters in [fst_clus, fst_clus + len), they are merged with the extents next to them.
+         * */
+        void insert(u32 fst_clus, u32 len) noexcept;
+
+        /**
+         * Remove the clusters in [fst_clus, fst_clus + len), which must be in a single extent.
+         * */
+        void erase(u32 fst_clus, u32 len) noexcept;
+
+        /**
+         * The count of the free clusters from `clus` to the end of its extent, 0 if `clus` isn't free.
+         * */
+        u32 runLen(u32 clus) const noexcept;
+
+        /**
+         * The first cluster of the shortest extent with at least `len` clusters.
+         * */
+        std::optional<u32> bestFit(u32 len) const noexcept;
+
+        /**
+         * The first cluster of the first `len` free clusters in a row from `clus`, wrapping around to the start.
+         * */
+        std::optional<u32> nextFit(u32 clus, u32 len) const noexcept;
+
+        /**
+         * The longest extents as (first cluster, length) pairs, which have `clus_cnt` clusters in total. The last one
+         * is cut short if needed.
+         * */
+        std::vector<std::pair<u32, u32>> longest(u32 clus_cnt) const noexcept;
+
+        u32 count() const noexcept { return by_addr_.size(); }
+
+        u32 maxLen() const noexcept { return by_len_.empty() ? 0 : by_len_.rbegin()->first; }
+
+    private:
+        std::map<u32, u32> by_addr_; // first cluster -> length
+        std::set<std::pair<u32, u32>> by_len_; // (length, first cluster)
+
+        void put(u32 fst_clus, u32 len) noexcept;
+
+        void remove(std::map<u32, u32>::iterator it) noexcept;
+    };
+
+    /**
+     * How fragmented the free space is.
+     * */
+    struct FragStats {
+        u32 free_clus_cnt;
+        u32 free_extent_cnt;
+        u32 max_free_extent_len;
+    };
+
     class FAT {
     public:
-        FAT(BPB bpb, u32 free_count, std::shared_ptr<device::Device> device) noexcept;
+        /**
+         * `nxt_free` and `free_count` are the hints in FSInfo, 0xFFFFFFFF if unknown. The cluster `nxt_free` is taken
+         * first by `allocClus` if it's free. `free_count` saves the scan of the FAT until the first allocation, which
+         * scans only as much of the FAT as it needs.
+         * */
+        FAT(BPB bpb, u32 nxt_free, std::shared_ptr<device::Device> device, u32 free_count = 0xFFFFFFFF) noexcept;
 
         u32 availClusCnt() noexcept;
 
+        /**
+         * The free cluster count and the next free cluster to be saved in FSInfo, 0xFFFFFFFF if unknown.
+         * */
+        u32 freeCount() const noexcept;
+
+        u32 nxtFree() noexcept;
+
+        /**
+         * Write `freeCount` and `nxtFree` into FSInfo. They are marked unknown there again by the first change of the
+         * FAT after, so that a crash before the next `writeFSInfo` doesn't leave stale values behind.
+         * */
+        void writeFSInfo() noexcept;
+
         u32 totalClusCnt() const noexcept { return cnt_of_clus_; }
 
-        std::optional<std::vector<u32>> allocClus(u32 require_clus_num) noexcept;
+        /**
+         * `goal_clus` is where the clusters are best to start, such as the one after the tail of a file. It's taken
+         * by the policies other than FirstFit if there are enough free clusters in a row from it.
+         * */
+        std::optional<std::vector<u32>> allocClus(u32 require_clus_num, u32 goal_clus = 0) noexcept;
 
         // fst_clus should only be a file's first cluster
         void freeClus(u32 fst_clus) noexcept;
 
         std::vector<u32> readClusChains(u32 fst_clus) noexcept;
 
+        ClusChain readClusExtents(u32 fst_clus) noexcept;
+
         // If fst_clus is invalid, it may be written with a valid cluster number;
         // If clus_num is zero, fst_clus will be written with a zero;
         // In other situation, fst_clus won't be changed.
@@ -304,27 +449,160 @@ namespace fat32 {
         // If clear is set, the new allocated clusters will be set zero.
         bool resize(u32 &fst_clus, u32 clus_num, bool clear) noexcept;
 
+        /**
+         * The same as above, with `clus_chain` being the chain of `fst_clus`. The chain isn't walked on the FAT, and
+         * `clus_chain` is resized along.
+         * */
+        bool resize(u32 &fst_clus, ClusChain &clus_chain, u32 clus_num, bool clear) noexcept;
+
         void clearClusChain(const std::vector<u32> &clus_chain) noexcept;
 
         void writeFatEntry(u32 sec_no, u32 fat_ent_offset, u32 val) noexcept;
 
         u32 readFatEntry(u32 sec_no, u32 fat_ent_no) noexcept;
 
+        /**
+         * Load the active FAT into memory if it takes at most `max_size` bytes, then the entries are read from there,
+         * and written there as well as to the active FAT on the device. Return whether the FAT is in memory.
+         * */
+        bool loadMirror(u64 max_size) noexcept;
+
+        /**
+         * Copy the dirty sectors of the active FAT, in the order of sectors, to the other FATs unless BPB_ext_flags
+         * disables the mirroring.
+         * */
+        void flushFAT() noexcept;
+
+        /**
+         * Discard the clusters freed through `discard_queue`, the clusters allocated are taken back from it.
+         * */
+        void setDiscardQueue(std::shared_ptr<device::DiscardQueue> discard_queue) noexcept;
+
+        /**
+         * Let the clusters freed so far be discarded in the background. It's called once the FAT which freed them is
+         * written back to the device, as the queue holds them till then.
+         * */
+        void commitDiscard() noexcept;
+
+        /**
+         * Discard the freed clusters which are still queued, on the same condition as `commitDiscard`.
+         * */
+        void flushDiscard() noexcept;
+
+        /**
+         * The free extents are indexed, from a scan of the whole FAT, by the first allocation of the policies other
+         * than FirstFit.
+         * */
+        void setAllocPolicy(AllocPolicy alloc_policy) noexcept;
+
+        AllocPolicy allocPolicy() const noexcept { return alloc_policy_; }
+
+        FragStats fragStats() noexcept;
+
+        void dumpStats(FILE *out) noexcept;
+
     private:
         u32 start_sec_no_;
         u32 fat_sec_num_;
         u32 cnt_of_clus_;
+        u32 end_of_clus_;
         BPB bpb_;
-        u32 free_count_;
+        u32 nxt_free_;
         std::optional<u32> avail_clus_cnt_;
+        /**
+         * Whether FSInfo on the device may hold the values of the free count and the next free cluster, which must be
+         * marked unknown before the FAT is changed.
+         * */
+        bool fs_info_valid_;
+        /**
+         * One bit for each cluster below `end_of_clus_`, which is set if the cluster is free. The FAT is scanned into
+         * it from the start, up to `scanned_sec_cnt_` sectors, and there is no free cluster in the words before
+         * `fst_free_word_`.
+         * */
+        std::vector<u64> free_bitmap_;
+        u32 scanned_sec_cnt_ = 0;
+        u32 fst_free_word_ = 0;
+        /**
+         * The FAT in use and whether it's mirrored to the others, by BPB_ext_flags.
+         * */
+        u16 active_fat_;
+        bool mirroring_;
+        /**
+         * The entries of the active FAT if it's loaded into memory.
+         * */
+        std::vector<u32> mirror_;
+        /**
+         * One bit for each FAT sector changed since the last `flushFAT`, whose copies in the other FATs are stale.
+         * */
+        std::vector<u64> dirty_sec_bitmap_;
+        /**
+         * The FAT sectors changed in the mirror, which are still to be copied to the active FAT on the device.
+         * */
+        std::vector<u32> unwritten_secs_;
         std::shared_ptr<device::Device> device_;
+        std::shared_ptr<device::DiscardQueue> discard_queue_;
+        AllocPolicy alloc_policy_ = AllocPolicy::FirstFit;
+        /**
+         * The free clusters as extents once they are indexed, where the freed clusters are added by runs, and where
+         * NextFit looks from.
+         * */
+        std::optional<FreeExtents> free_extents_;
+        u32 nxt_fit_clus_ = 0;
 
         // todo: rename
         u32 end_sec_no() const { return this->start_sec_no_ + this->fat_sec_num_; }
 
-        void inc_avail_cnt(u64 no) noexcept;
+        // the count of the FAT sectors with the entries of clusters
+        u32 fatSecCnt() const noexcept;
+
+        bool isScanned(u32 clus) const noexcept;
+
+        void invalidateFSInfo() noexcept;
+
+        /**
+         * Write the sectors changed in the mirror to the active FAT on the device, at the end of each change of the
+         * clusters.
+         * */
+        void writeThrough() noexcept;
+
+        /**
+         * Scan the next `sec_cnt` sectors of the FAT into the bitmap, the free count is set once it's all scanned.
+         * */
+        void scanFAT(u32 sec_cnt) noexcept;
+
+        bool isClusFree(u32 clus) noexcept;
+
+        void markClusFree(u32 clus) noexcept;
+
+        void markClusUsed(u32 clus) noexcept;
+
+        std::optional<u32> findScannedFreeClus() noexcept;
+
+        /**
+         * Return the first free cluster, the FAT is scanned further if there is none in the scanned part.
+         * */
+        std::optional<u32> findFreeClus() noexcept;
+
+        /**
+         * Index the free clusters of the whole FAT as extents.
+         * */
+        FreeExtents buildFreeExtents() noexcept;
+
+        /**
+         * `allocClus` of the policies other than FirstFit.
+         * */
+        std::optional<std::vector<u32>> allocClusExtents(u32 require_clus_num, u32 goal_clus) noexcept;
+
+        /**
+         * The clusters in [fst_clus, fst_clus + cnt) are freed, add them to the free extents if they are indexed, and
+         * queue them to be discarded if discard is enabled.
+         * */
+        void releaseClus(u32 fst_clus, u32 cnt) noexcept;
 
-        void dec_avail_cnt(u64 no) noexcept;
+        /**
+         * Take the clusters of `clus_chain` back from the discard queue, before they are written.
+         * */
+        void keepClus(const std::vector<u32> &clus_chain) noexcept;
     };
 
 } // namespace fat32
@@ -79,26 +79,29 @@ namespace fs {
 
     u32 File::read(char *buf, u32 size, u32 offset) noexcept {
         fat32::BPB &bpb = fs_.bpb();
-        u32 off_in_sec = offset / bpb.BPB_bytes_per_sec;
-        u32 off_in_bytes = offset % bpb.BPB_bytes_per_sec;
-        u32 sec_no = off_in_sec;
+        u32 sec_sz = bpb.BPB_bytes_per_sec;
+        u32 sec_no = offset / sec_sz;
+        u32 off_in_bytes = offset % sec_sz;
         if (offset >= file_sz()) { // offset exceeds file size, return zero.
             return 0;
         }
 
         u32 remained_sz = std::min(size, file_sz() - offset);
         char *wrt_ptr = buf;
-        auto sector = readSector(sec_no).value();
-        u32 wrt_sz = std::min(remained_sz, bpb.BPB_bytes_per_sec - off_in_bytes);
-        memcpy(wrt_ptr, sector->read_ptr(off_in_bytes), wrt_sz);
-        sec_no += 1;
-        wrt_ptr += wrt_sz;
-        remained_sz -= wrt_sz;
-        for (; remained_sz > 0 && readSector(sec_no).has_value();
-               sec_no++, wrt_ptr += wrt_sz, remained_sz -= wrt_sz) {
-            sector = readSector(sec_no).value();
-            wrt_sz = std::min((u32) bpb.BPB_bytes_per_sec, remained_sz);
-            memcpy(wrt_ptr, sector->read_ptr(0), wrt_sz);
+        while (remained_sz > 0) {
+            u32 sec_cnt = std::min((off_in_bytes + remained_sz - 1) / sec_sz + 1, (u32) MAX_BATCH_SECTOR_NUM);
+            auto sectors = readSectors(sec_no, sec_cnt);
+            if (sectors.empty()) {
+                break;
+            }
+            for (const auto &sector: sectors) {
+                u32 wrt_sz = std::min(remained_sz, sec_sz - off_in_bytes);
+                memcpy(wrt_ptr, sector->read_ptr(off_in_bytes), wrt_sz);
+                off_in_bytes = 0;
+                wrt_ptr += wrt_sz;
+                remained_sz -= wrt_sz;
+            }
+            sec_no += sectors.size();
         }
 
         setAccTime(fat32::getCurDosTs());
@@ -107,9 +110,9 @@ namespace fs {
 
     u32 File::write(const char *buf, u32 size, u32 offset) noexcept {
         fat32::BPB &bpb = fs_.bpb();
-        u32 off_in_sec = offset / bpb.BPB_bytes_per_sec;
-        u32 off_in_bytes = offset % bpb.BPB_bytes_per_sec;
-        u32 sec_no = off_in_sec;
+        u32 sec_sz = bpb.BPB_bytes_per_sec;
+        u32 sec_no = offset / sec_sz;
+        u32 off_in_bytes = offset % sec_sz;
         if (offset + size >= file_sz() &&
             !truncate(offset + size)) { // offset exceeds file size, try to expand size first
             return 0;
@@ -117,17 +120,20 @@ namespace fs {
 
         u32 remained_sz = size;
         const char *read_ptr = buf;
-        auto sector = readSector(sec_no).value();
-        u32 read_sz = std::min(remained_sz, bpb.BPB_bytes_per_sec - off_in_bytes);
-        memcpy(sector->write_ptr(off_in_bytes), read_ptr, read_sz);
-        sec_no += 1;
-        read_ptr += read_sz;
-        remained_sz -= read_sz;
-        for (; remained_sz > 0 && readSector(sec_no).has_value();
-               sec_no++, read_ptr += read_sz, remained_sz -= read_sz) {
-            sector = readSector(sec_no).value();
-            read_sz = std::min((u32) bpb.BPB_bytes_per_sec, remained_sz);
-            memcpy(sector->write_ptr(0), read_ptr, read_sz);
+        while (remained_sz > 0) {
+            u32 sec_cnt = std::min((off_in_bytes + remained_sz - 1) / sec_sz + 1, (u32) MAX_BATCH_SECTOR_NUM);
+            auto sectors = readSectors(sec_no, sec_cnt);
+            if (sectors.empty()) {
+                break;
+            }
+            for (const auto &sector: sectors) {
+                u32 read_sz = std::min(remained_sz, sec_sz - off_in_bytes);
+                memcpy(sector->write_ptr(off_in_bytes), read_ptr, read_sz);
+                off_in_bytes = 0;
+                read_ptr += read_sz;
+                remained_sz -= read_sz;
+            }
+            sec_no += sectors.size();
         }
         setWrtTime(fat32::getCurDosTs());
         return read_ptr - buf;
@@ -175,8 +181,7 @@ namespace fs {
 
     bool File::truncate(u32 length) noexcept {
         u32 clus_num = length == 0 ? 0 : ((length - 1) / fat32::bytesPerClus(fs_.bpb()) + 1);
-        if (fs_.fat().resize(fst_clus_, clus_num, isDir())) {
-            clus_chain_ = std::nullopt;
+        if (fs_.fat().resize(fst_clus_, readClusChain(), clus_num, isDir())) {
             if (!isDir()) {
                 file_sz_ = length;
             }
@@ -282,8 +287,34 @@ namespace fs {
         }
     }
 
+    std::vector<std::shared_ptr<device::Sector>> File::readSectors(u32 n, u32 cnt) noexcept {
+        auto &clus_chain = readClusChain();
+        fat32::BPB &bpb = fs_.bpb();
+        u32 sec_per_clus = bpb.BPB_sec_per_clus;
+        u32 sec_cnt = clus_chain.size() * sec_per_clus;
+        u32 end = n >= sec_cnt ? n : n + std::min(cnt, sec_cnt - n);
+
+        std::vector<std::shared_ptr<device::Sector>> sectors;
+        sectors.reserve(end - n);
+        for (u32 i = n; i < end;) {
+            // the sectors of an extent are physically adjacent
+            const auto &extent = clus_chain.extents()[clus_chain.extentIdx(i / sec_per_clus)];
+            u32 run_fst_sec = fat32::getFirstSectorOfCluster(bpb, extent.fst_clus) + i - extent.fst_idx * sec_per_clus;
+            u32 run_end = std::min((extent.fst_idx + extent.len) * sec_per_clus, end);
+
+            auto result = fs_.device()->readSectors(run_fst_sec, run_end - i);
+            assert(result.has_value());
+            for (auto &sector: result.value()) {
+                sectors.push_back(std::move(sector));
+            }
+            i = run_end;
+        }
+
+        return sectors;
+    }
+
     std::optional<u32> File::sector_no(u32 n) noexcept {
-        auto clus_chain = readClusChain();
+        auto &clus_chain = readClusChain();
         u32 sec_cnt = clus_chain.size() * fs_.bpb().BPB_sec_per_clus;
         if (n >= sec_cnt) { // overflowed, return empty
             return std::nullopt;
@@ -298,9 +329,9 @@ namespace fs {
         return file_sz_;
     }
 
-    std::vector<u32> &File::readClusChain() noexcept {
+    fat32::ClusChain &File::readClusChain() noexcept {
         if (!this->clus_chain_.has_value()) {
-            this->clus_chain_ = fs_.fat().readClusChains(fst_clus_);
+            this->clus_chain_ = fs_.fat().readClusExtents(fst_clus_);
         }
 
         return this->clus_chain_.value();
@@ -672,7 +703,7 @@ namespace fs {
      * Filesystem
      * */
     FAT32fs::FAT32fs(fat32::BPB bpb, fat32::FAT fat, std::shared_ptr<device::Device> device) noexcept
-            : bpb_(bpb), fat_(fat), device_{std::move(device)} {}
+            : bpb_(bpb), fat_(std::move(fat)), device_{std::move(device)} {}
 
     std::unique_ptr<FAT32fs> FAT32fs::from(std::shared_ptr<device::Device> device) noexcept {
         // read and check BPB
@@ -683,16 +714,15 @@ namespace fs {
             exit(1);
         }
 
-        // read fs_info and FAT, then mark invalid in fs_info as we won't fully support fs_info feature
+        // read fs_info and FAT, the FAT marks fs_info invalid on its first change, until `flush` writes it back
         auto fs_info_sec = device->readSector(bpb.BPB_fs_info).value();
-        fat32::FSInfo *fs_info = (fat32::FSInfo *) fs_info_sec->write_ptr(0);
+        fat32::FSInfo *fs_info = (fat32::FSInfo *) fs_info_sec->read_ptr(0);
         fat32::assertFSInfo(*fs_info);
-        auto fat = fat32::FAT(bpb, fs_info->free_count, device);
-        fs_info->free_count = 0xFFFFFFFF;
-        fs_info->nxt_free = 0xFFFFFFFF;
+        auto fat = fat32::FAT(bpb, fs_info->nxt_free, device, fs_info->free_count);
+        fat.loadMirror(FAT_MIRROR_MAX_SIZE);
 
         // everything is settled, make a FAT32fs and return
-        return std::make_unique<FAT32fs>(bpb, fat, std::move(device));
+        return std::make_unique<FAT32fs>(bpb, std::move(fat), std::move(device));
     }
 
     std::optional<FAT32fs> FAT32fs::mkfs(std::shared_ptr<device::Device> device) noexcept {
@@ -774,9 +804,19 @@ namespace fs {
         // assert(false);
     }
 
+    void FAT32fs::sync() noexcept {
+        this->fat_.flushFAT();
+        this->device_->flush();
+        this->fat_.commitDiscard();
+    }
+
     void FAT32fs::flush() noexcept {
         this->cached_lookup_files_.clear();
+        this->fat_.flushFAT();
+        this->fat_.writeFSInfo();
         this->device_->clear();
+        // the clusters freed are discarded only now that the FAT freeing them is on the device
+        this->fat_.flushDiscard();
     }
 
     fat32::BPB &FAT32fs::bpb() noexcept {
@@ -64,6 +64,12 @@ namespace fs {
          * */
         std::optional<std::shared_ptr<device::Sector>> readSector(u32 n) noexcept;
 
+        /**
+         * Read at most `cnt` sectors starting from the nth sector of current file, it stops early at the end of
+         * the cluster chain. Sectors of physically adjacent clusters are fetched with a single device request.
+         * */
+        std::vector<std::shared_ptr<device::Sector>> readSectors(u32 n, u32 cnt) noexcept;
+
         /**
          * Return the nth sector number of current file(the first sector is 0), or return nullptr when overflowed.
          * */
@@ -77,7 +83,7 @@ namespace fs {
         /**
          * Return the reference of the cluster chain, using a lazy strategy.
          * */
-        std::vector<u32> &readClusChain() noexcept;
+        fat32::ClusChain &readClusChain() noexcept;
 
         /**
          * Iterate over each directory entry of the cluster chain, return false when chain_index exceeds.
@@ -114,10 +120,10 @@ namespace fs {
         std::string name_;
         bool is_deleted_ = false;
         /**
-         * Possibly contains current file's cluster chain vector.
+         * Possibly contains current file's cluster chain, which is resized along with the file.
          * This field should never be used, use readClusChain() instead.
          * */
-        std::optional<std::vector<u32>> clus_chain_;
+        std::optional<fat32::ClusChain> clus_chain_;
     };
 
     /**
@@ -238,6 +244,14 @@ namespace fs {
          * */
         void closeFile(u64 ino) noexcept;
 
+        /**
+         * Write back the FATs and the sectors written so far, after which the clusters freed are discarded.
+         * */
+        void sync() noexcept;
+
+        /**
+         * Write back everything and drop the caches, it's called at unmount.
+         * */
         void flush() noexcept;
 
         fat32::BPB &bpb() noexcept;
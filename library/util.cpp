@@ -1,12 +1,208 @@
 #include <string>
 #include <unistd.h>
+#include <sys/mman.h>
 #include <cstring>
+#include <cassert>
 #include <algorithm>
+#include <thread>
 #include <iconv.h>
 
+#include "config.h"
 #include "util.h"
 
 namespace util {
+    /**
+     * SlabArena
+     * */
+    SlabArena::SlabArena(u32 slot_sz, u32 slot_cnt, bool huge_page) noexcept
+            : slot_sz_{(slot_sz + 63) / 64 * 64}, slot_cnt_{slot_cnt}, base_{nullptr}, is_huge_page_{false} {
+        u64 sz = (u64) slot_sz_ * slot_cnt_;
+        if (huge_page) {
+            map_sz_ = (sz + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+            void *addr = mmap(nullptr, map_sz_, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB,
+                              -1, 0);
+            if (addr != MAP_FAILED) {
+                base_ = (u8 *) addr;
+                is_huge_page_ = true;
+            }
+        }
+        if (base_ == nullptr) {
+            map_sz_ = std::max(sz, (u64) 1);
+            void *addr = mmap(nullptr, map_sz_, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            assert(addr != MAP_FAILED);
+            base_ = (u8 *) addr;
+            if (huge_page) { // no huge page is reserved, ask for transparent huge pages instead
+                madvise(base_, map_sz_, MADV_HUGEPAGE);
+            }
+        }
+
+        free_slots_.reserve(slot_cnt_);
+        for (u32 i = slot_cnt_; i > 0; i--) {
+            free_slots_.push_back(i - 1);
+        }
+    }
+
+    void *SlabArena::allocate() noexcept {
+        std::lock_guard<std::mutex> guard(mutex_);
+        if (free_slots_.empty()) {
+            return nullptr;
+        }
+        u32 i = free_slots_.back();
+        free_slots_.pop_back();
+        return base_ + (u64) i * slot_sz_;
+    }
+
+    void SlabArena::deallocate(void *slot) noexcept {
+        assert(owns(slot) && ((u8 *) slot - base_) % slot_sz_ == 0);
+        std::lock_guard<std::mutex> guard(mutex_);
+        free_slots_.push_back(((u8 *) slot - base_) / slot_sz_);
+    }
+
+    u32 SlabArena::freeSlotCnt() const noexcept {
+        std::lock_guard<std::mutex> guard(mutex_);
+        return free_slots_.size();
+    }
+
+    SlabArena::~SlabArena() noexcept {
+        munmap(base_, map_sz_);
+    }
+
+    /**
+     * LatencyHistogram
+     * */
+    void LatencyHistogram::record(u64 ns) noexcept {
+        u32 i = ns == 0 ? 0 : std::min(63 - __builtin_clzll(ns), (int) BUCKET_NUM - 1);
+        buckets_[i].fetch_add(1, std::memory_order_relaxed);
+        total_ns_.fetch_add(ns, std::memory_order_relaxed);
+    }
+
+    u64 LatencyHistogram::count() const noexcept {
+        u64 cnt = 0;
+        for (const auto &bucket: buckets_) {
+            cnt += bucket.load(std::memory_order_relaxed);
+        }
+        return cnt;
+    }
+
+    u64 LatencyHistogram::percentile(double percent) const noexcept {
+        u64 cnt = count();
+        if (cnt == 0) {
+            return 0;
+        }
+
+        auto rank = (u64) (cnt * percent / 100);
+        u64 seen = 0;
+        for (u32 i = 0; i < BUCKET_NUM; i++) {
+            seen += buckets_[i].load(std::memory_order_relaxed);
+            if (seen > rank || seen == cnt) {
+                return (u64) 2 << i;
+            }
+        }
+        return (u64) 2 << (BUCKET_NUM - 1);
+    }
+
+    std::string LatencyHistogram::toString() const noexcept {
+        u64 cnt = count();
+        if (cnt == 0) {
+            return "count 0";
+        }
+        return format_string("count %llu, avg %lluns, p50 <%lluns, p99 <%lluns, max <%lluns", cnt, totalNs() / cnt,
+                             percentile(50), percentile(99), percentile(100));
+    }
+
+    /**
+     * EpochDomain
+     * */
+    EpochDomain::Guard::Guard(EpochDomain &domain) noexcept: slot_{domain.pin()} {}
+
+    std::atomic<u64> &EpochDomain::pin() noexcept {
+        static thread_local u32 hint = std::hash<std::thread::id>{}(std::this_thread::get_id()) % SLOT_NUM;
+        for (u32 i = hint;; i = (i + 1) % SLOT_NUM) {
+            u64 free = 0, pinned = epoch_.load();
+            if (!slots_[i].epoch.compare_exchange_strong(free, pinned)) {
+                continue;
+            }
+            // the epoch may advance before the slot is seen, pin the latest one
+            for (u64 cur = epoch_.load(); cur != pinned; cur = epoch_.load()) {
+                slots_[i].epoch.store(cur);
+                pinned = cur;
+            }
+            hint = i;
+            return slots_[i].epoch;
+        }
+    }
+
+    u64 EpochDomain::safeEpoch() const noexcept {
+        u64 safe = epoch_.load();
+        for (const auto &slot: slots_) {
+            u64 pinned = slot.epoch.load();
+            if (pinned != 0) {
+                safe = std::min(safe, pinned);
+            }
+        }
+        return safe;
+    }
+
+    /**
+     * RangeSet
+     * */
+    u64 RangeSet::add(u32 start, u32 end) noexcept {
+        if (start >= end) {
+            return 0;
+        }
+        u64 old_size = size_;
+        auto it = ranges_.upper_bound(start);
+        if (it != ranges_.begin() && std::prev(it)->second >= start) { // merge with the previous range
+            it--;
+            start = it->first;
+            end = std::max(end, it->second);
+            size_ -= it->second - it->first;
+            it = ranges_.erase(it);
+        }
+        while (it != ranges_.end() && it->first <= end) { // merge with the following ranges
+            end = std::max(end, it->second);
+            size_ -= it->second - it->first;
+            it = ranges_.erase(it);
+        }
+        ranges_[start] = end;
+        size_ += end - start;
+        return size_ - old_size;
+    }
+
+    u64 RangeSet::remove(u32 start, u32 end) noexcept {
+        if (start >= end) {
+            return 0;
+        }
+        u64 old_size = size_;
+        auto it = ranges_.upper_bound(start);
+        if (it != ranges_.begin() && std::prev(it)->second > start) {
+            it--;
+        }
+        while (it != ranges_.end() && it->first < end) { // cut the overlapped part out of each range
+            auto [range_start, range_end] = *it;
+            it = ranges_.erase(it);
+            size_ -= range_end - range_start;
+            if (range_start < start) {
+                ranges_[range_start] = start;
+                size_ += start - range_start;
+            }
+            if (range_end > end) {
+                ranges_[end] = range_end;
+                size_ += range_end - end;
+                break;
+            }
+        }
+        return old_size - size_;
+    }
+
+    bool RangeSet::contains(u32 start, u32 end) const noexcept {
+        if (start >= end) {
+            return true;
+        }
+        auto it = ranges_.upper_bound(start);
+        return it != ranges_.begin() && std::prev(it)->second >= end;
+    }
+
     std::optional<string_gbk> utf8ToGbk(string_utf8 &utf8_str) noexcept {
         iconv_t cd = iconv_open("gbk", "utf8");
         size_t src_len = utf8_str.length();
@@ -1,11 +1,20 @@
 #ifndef STUPID_FAT32_UTIL_H
 #define STUPID_FAT32_UTIL_H
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
 #include <list>
+#include <map>
 #include <optional>
 #include <unordered_map>
 #include <initializer_list>
 #include <memory>
+#include <mutex>
+#include <new>
+#include <vector>
 
 namespace util {
     typedef unsigned long long u64;
@@ -19,50 +28,484 @@ namespace util {
     typedef std::string string_gbk;
     typedef std::string string_utf16;
 
+    /**
+     * The replacement policies of `LRUCacheMap`.
+     *
+     * `LRU` evicts the least recently used key. `TwoQ` and `ClockPro` are scan resistant: a key referred only once
+     * is evicted before the ones referred repeatedly, so that a sequential scan doesn't flush the hot keys.
+     * */
+    enum class ReplacePolicy {
+        LRU, TwoQ, ClockPro
+    };
+
+    /**
+     * A replacement policy tracking the keys of a cache, it may also remember some evicted keys(ghosts) to tell
+     * whether a key is referred again soon after it's evicted.
+     * */
+    template<typename key_t>
+    class CachePolicy {
+    public:
+        /**
+         * `key` is put into the cache.
+         * */
+        virtual void onInsert(const key_t &key) noexcept = 0;
+
+        /**
+         * `key` is hit in the cache.
+         * */
+        virtual void onAccess(const key_t &key) noexcept = 0;
+
+        /**
+         * `key` is removed from the cache by the user.
+         * */
+        virtual void onRemove(const key_t &key) noexcept = 0;
+
+        /**
+         * Choose a cached key to evict and forget it, the cache must not be empty.
+         * */
+        virtual key_t evict() noexcept = 0;
+
+        virtual void clear() noexcept = 0;
+
+        virtual ~CachePolicy() = default;
+    };
+
+    /**
+     * The full version of 2Q(Johnson and Shasha, VLDB'94). New keys enter the FIFO `a1in_`, and the keys evicted
+     * from it are remembered by the ghost FIFO `a1out_`. Only a key referred again while it's in `a1out_` is
+     * promoted to the LRU `am_`, which is evicted only when `a1in_` is not larger than `kin_`.
+     * */
+    template<typename key_t>
+    class TwoQPolicy : public CachePolicy<key_t> {
+    public:
+        explicit TwoQPolicy(u32 max_size) noexcept
+                : kin_{std::max(max_size / 4, (u32) 1)}, kout_{std::max(max_size / 2, (u32) 1)} {}
+
+        void onInsert(const key_t &key) noexcept override {
+            auto it = index_.find(key);
+            if (it != index_.end() && it->second.first == A1OUT) {
+                a1out_.erase(it->second.second);
+                am_.push_front(key);
+                it->second = {AM, am_.begin()};
+            } else {
+                a1in_.push_front(key);
+                index_[key] = {A1IN, a1in_.begin()};
+            }
+            // `a1out_` is trimmed after the lookup, since the cache evicts before inserting the key
+            while (a1out_.size() > kout_) {
+                index_.erase(a1out_.back());
+                a1out_.pop_back();
+            }
+        }
+
+        void onAccess(const key_t &key) noexcept override {
+            auto it = index_.find(key);
+            // the references to a key in `a1in_` are regarded as correlated, they don't promote it.
+            if (it != index_.end() && it->second.first == AM) {
+                am_.splice(am_.begin(), am_, it->second.second);
+            }
+        }
+
+        void onRemove(const key_t &key) noexcept override {
+            auto it = index_.find(key);
+            if (it != index_.end()) {
+                queueOf(it->second.first).erase(it->second.second);
+                index_.erase(it);
+            }
+        }
+
+        key_t evict() noexcept override {
+            if (a1in_.size() > kin_ || am_.empty()) {
+                key_t key = a1in_.back();
+                a1in_.pop_back();
+                a1out_.push_front(key);
+                index_[key] = {A1OUT, a1out_.begin()};
+                return key;
+            } else {
+                key_t key = am_.back();
+                am_.pop_back();
+                index_.erase(key);
+                return key;
+            }
+        }
+
+        void clear() noexcept override {
+            a1in_.clear();
+            a1out_.clear();
+            am_.clear();
+            index_.clear();
+        }
+
+    private:
+        enum Queue {
+            A1IN, A1OUT, AM
+        };
+
+        std::list<key_t> &queueOf(Queue queue) noexcept {
+            return queue == A1IN ? a1in_ : (queue == A1OUT ? a1out_ : am_);
+        }
+
+        u32 kin_;
+        u32 kout_;
+        std::list<key_t> a1in_;
+        std::list<key_t> a1out_;
+        std::list<key_t> am_;
+        std::unordered_map<key_t, std::pair<Queue, typename std::list<key_t>::iterator>> index_;
+    };
+
+    /**
+     * CLOCK-Pro(Jiang, Chen and Zhang, USENIX ATC'05). All the keys are kept in a clock, and are either hot, cold
+     * or non-resident(evicted cold keys still in their test period). A hit only sets the reference bit.
+     *
+     * `hand_cold_` evicts the cold keys not referred, a cold key referred in its test period turns hot. `hand_hot_`
+     * turns the hot keys not referred into cold once there are too many hot keys, and ends the test periods it
+     * passes. A non-resident key inserted again turns hot and enlarges the target number of cold keys, a test
+     * period ended without reference shrinks it. `hand_test_` ends test periods when there are too many
+     * non-resident keys.
+     * */
+    template<typename key_t>
+    class ClockProPolicy : public CachePolicy<key_t> {
+    public:
+        explicit ClockProPolicy(u32 max_size) noexcept
+                : max_size_{std::max(max_size, (u32) 2)}, cold_target_{std::max(max_size / 10, (u32) 1)} {
+            resetHands();
+        }
+
+        void onInsert(const key_t &key) noexcept override {
+            auto it = index_.find(key);
+            if (it != index_.end()) { // a non-resident key in test period, it turns hot
+                auto page = it->second;
+                remove(page);
+                cold_target_ = std::min(cold_target_ + 1, max_size_ - 1);
+                insertAtHead({key, true, true, false, false});
+                hot_cnt_++;
+                while (hot_cnt_ > max_size_ - cold_target_) {
+                    runHandHot();
+                }
+            } else {
+                insertAtHead({key, false, true, true, false});
+                cold_cnt_++;
+            }
+            // the non-resident keys are limited after the lookup, since the cache evicts before inserting the key
+            while (non_resident_cnt_ > max_size_) {
+                runHandTest();
+            }
+        }
+
+        void onAccess(const key_t &key) noexcept override {
+            auto it = index_.find(key);
+            if (it != index_.end()) {
+                it->second->ref = true;
+            }
+        }
+
+        void onRemove(const key_t &key) noexcept override {
+            auto it = index_.find(key);
+            if (it != index_.end()) {
+                remove(it->second);
+            }
+        }
+
+        key_t evict() noexcept override {
+            if (cold_cnt_ == 0) {
+                runHandHot();
+            }
+            while (true) {
+                auto page = hand_cold_;
+                advance(hand_cold_);
+                if (page->hot || !page->resident) {
+                    continue;
+                }
+                if (!page->ref) {
+                    key_t key = page->key;
+                    if (page->test) { // keep it as non-resident until its test period ends
+                        page->resident = false;
+                        cold_cnt_--;
+                        non_resident_cnt_++;
+                    } else {
+                        remove(page);
+                    }
+                    return key;
+                }
+
+                page->ref = false;
+                if (page->test) {
+                    page->hot = true;
+                    page->test = false;
+                    cold_cnt_--;
+                    hot_cnt_++;
+                    moveToHead(page);
+                    while (hot_cnt_ > max_size_ - cold_target_) {
+                        runHandHot();
+                    }
+                    if (cold_cnt_ == 0) {
+                        runHandHot();
+                    }
+                } else {
+                    page->test = true;
+                    moveToHead(page);
+                }
+            }
+        }
+
+        void clear() noexcept override {
+            clock_.clear();
+            index_.clear();
+            hot_cnt_ = cold_cnt_ = non_resident_cnt_ = 0;
+            resetHands();
+        }
+
+    private:
+        struct Page {
+            key_t key;
+            bool hot;
+            bool resident;
+            bool test;
+            bool ref;
+        };
+
+        typedef typename std::list<Page>::iterator page_iterator_t;
+
+        void resetHands() noexcept {
+            hand_hot_ = hand_cold_ = hand_test_ = clock_.end();
+        }
+
+        void advance(page_iterator_t &hand) noexcept {
+            if (++hand == clock_.end()) {
+                hand = clock_.begin();
+            }
+        }
+
+        /**
+         * Move the hands away from `page`, which is going to be moved or removed.
+         * */
+        void leave(page_iterator_t page) noexcept {
+            for (auto hand: {&hand_hot_, &hand_cold_, &hand_test_}) {
+                if (*hand == page) {
+                    advance(*hand);
+                    if (*hand == page) { // the only page in clock
+                        *hand = clock_.end();
+                    }
+                }
+            }
+        }
+
+        /**
+         * The head of clock is right behind `hand_hot_`, which is the last place reached by the hands.
+         * */
+        void insertAtHead(const Page &page) noexcept {
+            auto it = clock_.insert(hand_hot_, page);
+            index_[page.key] = it;
+            for (auto hand: {&hand_hot_, &hand_cold_, &hand_test_}) {
+                if (*hand == clock_.end()) {
+                    *hand = it;
+                }
+            }
+        }
+
+        void moveToHead(page_iterator_t page) noexcept {
+            if (clock_.size() > 1) {
+                leave(page);
+                clock_.splice(hand_hot_, clock_, page);
+            }
+        }
+
+        void remove(page_iterator_t page) noexcept {
+            if (page->hot) {
+                hot_cnt_--;
+            } else if (page->resident) {
+                cold_cnt_--;
+            } else {
+                non_resident_cnt_--;
+            }
+            leave(page);
+            index_.erase(page->key);
+            clock_.erase(page);
+        }
+
+        /**
+         * Turn a hot key into cold, and end the test periods passed by.
+         * */
+        void runHandHot() noexcept {
+            while (hot_cnt_ > 0) {
+                auto page = hand_hot_;
+                advance(hand_hot_);
+                if (page->hot) {
+                    if (page->ref) {
+                        page->ref = false;
+                    } else {
+                        page->hot = false;
+                        hot_cnt_--;
+                        cold_cnt_++;
+                        return;
+                    }
+                } else if (!page->resident) {
+                    remove(page);
+                    cold_target_ = std::max(cold_target_ - 1, (u32) 1);
+                } else {
+                    page->test = false;
+                }
+            }
+        }
+
+        /**
+         * End the test period of a non-resident key.
+         * */
+        void runHandTest() noexcept {
+            while (true) {
+                auto page = hand_test_;
+                advance(hand_test_);
+                if (!page->resident) {
+                    remove(page);
+                    cold_target_ = std::max(cold_target_ - 1, (u32) 1);
+                    return;
+                } else if (!page->hot) {
+                    page->test = false;
+                }
+            }
+        }
+
+        u32 max_size_;
+        u32 cold_target_;
+        u32 hot_cnt_ = 0;
+        u32 cold_cnt_ = 0;
+        u32 non_resident_cnt_ = 0;
+        std::list<Page> clock_;
+        std::unordered_map<key_t, page_iterator_t> index_;
+        page_iterator_t hand_hot_;
+        page_iterator_t hand_cold_;
+        page_iterator_t hand_test_;
+    };
+
+    /**
+     * A map holding at most `max_size` items, which evicts items by the `ReplacePolicy` given. The items are
+     * iterated from the most recently used to the least recently used whatever the policy is.
+     *
+     * The items live in a node array allocated once by the constructor. The nodes are linked by index into a
+     * circular recency list, whose sentinel is the last node, and the free nodes are chained by `next`. The nodes
+     * are indexed by an open addressing hash table with linear probing, which is at most half full and uses
+     * backward shift deletion instead of tombstones. So no operation allocates memory, except those of the
+     * replacement policy.
+     *
+     * The items used without going through the map can be told by `setSecondChance`, the item chosen to evict is
+     * kept for another round if it's used since it's put or kept last time, which approximates the policy like
+     * CLOCK does for LRU.
+     * */
     template<typename key_t, typename value_t>
     class LRUCacheMap {
     public:
         typedef std::pair<key_t, value_t> key_value_pair_t;
-        typedef typename std::list<key_value_pair_t>::iterator list_iterator_t;
 
-        explicit LRUCacheMap(u32 max_size) noexcept: max_size_{max_size} {}
+    private:
+        struct Node {
+            key_value_pair_t item;
+            u32 prev;
+            u32 next;
+        };
+
+    public:
+        class const_iterator {
+        public:
+            const_iterator(const std::vector<Node> *nodes, u32 node) noexcept: nodes_{nodes}, node_{node} {}
+
+            const key_value_pair_t &operator*() const noexcept { return (*nodes_)[node_].item; }
+
+            const key_value_pair_t *operator->() const noexcept { return &(*nodes_)[node_].item; }
 
-        void put(key_t key, value_t value) noexcept {
-            auto it = caches_map_.find(key);
-            if (it != caches_map_.end()) {
-                caches_map_.erase(key);
-                key_value_list_.erase(it->second);
+            const_iterator &operator++() noexcept {
+                node_ = (*nodes_)[node_].next;
+                return *this;
             }
-            key_value_list_.push_front(std::pair(key, value));
-            caches_map_[key] = key_value_list_.begin();
 
-            if (caches_map_.size() > max_size_) {
-                auto removed_item = key_value_list_.end();
-                removed_item--;
-                caches_map_.erase(removed_item->first);
-                key_value_list_.erase(removed_item);
+            bool operator==(const const_iterator &other) const noexcept { return node_ == other.node_; }
+
+            bool operator!=(const const_iterator &other) const noexcept { return node_ != other.node_; }
+
+        private:
+            const std::vector<Node> *nodes_;
+            u32 node_;
+        };
+
+        explicit LRUCacheMap(u32 max_size, ReplacePolicy policy = ReplacePolicy::LRU) noexcept
+                : max_size_{std::max(max_size, (u32) 1)}, nodes_(max_size_ + 1) {
+            u32 slot_cnt = 2;
+            for (bits_ = 1; slot_cnt < 2 * max_size_; bits_++) {
+                slot_cnt *= 2;
+            }
+            slots_.assign(slot_cnt, NIL);
+            resetNodes();
+            if (policy == ReplacePolicy::TwoQ) {
+                policy_ = std::make_unique<TwoQPolicy<key_t>>(max_size);
+            } else if (policy == ReplacePolicy::ClockPro) {
+                policy_ = std::make_unique<ClockProPolicy<key_t>>(max_size);
             }
         }
 
+        /**
+         * Put `key` in the map, and return the item evicted for it if any.
+         * */
+        std::optional<key_value_pair_t> put(key_t key, value_t value) noexcept {
+            u32 slot = findSlot(key);
+            if (slot != NIL) {
+                u32 node = slots_[slot];
+                nodes_[node].item.second = std::move(value);
+                touch(node);
+                return std::nullopt;
+            }
+
+            // make room before inserting, so that the new item is never chosen
+            std::optional<key_value_pair_t> evicted_item;
+            if (size_ >= max_size_) {
+                evicted_item = evict();
+            }
+            u32 node = free_;
+            free_ = nodes_[node].next;
+            nodes_[node].item = {key, std::move(value)};
+            linkFront(node);
+            insertSlot(node);
+            size_++;
+            if (policy_ != nullptr) {
+                policy_->onInsert(key);
+            }
+            return evicted_item;
+        }
+
         std::optional<value_t> get(key_t key) noexcept {
-            auto it = caches_map_.find(key);
-            if (it != caches_map_.end()) {
-                // move the item in the front of `key_value_list_`
-                auto begin = key_value_list_.begin();
-                key_value_list_.splice(begin, key_value_list_, it->second);
+            u32 slot = findSlot(key);
+            if (slot != NIL) {
+                touch(slots_[slot]);
+                return std::optional(nodes_[slots_[slot]].item.second);
+            } else {
+                return std::nullopt;
+            }
+        }
 
-                return std::optional(it->second->second);
+        /**
+         * Look up `key` without changing its position in the list.
+         * */
+        std::optional<value_t> peek(key_t key) noexcept {
+            u32 slot = findSlot(key);
+            if (slot != NIL) {
+                return std::optional(nodes_[slots_[slot]].item.second);
             } else {
                 return std::nullopt;
             }
         }
 
+        /**
+         * `referenced` tells whether the value has been used since it's asked last time, and clears that.
+         * */
+        void setSecondChance(std::function<bool(value_t &)> referenced) noexcept {
+            referenced_ = std::move(referenced);
+        }
+
         std::optional<value_t> remove(key_t key) noexcept {
-            auto it = caches_map_.find(key);
-            if (it != caches_map_.end()) {
-                auto value = it->second->second;
-                caches_map_.erase(it);
-                key_value_list_.erase(it->second);
+            u32 slot = findSlot(key);
+            if (slot != NIL) {
+                auto value = release(slot).second;
+                if (policy_ != nullptr) {
+                    policy_->onRemove(key);
+                }
                 return {value};
             } else {
                 return std::nullopt;
@@ -70,26 +513,400 @@ namespace util {
         }
 
         void clear() noexcept {
-            caches_map_.clear();
-            key_value_list_.clear();
+            for (u32 node = nodes_[sentinel()].next; node != sentinel(); node = nodes_[node].next) {
+                nodes_[node].item.second = value_t();
+            }
+            std::fill(slots_.begin(), slots_.end(), NIL);
+            resetNodes();
+            if (policy_ != nullptr) {
+                policy_->clear();
+            }
         }
 
         u64 size() noexcept {
-            return key_value_list_.size();
+            return size_;
         }
 
-        typename std::list<key_value_pair_t>::const_iterator begin() {
-            return key_value_list_.begin();
+        const_iterator begin() const noexcept {
+            return {&nodes_, nodes_[sentinel()].next};
         }
 
-        typename std::list<key_value_pair_t>::const_iterator end() {
-            return key_value_list_.end();
+        const_iterator end() const noexcept {
+            return {&nodes_, sentinel()};
         }
 
     private:
+        static constexpr u32 NIL = UINT32_MAX;
+
+        u32 sentinel() const noexcept {
+            return max_size_;
+        }
+
+        /**
+         * Empty the recency list and chain all the nodes into the free list.
+         * */
+        void resetNodes() noexcept {
+            for (u32 i = 0; i < max_size_; i++) {
+                nodes_[i].next = i + 1 < max_size_ ? i + 1 : NIL;
+            }
+            free_ = 0;
+            nodes_[sentinel()].prev = nodes_[sentinel()].next = sentinel();
+            size_ = 0;
+        }
+
+        void unlink(u32 node) noexcept {
+            nodes_[nodes_[node].prev].next = nodes_[node].next;
+            nodes_[nodes_[node].next].prev = nodes_[node].prev;
+        }
+
+        void linkFront(u32 node) noexcept {
+            u32 fst = nodes_[sentinel()].next;
+            nodes_[node].prev = sentinel();
+            nodes_[node].next = fst;
+            nodes_[fst].prev = node;
+            nodes_[sentinel()].next = node;
+        }
+
+        void touch(u32 node) noexcept {
+            // move the item in the front of the recency list
+            unlink(node);
+            linkFront(node);
+            if (policy_ != nullptr) {
+                policy_->onAccess(nodes_[node].item.first);
+            }
+        }
+
+        /**
+         * The home slot of `key`, the hash is scattered by the golden ratio since it may be the key itself.
+         * */
+        u32 homeSlot(const key_t &key) const noexcept {
+            return (u32) (((u64) std::hash<key_t>{}(key) * 0x9E3779B97F4A7C15ull) >> (64 - bits_));
+        }
+
+        u32 findSlot(const key_t &key) const noexcept {
+            u32 mask = slots_.size() - 1;
+            for (u32 slot = homeSlot(key);; slot = (slot + 1) & mask) {
+                if (slots_[slot] == NIL) {
+                    return NIL;
+                }
+                if (nodes_[slots_[slot]].item.first == key) {
+                    return slot;
+                }
+            }
+        }
+
+        void insertSlot(u32 node) noexcept {
+            u32 mask = slots_.size() - 1;
+            u32 slot = homeSlot(nodes_[node].item.first);
+            while (slots_[slot] != NIL) {
+                slot = (slot + 1) & mask;
+            }
+            slots_[slot] = node;
+        }
+
+        /**
+         * Empty `slot` and shift the following items of the probe sequence back, so that no item is separated
+         * from its home slot by an empty slot.
+         * */
+        void eraseSlot(u32 slot) noexcept {
+            u32 mask = slots_.size() - 1;
+            for (u32 next = (slot + 1) & mask; slots_[next] != NIL; next = (next + 1) & mask) {
+                u32 home = homeSlot(nodes_[slots_[next]].item.first);
+                // the item stays if its home slot is in (slot, next] cyclically
+                if (((next - home) & mask) < ((next - slot) & mask)) {
+                    continue;
+                }
+                slots_[slot] = slots_[next];
+                slot = next;
+            }
+            slots_[slot] = NIL;
+        }
+
+        /**
+         * Take the item in `slot` out of the map, and give its node back to the free list.
+         * */
+        key_value_pair_t release(u32 slot) noexcept {
+            u32 node = slots_[slot];
+            eraseSlot(slot);
+            unlink(node);
+            key_value_pair_t item = std::move(nodes_[node].item);
+            nodes_[node].item.second = value_t();
+            nodes_[node].next = free_;
+            free_ = node;
+            size_--;
+            return item;
+        }
+
+        key_value_pair_t evict() noexcept {
+            for (u32 round = 0;; round++) {
+                // for LRU, the back of the recency list is the least recently used one
+                u32 slot = findSlot(policy_ == nullptr ? nodes_[nodes_[sentinel()].prev].item.first
+                                                       : policy_->evict());
+                u32 node = slots_[slot];
+                // every item is asked at most once, since that clears its reference
+                if (!referenced_ || round == size_ || !referenced_(nodes_[node].item.second)) {
+                    return release(slot);
+                }
+                // keep the item as if it's accessed, the policy takes it back as a reused one
+                if (policy_ == nullptr) {
+                    touch(node);
+                } else {
+                    policy_->onInsert(nodes_[node].item.first);
+                }
+            }
+        }
+
         u32 max_size_;
-        std::unordered_map<key_t, list_iterator_t> caches_map_;
-        std::list<key_value_pair_t> key_value_list_;
+        u32 bits_;
+        u32 size_ = 0;
+        u32 free_ = NIL;
+        std::vector<Node> nodes_;
+        std::vector<u32> slots_;
+        /**
+         * The policy choosing the item to evict, it's null for LRU which is kept by the recency list itself.
+         * */
+        std::unique_ptr<CachePolicy<key_t>> policy_;
+        std::function<bool(value_t &)> referenced_;
+    };
+
+    /**
+     * A fixed-capacity arena handing out `slot_cnt` slots of `slot_sz` bytes from a single mapping, the freed slots
+     * are recycled in LIFO order so that the hot ones are reused first. Slots are aligned to 64 bytes.
+     *
+     * With `huge_page` set, the mapping is backed by huge pages(MAP_HUGETLB), or by transparent huge pages when
+     * no huge page is reserved.
+     * */
+    class SlabArena {
+    public:
+        SlabArena(u32 slot_sz, u32 slot_cnt, bool huge_page = false) noexcept;
+
+        SlabArena(const SlabArena &) = delete;
+
+        SlabArena &operator=(const SlabArena &) = delete;
+
+        /**
+         * Take a free slot, return nullptr when all of them are in use.
+         * */
+        void *allocate() noexcept;
+
+        void deallocate(void *slot) noexcept;
+
+        bool owns(const void *ptr) const noexcept {
+            return ptr >= base_ && ptr < base_ + (u64) slot_sz_ * slot_cnt_;
+        }
+
+        u32 slotSz() const noexcept { return slot_sz_; }
+
+        u32 slotCnt() const noexcept { return slot_cnt_; }
+
+        u32 freeSlotCnt() const noexcept;
+
+        bool isHugePage() const noexcept { return is_huge_page_; }
+
+        ~SlabArena() noexcept;
+
+    private:
+        u32 slot_sz_;
+        u32 slot_cnt_;
+        u64 map_sz_;
+        u8 *base_;
+        bool is_huge_page_;
+        std::vector<u32> free_slots_;
+        mutable std::mutex mutex_;
+    };
+
+    /**
+     * A std allocator taking memory from `SlabArena`, it falls back to the heap when the arena is exhausted or
+     * the requested size doesn't fit in a slot.
+     * */
+    template<typename T>
+    class SlabAllocator {
+    public:
+        typedef T value_type;
+
+        explicit SlabAllocator(std::shared_ptr<SlabArena> arena) noexcept: arena_{std::move(arena)} {}
+
+        template<typename U>
+        SlabAllocator(const SlabAllocator<U> &other) noexcept: arena_{other.arena()} {}
+
+        T *allocate(std::size_t n) {
+            void *ptr = nullptr;
+            if (n * sizeof(T) <= arena_->slotSz()) {
+                ptr = arena_->allocate();
+            }
+            if (ptr == nullptr) {
+                ptr = ::operator new(n * sizeof(T));
+            }
+            return static_cast<T *>(ptr);
+        }
+
+        void deallocate(T *ptr, std::size_t) noexcept {
+            if (arena_->owns(ptr)) {
+                arena_->deallocate(ptr);
+            } else {
+                ::operator delete(ptr);
+            }
+        }
+
+        const std::shared_ptr<SlabArena> &arena() const noexcept { return arena_; }
+
+        template<typename U>
+        bool operator==(const SlabAllocator<U> &other) const noexcept { return arena_ == other.arena(); }
+
+        template<typename U>
+        bool operator!=(const SlabAllocator<U> &other) const noexcept { return arena_ != other.arena(); }
+
+    private:
+        std::shared_ptr<SlabArena> arena_;
+    };
+
+    /**
+     * A histogram of latencies in power-of-two buckets, bucket i counts the latencies in [2^i, 2^(i+1)) nanoseconds
+     * (the first one also counts 0). It's recorded by many threads without locking.
+     * */
+    class LatencyHistogram {
+    public:
+        static constexpr u32 BUCKET_NUM = 40;
+
+        void record(u64 ns) noexcept;
+
+        u64 count() const noexcept;
+
+        u64 bucket(u32 i) const noexcept { return buckets_[i]; }
+
+        u64 totalNs() const noexcept { return total_ns_; }
+
+        /**
+         * The upper bound of the bucket where the `percent` percentile falls, 0 if nothing is recorded.
+         * */
+        u64 percentile(double percent) const noexcept;
+
+        /**
+         * Summarize the histogram as "count, avg, p50, p99 and max" in a line.
+         * */
+        std::string toString() const noexcept;
+
+    private:
+        std::atomic<u64> buckets_[BUCKET_NUM]{};
+        std::atomic<u64> total_ns_{0};
+    };
+
+    /**
+     * Record the time from its construction to its destruction into a `LatencyHistogram`.
+     * */
+    class LatencyTimer {
+    public:
+        explicit LatencyTimer(LatencyHistogram &histogram) noexcept
+                : histogram_{histogram}, start_{std::chrono::steady_clock::now()} {}
+
+        LatencyTimer(const LatencyTimer &) = delete;
+
+        LatencyTimer &operator=(const LatencyTimer &) = delete;
+
+        ~LatencyTimer() noexcept {
+            auto elapsed = std::chrono::steady_clock::now() - start_;
+            histogram_.record(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+        }
+
+    private:
+        LatencyHistogram &histogram_;
+        std::chrono::steady_clock::time_point start_;
+    };
+
+    /**
+     * Epoch based reclamation for the objects read without locking. A reader pins the current epoch by a `Guard`
+     * while it may touch such objects. An object unlinked by a writer is retired with the epoch returned by
+     * `retire`, and it can be freed once the epoch is below `safeEpoch`, when no reader may still see it.
+     *
+     * A reader takes one of `SLOT_NUM` slots, each thread tries the slot it took last time first.
+     * */
+    class EpochDomain {
+    public:
+        static constexpr u32 SLOT_NUM = 32;
+
+        class Guard {
+        public:
+            explicit Guard(EpochDomain &domain) noexcept;
+
+            Guard(const Guard &) = delete;
+
+            Guard &operator=(const Guard &) = delete;
+
+            ~Guard() noexcept { slot_.store(0, std::memory_order_release); }
+
+        private:
+            std::atomic<u64> &slot_;
+        };
+
+        /**
+         * Called after the objects are unlinked, return the epoch to retire them with.
+         * */
+        u64 retire() noexcept { return epoch_.fetch_add(1); }
+
+        /**
+         * The objects retired with an epoch below it are seen by no reader.
+         * */
+        u64 safeEpoch() const noexcept;
+
+    private:
+        /**
+         * The epoch pinned by a reader, 0 if the slot is free.
+         * */
+        struct alignas(64) Slot {
+            std::atomic<u64> epoch{0};
+        };
+
+        /**
+         * Take a free slot and pin the current epoch in it.
+         * */
+        std::atomic<u64> &pin() noexcept;
+
+        std::atomic<u64> epoch_{1};
+        Slot slots_[SLOT_NUM];
+    };
+
+    /**
+     * A set of numbers kept as disjoint ranges, mapping from the start of each range to its end(exclusive). The
+     * ranges added are merged with the adjacent or overlapped ones, and the ranges removed are cut out of them.
+     * */
+    class RangeSet {
+    public:
+        typedef std::map<u32, u32>::const_iterator const_iterator;
+
+        /**
+         * Add [start, end), return the number of values which aren't in the set before.
+         * */
+        u64 add(u32 start, u32 end) noexcept;
+
+        /**
+         * Remove [start, end), return the number of values which are in the set before.
+         * */
+        u64 remove(u32 start, u32 end) noexcept;
+
+        /**
+         * Whether all the values in [start, end) are in the set.
+         * */
+        bool contains(u32 start, u32 end) const noexcept;
+
+        /**
+         * The number of values in the set.
+         * */
+        u64 size() const noexcept { return size_; }
+
+        bool empty() const noexcept { return ranges_.empty(); }
+
+        void swap(RangeSet &other) noexcept {
+            ranges_.swap(other.ranges_);
+            std::swap(size_, other.size_);
+        }
+
+        const_iterator begin() const noexcept { return ranges_.begin(); }
+
+        const_iterator end() const noexcept { return ranges_.end(); }
+
+    private:
+        std::map<u32, u32> ranges_;
+        u64 size_ = 0;
     };
 
     std::optional<string_gbk> utf8ToGbk(string_utf8 &utf8_str) noexcept;
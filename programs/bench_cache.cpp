@@ -0,0 +1,160 @@
+#include <unistd.h>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <list>
+#include <memory>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "config.h"
+#include "device.h"
+#include "util.h"
+
+using util::u32, util::u64;
+
+/**
+ * The `LRUCacheMap` built on std::list and std::unordered_map before it became flat, which allocates two nodes
+ * for each new key. It's kept here as the baseline.
+ * */
+template<typename key_t, typename value_t>
+class ListLRUCacheMap {
+public:
+    explicit ListLRUCacheMap(u32 max_size) noexcept: max_size_{max_size} {}
+
+    void put(key_t key, value_t value) noexcept {
+        auto it = caches_map_.find(key);
+        if (it != caches_map_.end()) {
+            key_value_list_.erase(it->second);
+            caches_map_.erase(it);
+        }
+        key_value_list_.push_front(std::pair(key, value));
+        caches_map_[key] = key_value_list_.begin();
+        if (caches_map_.size() > max_size_) {
+            caches_map_.erase(key_value_list_.back().first);
+            key_value_list_.pop_back();
+        }
+    }
+
+    std::optional<value_t> get(key_t key) noexcept {
+        auto it = caches_map_.find(key);
+        if (it == caches_map_.end()) {
+            return std::nullopt;
+        }
+        key_value_list_.splice(key_value_list_.begin(), key_value_list_, it->second);
+        return std::optional(it->second->second);
+    }
+
+private:
+    u32 max_size_;
+    std::unordered_map<key_t, typename std::list<std::pair<key_t, value_t>>::iterator> caches_map_;
+    std::list<std::pair<key_t, value_t>> key_value_list_;
+};
+
+/**
+ * xorshift64, so that every run sees the same keys.
+ * */
+static u64 nextRandom(u64 &state) noexcept {
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return state;
+}
+
+/**
+ * Look up `op_cnt` keys and put the missing ones, 80% of the lookups go to the hottest 20% of `key_cnt` keys.
+ * Return the nanoseconds per lookup.
+ * */
+template<typename map_t, typename key_t, typename value_t>
+static double benchMap(map_t &map, u32 key_cnt, u64 key_base, u32 op_cnt) noexcept {
+    u64 state = 88172645463325252ull;
+    auto value = std::make_shared<typename value_t::element_type>();
+    u32 hot_cnt = std::max(key_cnt / 5, (u32) 1);
+    auto start = std::chrono::steady_clock::now();
+    for (u32 i = 0; i < op_cnt; i++) {
+        u64 r = nextRandom(state);
+        u32 key = r % 10 < 8 ? (r >> 8) % hot_cnt : (r >> 8) % key_cnt;
+        if (!map.get(key_base + key).has_value()) {
+            map.put(key_base + key, value);
+        }
+    }
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    return (double) std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count() / op_cnt;
+}
+
+template<typename key_t, typename value_t>
+static void compareMaps(const char *name, u32 max_size, u32 key_cnt, u64 key_base, u32 op_cnt) noexcept {
+    ListLRUCacheMap<key_t, value_t> list_map(max_size);
+    util::LRUCacheMap<key_t, value_t> flat_map(max_size);
+    double list_ns = benchMap<decltype(list_map), key_t, value_t>(list_map, key_cnt, key_base, op_cnt);
+    double flat_ns = benchMap<decltype(flat_map), key_t, value_t>(flat_map, key_cnt, key_base, op_cnt);
+    printf("%-32s %10.1f %10.1f %9.2fx\n", name, list_ns, flat_ns, list_ns / flat_ns);
+}
+
+/**
+ * Read random sectors of a temporary image through `CacheManager` by `thread_cnt` threads, each of them reads its own
+ * part of the image. Return the nanoseconds per read of all the threads.
+ * */
+static double benchCacheManager(u32 sec_cnt, u32 op_cnt, u32 thread_cnt) noexcept {
+    char path[] = "/tmp/bench_cache_XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0 || ftruncate(fd, (off_t) sec_cnt * thread_cnt * SECTOR_SIZE) != 0) {
+        return 0;
+    }
+    close(fd);
+
+    double ns;
+    {
+        device::CacheManager cache_manager(std::make_shared<device::LinuxFileDriver>(path, SECTOR_SIZE),
+                                           CACHED_SECTOR_NUM * thread_cnt);
+        auto start = std::chrono::steady_clock::now();
+        std::vector<std::thread> threads;
+        for (u32 t = 0; t < thread_cnt; t++) {
+            threads.emplace_back([&, t] {
+                u64 state = 88172645463325252ull + t;
+                u32 hot_cnt = std::max(sec_cnt / 5, (u32) 1);
+                for (u32 i = 0; i < op_cnt / thread_cnt; i++) {
+                    u64 r = nextRandom(state);
+                    u32 sec_num = r % 10 < 8 ? (r >> 8) % hot_cnt : (r >> 8) % sec_cnt;
+                    cache_manager.readSector(sec_num * thread_cnt + t);
+                }
+            });
+        }
+        for (auto &thread: threads) {
+            thread.join();
+        }
+        auto elapsed = std::chrono::steady_clock::now() - start;
+        ns = (double) std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count() / op_cnt;
+    }
+    unlink(path);
+    return ns;
+}
+
+struct Inode {
+    u64 ino = 0;
+};
+
+struct Block {
+    u32 fst_sec = 0;
+};
+
+int main(int argc, char *argv[]) {
+    u32 op_cnt = argc > 1 ? (u32) atoi(argv[1]) : 2000000;
+
+    printf("%-32s %10s %10s %10s\n", "ns per lookup", "list", "flat", "speedup");
+    // `CacheManager` caches CACHED_SECTOR_NUM blocks of one sector, or 4KB pages
+    compareMaps<u32, std::shared_ptr<Block>>("block cache(64 of 320)", CACHED_SECTOR_NUM, CACHED_SECTOR_NUM * 5, 0,
+                                             op_cnt);
+    compareMaps<u32, std::shared_ptr<Block>>("block cache(8 of 40)", CACHED_SECTOR_NUM * SECTOR_SIZE / CACHE_PAGE_SIZE,
+                                             CACHED_SECTOR_NUM * SECTOR_SIZE / CACHE_PAGE_SIZE * 5, 0, op_cnt);
+    compareMaps<u32, std::shared_ptr<Block>>("block cache(4096 of 20480)", 4096, 20480, 0, op_cnt);
+    // `FAT32fs` caches 20 files looked up, whose inode numbers are the positions of their directory entries
+    compareMaps<u64, std::shared_ptr<Inode>>("inode cache(20 of 100)", 20, 100, 1ull << 32, op_cnt);
+
+    printf("\n%-32s %10s\n", "CacheManager::readSector", "ns per read");
+    for (u32 thread_cnt = 1; thread_cnt <= 8; thread_cnt *= 2) {
+        printf("%2u threads%22s %10.1f\n", thread_cnt, "", benchCacheManager(CACHED_SECTOR_NUM * 5, op_cnt, thread_cnt));
+    }
+    return 0;
+}
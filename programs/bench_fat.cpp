@@ -0,0 +1,238 @@
+#include <fcntl.h>
+#include <unistd.h>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <optional>
+#include <vector>
+
+#include "config.h"
+#include "device.h"
+#include "fat32.h"
+#include "util.h"
+
+using util::u8, util::u32, util::u64;
+
+/**
+ * xorshift64, so that every run sees the same FAT.
+ * */
+static u64 nextRandom(u64 &state) noexcept {
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return state;
+}
+
+/**
+ * The check of one entry at a time, it's kept here as the baseline of `fat32::getFreeFATEntryMask`.
+ * */
+static u64 getFreeFATEntryMaskScalar(const u8 *fat_buff, u32 ent_cnt) noexcept {
+    u64 mask = 0;
+    for (u32 i = 0; i < ent_cnt; i++) {
+        if (fat32::readFATClusEntryVal(fat_buff, i * fat32::KFATEntSz) == 0) {
+            mask |= 1ull << i;
+        }
+    }
+    return mask;
+}
+
+/**
+ * Fill `fat` with clusters of which one in `free_ratio` is free, and the others are linked to their next ones.
+ * */
+static void fillFAT(std::vector<u32> &fat, u32 free_ratio) noexcept {
+    u64 state = 88172645463325252ull;
+    fat[0] = 0x0FFFFFF8;
+    fat[1] = fat32::KFat32EocMark;
+    for (u32 i = 2; i < fat.size(); i++) {
+        fat[i] = nextRandom(state) % free_ratio == 0 ? 0 : i + 1;
+    }
+}
+
+/**
+ * Build the masks of `fat` by 64 entries `round_cnt` times with `get_mask`, return the nanoseconds per 64 entries.
+ * */
+template<typename func_t>
+static double benchMask(const std::vector<u32> &fat, u32 round_cnt, func_t get_mask, u64 &free_cnt) noexcept {
+    free_cnt = 0;
+    u32 word_cnt = fat.size() / 64;
+    auto start = std::chrono::steady_clock::now();
+    for (u32 r = 0; r < round_cnt; r++) {
+        for (u32 i = 0; i < word_cnt; i++) {
+            free_cnt += __builtin_popcountll(get_mask((const u8 *) &fat[i * 64], 64));
+        }
+    }
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    return (double) std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count() / word_cnt / round_cnt;
+}
+
+/**
+ * Make a sparse image of `img_sz` bytes whose first FAT is filled by `fillFAT`, return its BPB.
+ * */
+static std::optional<fat32::BPB> makeImage(const char *path, u64 img_sz, u32 free_ratio) noexcept {
+    fat32::BPB bpb{};
+    bpb.BPB_bytes_per_sec = SECTOR_SIZE;
+    bpb.BPB_sec_per_clus = 8;
+    bpb.BPB_resvd_sec_cnt = 32;
+    bpb.BPB_num_fats = 2;
+    bpb.BPB_tot_sec32 = img_sz / SECTOR_SIZE;
+    // large enough for the clusters of the data region and the two reserved entries
+    u32 clus_cnt = (bpb.BPB_tot_sec32 - bpb.BPB_resvd_sec_cnt) / bpb.BPB_sec_per_clus;
+    bpb.BPB_FATsz32 = ((clus_cnt + 2) * fat32::KFATEntSz + SECTOR_SIZE - 1) / SECTOR_SIZE;
+
+    std::vector<u32> fat(bpb.BPB_FATsz32 * SECTOR_SIZE / fat32::KFATEntSz);
+    fillFAT(fat, free_ratio);
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        return std::nullopt;
+    }
+    u64 fat_sz = fat.size() * fat32::KFATEntSz;
+    bool ok = ftruncate(fd, (off_t) img_sz) == 0 &&
+              pwrite(fd, fat.data(), fat_sz, (off_t) fat32::getFirstFATSector(bpb, 0) * SECTOR_SIZE) == fat_sz;
+    close(fd);
+    return ok ? std::optional(bpb) : std::nullopt;
+}
+
+/**
+ * Count the free clusters of the image by `count`, each time through a new `CacheManager`. Return the milliseconds
+ * per count.
+ * */
+template<typename func_t>
+static double benchScan(const char *path, fat32::BPB bpb, u32 round_cnt, func_t count, u32 &free_cnt) noexcept {
+    double ms = 0;
+    for (u32 r = 0; r < round_cnt; r++) {
+        auto device = std::make_shared<device::CacheManager>(
+                std::make_shared<device::LinuxFileDriver>(path, SECTOR_SIZE), CACHED_SECTOR_NUM);
+        fat32::FAT fat(bpb, 0xFFFFFFFF, device);
+        auto start = std::chrono::steady_clock::now();
+        free_cnt = count(fat);
+        auto elapsed = std::chrono::steady_clock::now() - start;
+        ms += (double) std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count() / 1000;
+    }
+    return ms / round_cnt;
+}
+
+struct ChurnResult {
+    double ms;
+    double extent_per_file;
+    fat32::FragStats frag_stats;
+};
+
+/**
+ * Create, grow and delete files at random `op_cnt` times on the empty image through the `alloc_policy`, keeping it
+ * about three quarters full at most.
+ * */
+static ChurnResult churnFiles(const char *path, fat32::BPB bpb, fat32::AllocPolicy alloc_policy, u32 op_cnt) noexcept {
+    struct File {
+        u32 fst_clus;
+        fat32::ClusChain clus_chain;
+    };
+    auto device = std::make_shared<device::CacheManager>(
+            std::make_shared<device::LinuxFileDriver>(path, SECTOR_SIZE), CACHED_SECTOR_NUM);
+    fat32::FAT fat(bpb, 0xFFFFFFFF, device);
+    fat.loadMirror(FAT_MIRROR_MAX_SIZE);
+    fat.setAllocPolicy(alloc_policy);
+    std::vector<File> files;
+    u64 state = 88172645463325252ull;
+
+    auto start = std::chrono::steady_clock::now();
+    for (u32 i = 0; i < op_cnt; i++) {
+        u32 op = nextRandom(state) % 4;
+        if (!files.empty() && (op == 0 || fat.availClusCnt() < fat.totalClusCnt() / 4)) { // delete
+            u32 idx = nextRandom(state) % files.size();
+            fat.freeClus(files[idx].fst_clus);
+            files[idx] = std::move(files.back());
+            files.pop_back();
+        } else if (files.size() < 16 || op == 1) { // create
+            File file{0, {}};
+            if (fat.resize(file.fst_clus, file.clus_chain, 1 + nextRandom(state) % 256, false)) {
+                files.push_back(std::move(file));
+            }
+        } else { // append
+            File &file = files[nextRandom(state) % files.size()];
+            fat.resize(file.fst_clus, file.clus_chain, file.clus_chain.size() + 1 + nextRandom(state) % 64, false);
+        }
+    }
+    auto elapsed = std::chrono::steady_clock::now() - start;
+
+    u64 extent_cnt = 0;
+    for (const File &file: files) {
+        extent_cnt += file.clus_chain.extents().size();
+    }
+    return ChurnResult{(double) std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count() / 1000,
+                       files.empty() ? 0 : (double) extent_cnt / files.size(), fat.fragStats()};
+}
+
+int main(int argc, char *argv[]) {
+    u64 img_gb = argc > 1 ? (u64) atoi(argv[1]) : 8;
+    u32 round_cnt = argc > 2 ? (u32) atoi(argv[2]) : 3;
+    u32 free_ratio = 8;
+
+    char path[] = "/tmp/bench_fat_XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        return 1;
+    }
+    close(fd);
+    auto bpb = makeImage(path, img_gb << 30, free_ratio);
+    if (!bpb.has_value()) {
+        unlink(path);
+        return 1;
+    }
+    u32 clus_cnt = fat32::getCountOfClusters(bpb.value());
+
+    std::vector<u32> fat(bpb->BPB_FATsz32 * SECTOR_SIZE / fat32::KFATEntSz);
+    fillFAT(fat, free_ratio);
+    u64 scalar_cnt = 0, simd_cnt = 0;
+    double scalar_ns = benchMask(fat, round_cnt * 10, getFreeFATEntryMaskScalar, scalar_cnt);
+    double simd_ns = benchMask(fat, round_cnt * 10, fat32::getFreeFATEntryMask, simd_cnt);
+    printf("%-32s %10s %10s %10s\n", "ns per 64 entries", "scalar", "simd", "speedup");
+    printf("%-32s %10.1f %10.1f %9.2fx%s\n", "getFreeFATEntryMask", scalar_ns, simd_ns, scalar_ns / simd_ns,
+           scalar_cnt == simd_cnt ? "" : " (mismatch)");
+
+    u32 entry_cnt = 0, batch_cnt = 0;
+    double entry_ms = benchScan(path, bpb.value(), round_cnt, [&](fat32::FAT &fat) {
+        // how `FAT::availClusCnt` used to count, with a `readSector` for each entry
+        u32 free_cnt = 0;
+        for (u32 clus = 2; clus < clus_cnt + 2; clus++) {
+            fat32::FATPos fat_pos = fat32::getClusPosOnFAT(bpb.value(), clus);
+            if (fat.readFatEntry(fat_pos.fat_sec_num, fat_pos.fat_ent_offset) == 0) {
+                free_cnt++;
+            }
+        }
+        return free_cnt;
+    }, entry_cnt);
+    double batch_ms = benchScan(path, bpb.value(), round_cnt, [](fat32::FAT &fat) {
+        return fat.availClusCnt();
+    }, batch_cnt);
+    printf("\n%-32s %10s %10s %10s\n", "ms per FAT scan", "per entry", "batched", "speedup");
+    char name[64];
+    snprintf(name, sizeof(name), "%llu GiB image(%u clusters)", img_gb, clus_cnt);
+    printf("%-32s %10.1f %10.1f %9.2fx%s\n", name, entry_ms, batch_ms, entry_ms / batch_ms,
+           entry_cnt == batch_cnt ? "" : " (mismatch)");
+
+    unlink(path);
+
+    // the policies of allocation on the same churn of files, each over a new empty image since the FAT changed by
+    // the churn is written to the image
+    u32 op_cnt = 100000 * round_cnt;
+    printf("\n%-32s %10s %10s %10s %10s\n", "churn of files", "ms", "extents", "free ext", "longest");
+    const std::pair<const char *, fat32::AllocPolicy> alloc_policies[] = {
+            {"first-fit", fat32::AllocPolicy::FirstFit},
+            {"best-fit",  fat32::AllocPolicy::BestFit},
+            {"next-fit",  fat32::AllocPolicy::NextFit},
+    };
+    for (auto [policy_name, alloc_policy]: alloc_policies) {
+        auto empty_bpb = makeImage(path, img_gb << 30, 1);
+        if (!empty_bpb.has_value()) {
+            unlink(path);
+            return 1;
+        }
+        ChurnResult result = churnFiles(path, empty_bpb.value(), alloc_policy, op_cnt);
+        printf("%-32s %10.1f %10.2f %10u %10u\n", policy_name, result.ms, result.extent_per_file,
+               result.frag_stats.free_extent_cnt, result.frag_stats.max_free_extent_len);
+    }
+
+    unlink(path);
+    return 0;
+}
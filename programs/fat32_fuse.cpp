@@ -1,5 +1,6 @@
 #include <cerrno>
 #include <cassert>
+#include <chrono>
 #include <cstdio>
 #include <cstring>
 #include <optional>
@@ -16,7 +17,19 @@
 using util::u8, util::u16, util::u32, util::i64, util::u64;
 
 std::unique_ptr<fs::FAT32fs> filesystem;
+std::chrono::steady_clock::time_point last_sync_time;
 
+void syncFilesystem() {
+    filesystem->sync();
+    last_sync_time = std::chrono::steady_clock::now();
+}
+
+// Called after clusters are freed, so that they are discarded without waiting for fsync or unmount.
+void syncIfExpired() {
+    if (std::chrono::steady_clock::now() - last_sync_time >= std::chrono::milliseconds(SYNC_INTERVAL_MS)) {
+        syncFilesystem();
+    }
+}
 
 // If ino is provided, the directory must exist on the filesystem
 std::shared_ptr<fs::Directory> getExistDir(fuse_ino_t ino) {
@@ -159,6 +172,9 @@ static void fat32_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int
 
     auto new_stat = readFileStat(file);
     fuse_reply_attr(req, &new_stat, 0);
+    if (valid & FUSE_SET_ATTR_SIZE) {
+        syncIfExpired();
+    }
 }
 
 static void fat32_mknod(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, dev_t rdev) {
@@ -201,6 +217,7 @@ static void fat32_unlink(fuse_req_t req, fuse_ino_t parent, const char *name) {
     assert(parent_dir->delFile(name));
     child->selfDestruct();
     fuse_reply_err(req, 0);
+    syncIfExpired();
 }
 
 static void fat32_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name) {
@@ -225,6 +242,7 @@ static void fat32_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name) {
     assert(parent_dir->delFile(name));
     sub_dir->selfDestruct();
     fuse_reply_err(req, 0);
+    syncIfExpired();
 }
 
 static void fat32_symlink(fuse_req_t req, const char *link, fuse_ino_t parent, const char *name) {
@@ -286,6 +304,7 @@ static void fat32_rename(fuse_req_t req, fuse_ino_t parent, const char *name,
     }
 
     fuse_reply_err(req, 0);
+    syncIfExpired();
 }
 
 static void fat32_link(fuse_req_t req, fuse_ino_t ino, fuse_ino_t newparent, const char *newname) {
@@ -327,6 +346,7 @@ static void fat32_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info
 static void fat32_fsync(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi) {
     auto file = getExistFile(ino);
     file->sync(datasync);
+    syncFilesystem();
     fuse_reply_err(req, 0);
 }
 
@@ -408,6 +428,7 @@ static void fat32_fsyncdir(fuse_req_t req, fuse_ino_t ino, int datasync, struct
         return;
     }
     file->sync(datasync);
+    syncFilesystem();
     fuse_reply_err(req, 0);
 }
 
@@ -478,11 +499,14 @@ static const struct fuse_lowlevel_ops fat32_ll_oper = {
 int main(int argc, char *argv[]) {
     struct fuse_session *se;
     std::shared_ptr<device::LinuxFileDriver> real_device;
-    std::shared_ptr<device::CacheManager> cache_mgr;
+    std::shared_ptr<device::Device> fs_device;
+    std::shared_ptr<device::CacheManager> cache_manager;
     int ret = -1;
-    std::string mountpoint, device_path;
+    std::string mountpoint, device_path, cache_block, replace_policy, warm_list, alloc_policy;
+    u32 blk_sec_cnt = 1, readahead_sec_cnt;
+    util::ReplacePolicy policy = util::ReplacePolicy::LRU;
     cmdline::parser cmd_parser;
-    bool is_foreground, is_debug;
+    bool is_foreground, is_debug, use_io_uring, use_mmap, use_direct_io, use_huge_page, use_discard;
     std::vector<const char *> arguments;
     int fake_argc = 1;
     char **fake_argv;
@@ -492,12 +516,40 @@ int main(int argc, char *argv[]) {
     cmd_parser.add("foreground", 'f', "foreground operation");
     cmd_parser.add<std::string>("device-path", 'p', "the path to the device", true);
     cmd_parser.add<std::string>("mountpoint", 'm', "the mountpoint", true);
+    cmd_parser.add("io-uring", 'u', "submit batched device I/O through io_uring");
+    cmd_parser.add("mmap", 'M', "map the image file into memory instead of caching its sectors");
+    cmd_parser.add("direct-io", 'D', "bypass the page cache of block device");
+    cmd_parser.add<std::string>("cache-block", 'b', "the unit of sector cache", false, "page",
+                                cmdline::oneof<std::string>("sector", "page", "cluster"));
+    cmd_parser.add("huge-page", 'H', "back the sector cache with huge pages");
+    cmd_parser.add<std::string>("replace-policy", 'r', "the replacement policy of sector cache", false, "lru",
+                                cmdline::oneof<std::string>("lru", "2q", "clock-pro"));
+    cmd_parser.add<int>("readahead", 'a', "the max sectors read ahead for sequential reads, 0 to disable", false,
+                        READAHEAD_MAX_SECTOR_NUM, cmdline::range(0, MAX_BATCH_SECTOR_NUM));
+    cmd_parser.add("discard", 'T', "discard the freed clusters in the background(TRIM or punching holes)");
+    cmd_parser.add<std::string>("warm-cache", 'w', "the file to save the cached sectors at unmount and load them "
+                                                   "back at mount", false, "");
+    cmd_parser.add<std::string>("alloc-policy", 'A', "how the free clusters are picked for a file", false, "first",
+                                cmdline::oneof<std::string>("first", "best", "next"));
     cmd_parser.parse_check(argc, argv);
 
     mountpoint = util::getFullPath(cmd_parser.get<std::string>("mountpoint"));
     device_path = util::getFullPath(cmd_parser.get<std::string>("device-path"));
     is_foreground = cmd_parser.exist("foreground");
     is_debug = cmd_parser.exist("debug");
+    use_io_uring = cmd_parser.exist("io-uring");
+    use_mmap = cmd_parser.exist("mmap");
+    use_direct_io = cmd_parser.exist("direct-io");
+    cache_block = cmd_parser.get<std::string>("cache-block");
+    use_huge_page = cmd_parser.exist("huge-page");
+    replace_policy = cmd_parser.get<std::string>("replace-policy");
+    readahead_sec_cnt = cmd_parser.get<int>("readahead");
+    use_discard = cmd_parser.exist("discard");
+    warm_list = cmd_parser.get<std::string>("warm-cache");
+    if (!warm_list.empty()) {
+        warm_list = util::getFullPath(warm_list); // the working directory is changed after daemonized
+    }
+    alloc_policy = cmd_parser.get<std::string>("alloc-policy");
 
     arguments.push_back(argv[0]);
     if (is_debug) {
@@ -519,15 +571,70 @@ int main(int argc, char *argv[]) {
     if (fuse_session_mount(se, mountpoint.c_str()) != 0)
         goto err_out3;
 
-    real_device = std::make_shared<device::LinuxFileDriver>(device_path, SECTOR_SIZE);
-    cache_mgr = std::make_shared<device::CacheManager>(std::move(real_device));
-    filesystem = fs::FAT32fs::from(std::move(cache_mgr));
+    // the threads of the cache don't survive the fork, so daemonize before opening the device
     fuse_daemonize(is_foreground);
 
+    if (use_mmap) {
+        auto mmap_device = std::make_shared<device::MmapFileDriver>(device_path, SECTOR_SIZE);
+        if (!mmap_device->isMapped()) {
+            printf("the device can't be mapped, fall back to cached I/O.\n");
+        }
+        real_device = std::move(mmap_device);
+    } else if (use_io_uring) {
+        auto uring_device = std::make_shared<device::UringFileDriver>(device_path, SECTOR_SIZE);
+        if (!uring_device->isUringEnabled()) {
+            printf("io_uring is unavailable, fall back to synchronous I/O.\n");
+        }
+        real_device = std::move(uring_device);
+    } else {
+        real_device = std::make_shared<device::LinuxFileDriver>(device_path, SECTOR_SIZE, use_direct_io);
+        if (use_direct_io && !real_device->isDirectIO()) {
+            printf("direct I/O is only supported on block device, fall back to buffered I/O.\n");
+        }
+    }
+    if (use_mmap && std::static_pointer_cast<device::MmapFileDriver>(real_device)->isMapped()) {
+        fs_device = std::move(real_device); // the page cache already holds the image, don't cache it twice
+    } else {
+        if (cache_block == "page") {
+            blk_sec_cnt = CACHE_PAGE_SIZE / SECTOR_SIZE;
+        } else if (cache_block == "cluster") {
+            auto boot_sec = real_device->readSector(0).value();
+            blk_sec_cnt = std::max(((const fat32::BPB *) boot_sec->read_ptr(0))->BPB_sec_per_clus, (u8) 1);
+        }
+        if (replace_policy == "2q") {
+            policy = util::ReplacePolicy::TwoQ;
+        } else if (replace_policy == "clock-pro") {
+            policy = util::ReplacePolicy::ClockPro;
+        }
+        cache_manager = std::make_shared<device::CacheManager>(std::move(real_device), CACHED_SECTOR_NUM,
+                                                               blk_sec_cnt, use_huge_page, policy);
+        cache_manager->setReadahead(readahead_sec_cnt);
+        fs_device = cache_manager;
+    }
+    filesystem = fs::FAT32fs::from(std::move(fs_device));
+    last_sync_time = std::chrono::steady_clock::now();
+    if (use_discard) {
+        filesystem->fat().setDiscardQueue(std::make_shared<device::DiscardQueue>(filesystem->device()));
+    }
+    if (alloc_policy == "best") {
+        filesystem->fat().setAllocPolicy(fat32::AllocPolicy::BestFit);
+    } else if (alloc_policy == "next") {
+        filesystem->fat().setAllocPolicy(fat32::AllocPolicy::NextFit);
+    }
+    if (cache_manager != nullptr && !warm_list.empty() && !cache_manager->warmUp(warm_list)) {
+        printf("no cache warm list is loaded from %s.\n", warm_list.c_str());
+    }
+
     /* Block until ctrl+c or fusermount -u */
     ret = fuse_session_loop(se);
 
     filesystem->flush();
+    if (cache_manager != nullptr && !warm_list.empty() &&
+        !cache_manager->saveWarmList(warm_list, fat32::getFirstDataSector(filesystem->bpb()))) {
+        fprintf(stderr, "can't save the cache warm list to %s.\n", warm_list.c_str());
+    }
+    filesystem->device()->dumpStats(stderr);
+    filesystem->fat().dumpStats(stderr);
     fuse_session_unmount(se);
     err_out3:
     fuse_remove_signal_handlers(se);
@@ -1,6 +1,7 @@
 #include <fcntl.h>
 
 #include <sys/vfs.h>
+#include <algorithm>
 #include <cstdlib>
 
 #include "gtest/gtest.h"
@@ -96,6 +97,20 @@ public:
     }
 };
 
+static bool isOriginFATCopy(u32 fat_no) {
+    device::LinuxFileDriver device(regular_file, SECTOR_SIZE);
+    u8 const *snapshot_ptr = &fat_snapshot[fat_no * fat_sec_no_ * SECTOR_SIZE];
+    for (u32 sec_no = fat32::getFirstFATSector(bpb, fat_no); sec_no < fat32::getFirstFATSector(bpb, fat_no + 1);
+         sec_no++) {
+        auto sector = device.readSector(sec_no).value();
+        if (memcmp(snapshot_ptr, sector->read_ptr(0), SECTOR_SIZE) != 0) {
+            return false;
+        }
+        snapshot_ptr += SECTOR_SIZE;
+    }
+    return true;
+}
+
 static bool isOriginFAT() {
     device::LinuxFileDriver device(regular_file, SECTOR_SIZE);
     u8 const *snapshot_ptr = &fat_snapshot[0];
@@ -226,19 +241,40 @@ TEST(FAT32Test, genBasisNameFromLong) {
     }
 }
 
+TEST(FAT32Test, FreeFATEntryMask) {
+    u32 entries[64];
+    for (u32 i = 0; i < 64; i++) {
+        entries[i] = i % 3 == 0 ? 0 : i;
+    }
+    entries[1] = 0xF0000000; // the high 4 bits are reserved
+    entries[2] = 0x0FFFFFFF;
+
+    u64 mask = 0;
+    for (u32 i = 0; i < 64; i++) {
+        if (i % 3 == 0 || i == 1) {
+            mask |= 1ull << i;
+        }
+    }
+    mask &= ~(1ull << 2);
+    for (u32 ent_cnt = 0; ent_cnt <= 64; ent_cnt++) {
+        u64 ent_mask = ent_cnt == 64 ? ~0ull : (1ull << ent_cnt) - 1;
+        ASSERT_EQ(fat32::getFreeFATEntryMask((const u8 *) entries, ent_cnt), mask & ent_mask);
+    }
+}
+
 TEST(FAT32Test, AvailClusCnt) {
     fat32::FAT fat = fat32::FAT(bpb, 0xffffffff, device_);
     struct statfs fs_stat{};
     ASSERT_EQ(statfs(mnt_point, &fs_stat), 0);
 
     // check
-    u64 clus_cnt = fat.availClusCnt() + 2; // linux fat driver seems to treat the two reserved clusters as available
+    u64 clus_cnt = fat.availClusCnt();
     ASSERT_EQ(clus_cnt * bpb.BPB_sec_per_clus * SECTOR_SIZE, fs_stat.f_bsize * fs_stat.f_bfree);
 
     // alloc, free ant check again
     auto clus_chain = fat.allocClus(100).value();
     fat.freeClus(clus_chain[0]);
-    clus_cnt = fat.availClusCnt() + 2;
+    clus_cnt = fat.availClusCnt();
     ASSERT_EQ(clus_cnt * bpb.BPB_sec_per_clus * SECTOR_SIZE, fs_stat.f_bsize * fs_stat.f_bfree);
 }
 
@@ -300,6 +336,111 @@ TEST(FAT32Test, SetFreeCount) {
     ASSERT_TRUE(isOriginFAT());
 }
 
+TEST(FAT32Test, FSInfoHint) {
+    u32 avail_clus_cnt = fat32::FAT(bpb, 0xffffffff, device_).availClusCnt();
+
+    // the hints are kept up to date
+    fat32::FAT fat = fat32::FAT(bpb, 3, device_, avail_clus_cnt);
+    ASSERT_EQ(fat.availClusCnt(), avail_clus_cnt);
+    auto clus_chain = fat.allocClus(3).value();
+    ASSERT_EQ(clus_chain[0], 3);
+    ASSERT_EQ(fat.freeCount(), avail_clus_cnt - 3);
+    ASSERT_EQ(fat.nxtFree(), 6);
+    fat.freeClus(clus_chain[0]);
+    ASSERT_EQ(fat.freeCount(), avail_clus_cnt);
+    ASSERT_EQ(fat.nxtFree(), 3);
+    ASSERT_TRUE(isOriginFAT());
+
+    // a wrong free count is corrected once the FAT is all scanned
+    fat32::FAT wrong_fat = fat32::FAT(bpb, 2, device_, avail_clus_cnt + 10);
+    ASSERT_FALSE(wrong_fat.allocClus(avail_clus_cnt + 5).has_value());
+    ASSERT_EQ(wrong_fat.availClusCnt(), avail_clus_cnt);
+    ASSERT_TRUE(isOriginFAT());
+
+    // so is a free count too small, before an allocation fails on it
+    fat32::FAT small_fat = fat32::FAT(bpb, 0xffffffff, device_, 10);
+    ASSERT_EQ(small_fat.availClusCnt(), 10);
+    clus_chain = small_fat.allocClus(100).value();
+    ASSERT_EQ(small_fat.freeCount(), avail_clus_cnt - 100);
+    small_fat.freeClus(clus_chain[0]);
+    ASSERT_EQ(small_fat.freeCount(), avail_clus_cnt);
+    ASSERT_TRUE(isOriginFAT());
+
+    // FSInfo is marked unknown by the first change of the FAT after it's written
+    fat.writeFSInfo();
+    auto fs_info = *(fat32::FSInfo *) device_->readSector(bpb.BPB_fs_info).value()->read_ptr(0);
+    ASSERT_EQ(fs_info.free_count, avail_clus_cnt);
+    clus_chain = fat.allocClus(1).value();
+    fs_info = *(fat32::FSInfo *) device_->readSector(bpb.BPB_fs_info).value()->read_ptr(0);
+    ASSERT_EQ(fs_info.free_count, 0xFFFFFFFF);
+    ASSERT_EQ(fs_info.nxt_free, 0xFFFFFFFF);
+    fat.freeClus(clus_chain[0]);
+    fat.writeFSInfo();
+    ASSERT_TRUE(isOriginFAT());
+}
+
+TEST(FAT32Test, FreeBitmap) {
+    fat32::FAT fat = fat32::FAT(bpb, 0xffffffff, device_);
+    u32 avail_clus_cnt = fat.availClusCnt();
+
+    // shrink a chain, the freed clusters are found again
+    auto clus_chain = fat.allocClus(200).value();
+    u32 fst_clus = clus_chain[0];
+    ASSERT_TRUE(fat.resize(fst_clus, 100, false));
+    ASSERT_EQ(fat.availClusCnt(), avail_clus_cnt - 100);
+    ASSERT_EQ(fat32::FAT(bpb, 0xffffffff, device_).availClusCnt(), avail_clus_cnt - 100);
+    ASSERT_EQ(fat.allocClus(1).value()[0], clus_chain[100]);
+
+    // clear
+    fat.freeClus(clus_chain[100]);
+    fat.freeClus(fst_clus);
+    ASSERT_EQ(fat.availClusCnt(), avail_clus_cnt);
+    ASSERT_TRUE(isOriginFAT());
+}
+
+TEST(FAT32Test, Mirror) {
+    fat32::FAT fat = fat32::FAT(bpb, 0xffffffff, device_);
+    ASSERT_FALSE(fat.loadMirror(0));
+    ASSERT_TRUE(fat.loadMirror(fat_sec_no_ * SECTOR_SIZE));
+
+    // the active FAT on the device is written through, the other one is only changed by flushFAT
+    auto clus_chain = fat.allocClus(5).value();
+    ASSERT_EQ(fat.readClusChains(clus_chain[0]), clus_chain);
+    ASSERT_EQ(fat32::FAT(bpb, 0xffffffff, device_).readClusChains(clus_chain[0]), clus_chain);
+    ASSERT_TRUE(isOriginFATCopy(1));
+    fat.flushFAT();
+    ASSERT_FALSE(isOriginFATCopy(1));
+
+    // clear
+    fat.freeClus(clus_chain[0]);
+    fat.flushFAT();
+    ASSERT_TRUE(isOriginFAT());
+}
+
+TEST(FAT32Test, DeferredMirroring) {
+    // only the active FAT is written until flushFAT
+    fat32::FAT fat = fat32::FAT(bpb, 0xffffffff, device_);
+    auto clus_chain = fat.allocClus(5).value();
+    ASSERT_TRUE(isOriginFATCopy(1));
+    fat.flushFAT();
+    ASSERT_FALSE(isOriginFATCopy(1));
+    fat.freeClus(clus_chain[0]);
+    fat.flushFAT();
+    ASSERT_TRUE(isOriginFAT());
+
+    // the mirroring is disabled, and the second FAT is the active one
+    fat32::BPB active_bpb = bpb;
+    active_bpb.BPB_ext_flags = 0x81;
+    fat32::FAT active_fat = fat32::FAT(active_bpb, 0xffffffff, device_);
+    clus_chain = active_fat.allocClus(5).value();
+    active_fat.flushFAT();
+    ASSERT_TRUE(isOriginFATCopy(0));
+    ASSERT_FALSE(isOriginFATCopy(1));
+    active_fat.freeClus(clus_chain[0]);
+    active_fat.flushFAT();
+    ASSERT_TRUE(isOriginFAT());
+}
+
 TEST(FAT32Test, ReadClusChain) {
     fat32::FAT fat = fat32::FAT(bpb, 0xffffffff, device_);
     std::vector<u32> clus_chain, read_clus_chain;
@@ -318,6 +459,109 @@ TEST(FAT32Test, ReadClusChain) {
     ASSERT_TRUE(isOriginFAT());
 }
 
+TEST(FAT32Test, ClusChain) {
+    fat32::ClusChain clus_chain;
+    std::vector<u32> clusters = {5, 6, 7, 10, 11, 3, 20};
+    for (u32 clus: clusters) {
+        clus_chain.push(clus);
+    }
+    ASSERT_EQ(clus_chain.size(), clusters.size());
+    ASSERT_EQ(clus_chain.extents().size(), 4);
+    for (u32 i = 0; i < clusters.size(); i++) {
+        ASSERT_EQ(clus_chain[i], clusters[i]);
+    }
+    ASSERT_EQ(clus_chain.back(), 20);
+
+    clus_chain.truncate(4);
+    ASSERT_EQ(clus_chain.extents().size(), 2);
+    ASSERT_EQ(clus_chain.back(), 10);
+    clus_chain.push(11);
+    ASSERT_EQ(clus_chain.extents().size(), 2);
+    clus_chain.truncate(0);
+    ASSERT_TRUE(clus_chain.empty());
+    ASSERT_TRUE(clus_chain.extents().empty());
+}
+
+TEST(FAT32Test, ResizeClusExtents) {
+    fat32::FAT fat = fat32::FAT(bpb, 0xffffffff, device_);
+    u32 fst_clus = 0, other_fst_clus = 0;
+    fat32::ClusChain clus_chain, other_clus_chain;
+
+    // grow two chains in turn, so that they are fragmented
+    for (u32 i = 1; i <= 10; i++) {
+        ASSERT_TRUE(fat.resize(fst_clus, clus_chain, i * 2, false));
+        ASSERT_TRUE(fat.resize(other_fst_clus, other_clus_chain, i, false));
+    }
+    ASSERT_EQ(clus_chain.extents().size(), 10);
+    ASSERT_EQ(fat.readClusExtents(fst_clus).extents().size(), 10);
+    auto read_clus_chain = fat.readClusChains(fst_clus);
+    ASSERT_EQ(read_clus_chain.size(), clus_chain.size());
+    for (u32 i = 0; i < read_clus_chain.size(); i++) {
+        ASSERT_EQ(read_clus_chain[i], clus_chain[i]);
+    }
+
+    // shrink in the middle of an extent
+    ASSERT_TRUE(fat.resize(fst_clus, clus_chain, 7, false));
+    ASSERT_EQ(clus_chain.size(), 7);
+    ASSERT_EQ(fat.readClusChains(fst_clus).size(), 7);
+    ASSERT_EQ(fat.readClusChains(fst_clus).back(), clus_chain.back());
+
+    // clear
+    ASSERT_TRUE(fat.resize(fst_clus, clus_chain, 0, false));
+    ASSERT_TRUE(fat.resize(other_fst_clus, other_clus_chain, 0, false));
+    ASSERT_EQ(fst_clus, 0);
+    ASSERT_TRUE(isOriginFAT());
+}
+
+TEST(FAT32Test, AllocPolicy) {
+    fat32::FAT fat = fat32::FAT(bpb, 0xffffffff, device_);
+    u32 avail_clus_cnt = fat.availClusCnt();
+    fat.setAllocPolicy(fat32::AllocPolicy::BestFit);
+
+    // leave a hole of 30 clusters at 103 and one of 10 clusters at 183
+    ASSERT_EQ(fat.allocClus(100).value()[0], 3);
+    ASSERT_EQ(fat.allocClus(30).value()[0], 103);
+    ASSERT_EQ(fat.allocClus(50).value()[0], 133);
+    ASSERT_EQ(fat.allocClus(10).value()[0], 183);
+    ASSERT_EQ(fat.allocClus(100).value()[0], 193);
+    fat.freeClus(103);
+    fat.freeClus(183);
+    ASSERT_EQ(fat.fragStats().free_extent_cnt, 3);
+    ASSERT_EQ(fat.fragStats().free_clus_cnt, avail_clus_cnt - 250);
+
+    // the shortest hole long enough is taken, and a file grows in a row from its tail
+    ASSERT_EQ(fat.allocClus(8).value()[0], 183);
+    fat.freeClus(183);
+    u32 fst_clus = 0;
+    fat32::ClusChain clus_chain;
+    ASSERT_TRUE(fat.resize(fst_clus, clus_chain, 15, false));
+    ASSERT_TRUE(fat.resize(fst_clus, clus_chain, 25, false));
+    ASSERT_EQ(fst_clus, 103);
+    ASSERT_EQ(clus_chain.extents().size(), 1);
+    ASSERT_TRUE(fat.resize(fst_clus, clus_chain, 0, false));
+
+    // the first hole long enough from where the last allocation ended
+    fat.setAllocPolicy(fat32::AllocPolicy::NextFit);
+    ASSERT_EQ(fat.allocClus(20).value()[0], 293);
+    ASSERT_EQ(fat.allocClus(5).value()[0], 313);
+    fat.freeClus(293);
+    fat.freeClus(313);
+
+    // no hole is long enough, the longest ones are taken in the order of clusters
+    auto all_clus_chain = fat.allocClus(fat.availClusCnt()).value();
+    ASSERT_TRUE(std::is_sorted(all_clus_chain.begin(), all_clus_chain.end()));
+    ASSERT_EQ(fat.fragStats().free_extent_cnt, 0);
+
+    // clear
+    fat.freeClus(all_clus_chain[0]);
+    fat.freeClus(3);
+    fat.freeClus(133);
+    fat.freeClus(193);
+    ASSERT_EQ(fat.availClusCnt(), avail_clus_cnt);
+    ASSERT_EQ(fat.fragStats().free_extent_cnt, 1);
+    ASSERT_TRUE(isOriginFAT());
+}
+
 TEST(FAT32Test, Resize) {
     fat32::FAT fat = fat32::FAT(bpb, 0xffffffff, device_);
     std::vector<u32> expect_result;
@@ -1,6 +1,9 @@
 #include <unistd.h>
 #include <cstring>
 #include <cerrno>
+#include <algorithm>
+#include <list>
+#include <thread>
 
 #include "gtest/gtest.h"
 
@@ -127,6 +130,237 @@ TEST(LRUCacheMapTest, Remove) {
     }
 }
 
+/**
+ * Refer to the hot keys repeatedly, then scan through many keys referred only once.
+ * */
+static void scanCacheMap(util::LRUCacheMap<u32, u32> &map, u32 hot_cnt) {
+    for (u32 round = 0; round < 3; ++round) {
+        for (u32 key = 0; key < hot_cnt; ++key) {
+            if (!map.get(key).has_value()) {
+                map.put(key, key);
+            }
+        }
+        for (u32 key = 100 * (round + 1); key < 100 * (round + 1) + hot_cnt; ++key) {
+            map.put(key, key);
+        }
+    }
+    for (u32 key = 1000; key < 1100; ++key) {
+        map.put(key, key);
+    }
+}
+
+TEST(LRUCacheMapTest, ScanResistance) {
+    u32 max_size = 8, hot_cnt = 4;
+    util::LRUCacheMap<u32, u32> lru_map(max_size);
+    scanCacheMap(lru_map, hot_cnt);
+    for (u32 key = 0; key < hot_cnt; ++key) {
+        ASSERT_FALSE(lru_map.peek(key).has_value());
+    }
+
+    for (auto policy: {util::ReplacePolicy::TwoQ, util::ReplacePolicy::ClockPro}) {
+        util::LRUCacheMap<u32, u32> map(max_size, policy);
+        scanCacheMap(map, hot_cnt);
+        ASSERT_EQ(map.size(), max_size);
+        for (u32 key = 0; key < hot_cnt; ++key) {
+            ASSERT_EQ(map.peek(key).value(), key);
+        }
+    }
+}
+
+TEST(LRUCacheMapTest, RandomOperations) {
+    for (auto policy: {util::ReplacePolicy::LRU, util::ReplacePolicy::TwoQ, util::ReplacePolicy::ClockPro}) {
+        u32 max_size = 16;
+        util::LRUCacheMap<u32, u32> map(max_size, policy);
+        srand(1);
+        for (int i = 0; i < 100000; ++i) {
+            u32 key = rand() % 64, op = rand() % 8;
+            if (op == 0) {
+                map.remove(key);
+                ASSERT_FALSE(map.peek(key).has_value());
+            } else if (op < 4) {
+                map.put(key, key + 1);
+                ASSERT_EQ(map.peek(key).value(), key + 1);
+            } else {
+                auto value = map.get(key);
+                ASSERT_TRUE(!value.has_value() || value.value() == key + 1);
+            }
+            ASSERT_LE(map.size(), max_size);
+            if (i % 10000 == 0) {
+                map.clear();
+            }
+        }
+        u32 cnt = 0;
+        for (const auto &item: map) {
+            ASSERT_EQ(map.peek(item.first).value(), item.first + 1);
+            cnt++;
+        }
+        ASSERT_EQ(cnt, map.size());
+    }
+}
+
+TEST(LRUCacheMapTest, SameOrderAsList) {
+    u32 max_size = 37;
+    util::LRUCacheMap<u64, u32> lru_map(max_size);
+    std::list<u64> keys; // from the most recently used to the least recently used
+    srand(2);
+    for (int i = 0; i < 200000; ++i) {
+        u64 key = (u64) (rand() % 128) << 20;
+        auto it = std::find(keys.begin(), keys.end(), key);
+        if (rand() % 4 == 0) {
+            ASSERT_EQ(lru_map.remove(key).has_value(), it != keys.end());
+            if (it != keys.end()) {
+                keys.erase(it);
+            }
+            continue;
+        }
+        lru_map.put(key, i);
+        if (it != keys.end()) {
+            keys.erase(it);
+        } else if (keys.size() == max_size) {
+            keys.pop_back();
+        }
+        keys.push_front(key);
+    }
+    ASSERT_EQ(lru_map.size(), keys.size());
+    auto it = keys.begin();
+    for (const auto &item: lru_map) {
+        ASSERT_EQ(item.first, *it++);
+    }
+}
+
+TEST(LRUCacheMapTest, PutReturnsEvicted) {
+    util::LRUCacheMap<u32, u32> lru_map(2);
+    ASSERT_FALSE(lru_map.put(1, 100).has_value());
+    ASSERT_FALSE(lru_map.put(2, 200).has_value());
+    ASSERT_FALSE(lru_map.put(1, 101).has_value());
+    auto evicted = lru_map.put(3, 300);
+    ASSERT_EQ(evicted.value().first, 2);
+    ASSERT_EQ(evicted.value().second, 200);
+}
+
+TEST(LRUCacheMapTest, SecondChance) {
+    // the values index the reference bits of the items
+    bool referenced[8] = {false};
+    util::LRUCacheMap<u32, u32> lru_map(3);
+    lru_map.setSecondChance([&](u32 &i) { return std::exchange(referenced[i], false); });
+    for (u32 i = 1; i <= 3; ++i) {
+        lru_map.put(i, i);
+    }
+
+    // item 1 is referenced without going through the map, so item 2 is evicted instead
+    referenced[1] = true;
+    ASSERT_EQ(lru_map.put(4, 4).value().first, 2);
+    ASSERT_FALSE(referenced[1]);
+
+    // every item is referenced, the least recently used one is evicted after a round
+    referenced[1] = referenced[3] = referenced[4] = true;
+    ASSERT_EQ(lru_map.put(5, 5).value().first, 3);
+}
+
+/**
+ * EpochDomainTest
+ * */
+TEST(EpochDomainTest, SafeEpoch) {
+    util::EpochDomain domain;
+    u64 retired_epoch;
+    {
+        util::EpochDomain::Guard guard(domain);
+        retired_epoch = domain.retire();
+        // the reader pinned before the retirement may still see the object
+        ASSERT_LE(domain.safeEpoch(), retired_epoch);
+    }
+
+    // the readers coming later can't
+    util::EpochDomain::Guard guard(domain);
+    ASSERT_GT(domain.safeEpoch(), retired_epoch);
+}
+
+/**
+ * LatencyHistogramTest
+ * */
+TEST(RangeSetTest, AddAndRemove) {
+    util::RangeSet range_set;
+    ASSERT_EQ(range_set.add(0, 4), 4);
+    ASSERT_EQ(range_set.add(8, 12), 4);
+    ASSERT_EQ(range_set.add(3, 9), 4); // merged with both
+    ASSERT_EQ(std::distance(range_set.begin(), range_set.end()), 1);
+    ASSERT_TRUE(range_set.contains(0, 12));
+    ASSERT_FALSE(range_set.contains(11, 13));
+
+    // cut out of the middle
+    ASSERT_EQ(range_set.remove(5, 7), 2);
+    ASSERT_EQ(range_set.remove(5, 7), 0);
+    ASSERT_EQ(range_set.size(), 10);
+    ASSERT_TRUE(range_set.contains(0, 5));
+    ASSERT_FALSE(range_set.contains(4, 8));
+    ASSERT_TRUE(range_set.contains(7, 12));
+    ASSERT_EQ(range_set.remove(2, 20), 8);
+    ASSERT_EQ(range_set.begin()->first, 0);
+    ASSERT_EQ(range_set.begin()->second, 2);
+    ASSERT_EQ(range_set.size(), 2);
+}
+
+TEST(LatencyHistogramTest, Percentile) {
+    util::LatencyHistogram histogram;
+    ASSERT_EQ(histogram.percentile(50), 0);
+    for (int i = 0; i < 99; ++i) {
+        histogram.record(100);
+    }
+    histogram.record(1000000);
+    ASSERT_EQ(histogram.count(), 100);
+    ASSERT_EQ(histogram.bucket(6), 99);
+    ASSERT_EQ(histogram.percentile(50), 128);
+    ASSERT_EQ(histogram.percentile(100), 1 << 20);
+    ASSERT_EQ(histogram.totalNs(), 99 * 100 + 1000000);
+}
+
+/**
+ * SlabArenaTest
+ * */
+TEST(SlabArenaTest, AllocateAndRecycle) {
+    util::SlabArena arena(100, 4);
+    ASSERT_EQ(arena.slotSz() % 64, 0);
+    std::vector<void *> slots;
+    for (int i = 0; i < 4; ++i) {
+        void *slot = arena.allocate();
+        ASSERT_NE(slot, nullptr);
+        ASSERT_TRUE(arena.owns(slot));
+        memset(slot, i, 100);
+        slots.push_back(slot);
+    }
+    ASSERT_EQ(arena.allocate(), nullptr);
+    ASSERT_EQ(arena.freeSlotCnt(), 0);
+
+    // the latest freed slot is handed out first
+    arena.deallocate(slots[1]);
+    arena.deallocate(slots[2]);
+    ASSERT_EQ(arena.freeSlotCnt(), 2);
+    ASSERT_EQ(arena.allocate(), slots[2]);
+    ASSERT_EQ(arena.allocate(), slots[1]);
+}
+
+TEST(SlabArenaTest, HugePage) {
+    // fall back to normal pages when no huge page is reserved
+    util::SlabArena arena(SECTOR_SIZE, 8, true);
+    void *slot = arena.allocate();
+    ASSERT_NE(slot, nullptr);
+    memset(slot, 0x66, SECTOR_SIZE);
+    arena.deallocate(slot);
+}
+
+TEST(SlabArenaTest, Allocator) {
+    auto arena = std::make_shared<util::SlabArena>(4 * sizeof(u32), 1);
+    std::vector<u32, util::SlabAllocator<u32>> values{util::SlabAllocator<u32>(arena)};
+    values.reserve(4);
+    ASSERT_TRUE(arena->owns(&values[0]));
+    ASSERT_EQ(arena->freeSlotCnt(), 0);
+
+    // too large for a slot, taken from heap
+    values.reserve(8);
+    ASSERT_FALSE(arena->owns(&values[0]));
+    ASSERT_EQ(arena->freeSlotCnt(), 1);
+}
+
 void testRegularRWOnDevice(device::Device &device) {
     char val = 0x66;
     for (u32 i = 0; i < sector_num; ++i) {
@@ -163,6 +397,36 @@ void testBlkDevRWOnDevice(device::Device &device) {
     }
 }
 
+void testBatchRWOnDevice(device::Device &device) {
+    u32 cnt = 8;
+    std::vector<std::vector<u8>> values(cnt, std::vector<u8>(SECTOR_SIZE));
+    std::vector<const u8 *> bufs;
+    for (u32 i = 0; i < cnt; ++i) {
+        memset(&values[i][0], 0x10 + i, SECTOR_SIZE);
+        bufs.push_back(&values[i][0]);
+    }
+    ASSERT_TRUE(device.writeSectors(4, bufs));
+
+    auto sectors = device.readSectors(4, cnt).value();
+    ASSERT_EQ(sectors.size(), cnt);
+    for (u32 i = 0; i < cnt; ++i) {
+        ASSERT_EQ(memcmp(sectors[i]->read_ptr(0), &values[i][0], SECTOR_SIZE), 0);
+    }
+
+    std::vector<std::vector<u8>> read_values(cnt, std::vector<u8>(SECTOR_SIZE));
+    std::vector<u8 *> read_bufs;
+    for (u32 i = 0; i < cnt; ++i) {
+        read_bufs.push_back(&read_values[i][0]);
+    }
+    ASSERT_TRUE(device.readSectorsValue(4, read_bufs));
+    ASSERT_EQ(read_values, values);
+
+    // out of bound
+    ASSERT_FALSE(device.readSectors(sector_num - 1, 2).has_value());
+    ASSERT_FALSE(device.writeSectors(sector_num - 1, bufs));
+    ASSERT_FALSE(device.readSectorsValue(sector_num - 1, read_bufs));
+}
+
 /**
  * LinuxFileDriverTest
  * */
@@ -180,6 +444,211 @@ TEST(LinuxFileDriverTest, BlkDevRW) {
     testBlkDevRWOnDevice(linux_file_driver);
 }
 
+TEST(LinuxFileDriverTest, BatchRW) {
+    device::LinuxFileDriver linux_file_driver(regular_file, SECTOR_SIZE);
+    testBatchRWOnDevice(linux_file_driver);
+}
+
+TEST(LinuxFileDriverTest, DirectIO) {
+    if (!enable_loop) {
+        GTEST_SKIP();
+    }
+
+    device::LinuxFileDriver linux_file_driver(loop_name, SECTOR_SIZE, true);
+    ASSERT_TRUE(linux_file_driver.isDirectIO());
+    ASSERT_GE(linux_file_driver.physicalBlkSz(), linux_file_driver.logicalBlkSz());
+    testBlkDevRWOnDevice(linux_file_driver);
+    testBatchRWOnDevice(linux_file_driver);
+
+    // regular file never uses direct io
+    device::LinuxFileDriver regular_driver(regular_file, SECTOR_SIZE, true);
+    ASSERT_FALSE(regular_driver.isDirectIO());
+}
+
+TEST(LinuxFileDriverTest, DirectIOPartialBlock) {
+    if (!enable_loop) {
+        GTEST_SKIP();
+    }
+
+    // sectors smaller than the logical block of device, so that a single sector only covers part of the block.
+    u32 small_sec_sz = SECTOR_SIZE / 2;
+    device::LinuxFileDriver linux_file_driver(loop_name, small_sec_sz, true);
+    ASSERT_TRUE(linux_file_driver.isDirectIO());
+    std::vector<u8> zero(small_sec_sz, 0), value(small_sec_sz, 0x77);
+    std::vector<const u8 *> bufs(3, &zero[0]);
+    ASSERT_TRUE(linux_file_driver.writeSectors(0, bufs));
+
+    // the neighbours in the same block must be kept
+    ASSERT_TRUE(linux_file_driver.writeSectors(1, {&value[0]}));
+    auto sectors = linux_file_driver.readSectors(0, 3).value();
+    ASSERT_EQ(memcmp(sectors[0]->read_ptr(0), &zero[0], small_sec_sz), 0);
+    ASSERT_EQ(memcmp(sectors[1]->read_ptr(0), &value[0], small_sec_sz), 0);
+    ASSERT_EQ(memcmp(sectors[2]->read_ptr(0), &zero[0], small_sec_sz), 0);
+}
+
+TEST(LinuxFileDriverTest, Discard) {
+    device::LinuxFileDriver linux_file_driver(regular_file, SECTOR_SIZE);
+    std::vector<u8> value(SECTOR_SIZE, 0x5a), zero(SECTOR_SIZE, 0);
+    ASSERT_TRUE(linux_file_driver.writeSectors(8, std::vector<const u8 *>(24, &value[0])));
+
+    // a hole is punched in the regular file, which reads as zero
+    ASSERT_TRUE(linux_file_driver.discardSectors(16, 8));
+    auto sectors = linux_file_driver.readSectors(8, 24).value();
+    for (u32 i = 8; i < 32; ++i) {
+        auto &expected = i >= 16 && i < 24 ? zero : value;
+        ASSERT_EQ(memcmp(sectors[i - 8]->read_ptr(0), &expected[0], SECTOR_SIZE), 0);
+    }
+    ASSERT_EQ(linux_file_driver.ioStats().discard_cnt, 1);
+    ASSERT_EQ(linux_file_driver.ioStats().discarded_bytes, 8 * SECTOR_SIZE);
+    ASSERT_FALSE(linux_file_driver.discardSectors(sector_num - 1, 2));
+}
+
+TEST(LinuxFileDriverTest, ZeroSectors) {
+    device::LinuxFileDriver linux_file_driver(regular_file, SECTOR_SIZE);
+    std::vector<u8> value(SECTOR_SIZE, 0x2d), zero(SECTOR_SIZE, 0);
+    ASSERT_TRUE(linux_file_driver.writeSectors(8, std::vector<const u8 *>(16, &value[0])));
+
+    ASSERT_TRUE(linux_file_driver.zeroSectors(10, 6));
+    auto sectors = linux_file_driver.readSectors(8, 16).value();
+    for (u32 i = 8; i < 24; ++i) {
+        auto &expected = i >= 10 && i < 16 ? zero : value;
+        ASSERT_EQ(memcmp(sectors[i - 8]->read_ptr(0), &expected[0], SECTOR_SIZE), 0);
+    }
+    ASSERT_EQ(linux_file_driver.ioStats().zero_cnt, 1);
+    ASSERT_EQ(linux_file_driver.ioStats().write_cnt, 1);
+    ASSERT_FALSE(linux_file_driver.zeroSectors(sector_num - 1, 2));
+}
+
+TEST(LinuxFileDriverTest, SparseRead) {
+    const char sparse_file[] = "sparse_file";
+    std::vector<u8> value(SECTOR_SIZE, 0x4e), zero(SECTOR_SIZE, 0);
+    int fd = open(sparse_file, O_CREAT | O_RDWR | O_TRUNC, 0644);
+    ASSERT_GE(fd, 0);
+    ASSERT_EQ(ftruncate(fd, regular_file_sz), 0);
+    ASSERT_EQ(pwrite(fd, &value[0], SECTOR_SIZE, 8 * SECTOR_SIZE), SECTOR_SIZE);
+    ASSERT_EQ(close(fd), 0);
+    {
+        // the file system allocates the page of sector 8, the others are in holes
+        device::LinuxFileDriver linux_file_driver(sparse_file, SECTOR_SIZE);
+        ASSERT_EQ(linux_file_driver.holeSecCnt(), sector_num - 8);
+        auto sectors = linux_file_driver.readSectors(16, 8).value();
+        ASSERT_EQ(memcmp(sectors[7]->read_ptr(0), &zero[0], SECTOR_SIZE), 0);
+        ASSERT_EQ(linux_file_driver.ioStats().hole_read_cnt, 1);
+        ASSERT_EQ(linux_file_driver.ioStats().syscall_cnt, 0);
+        sectors = linux_file_driver.readSectors(4, 8).value();
+        ASSERT_EQ(memcmp(sectors[4]->read_ptr(0), &value[0], SECTOR_SIZE), 0);
+        ASSERT_EQ(linux_file_driver.ioStats().syscall_cnt, 1);
+
+        // the holes are filled by the writes, and made by the discards
+        ASSERT_TRUE(linux_file_driver.writeSectorValue(20, &value[0]));
+        ASSERT_EQ(linux_file_driver.holeSecCnt(), sector_num - 9);
+        ASSERT_EQ(memcmp(linux_file_driver.readSector(20).value()->read_ptr(0), &value[0], SECTOR_SIZE), 0);
+        ASSERT_TRUE(linux_file_driver.discardSectors(8, 8));
+        ASSERT_EQ(linux_file_driver.holeSecCnt(), sector_num - 1);
+    }
+    ASSERT_EQ(unlink(sparse_file), 0);
+}
+
+/**
+ * MmapFileDriverTest
+ * */
+TEST(MmapFileDriverTest, RegularRW) {
+    device::MmapFileDriver mmap_file_driver(regular_file, SECTOR_SIZE);
+    ASSERT_TRUE(mmap_file_driver.isMapped());
+    testRegularRWOnDevice(mmap_file_driver);
+    testBatchRWOnDevice(mmap_file_driver);
+}
+
+TEST(MmapFileDriverTest, SectorsShareMapping) {
+    device::MmapFileDriver mmap_file_driver(regular_file, SECTOR_SIZE);
+    auto mess_len = strlen(message);
+    auto w_sector = mmap_file_driver.readSector(1).value();
+    strncpy((char *) w_sector->write_ptr(0), message, mess_len);
+
+    // another view of the same sector sees the value before it's synced
+    auto r_sector = mmap_file_driver.readSector(1).value();
+    ASSERT_EQ(r_sector->read_ptr(0), w_sector->read_ptr(0));
+    ASSERT_EQ(strncmp(message, (const char *) r_sector->read_ptr(0), mess_len), 0);
+}
+
+TEST(MmapFileDriverTest, WriteBack) {
+    auto mess_len = strlen(message);
+    {
+        device::MmapFileDriver mmap_file_driver(regular_file, SECTOR_SIZE);
+        for (u32 i = 8; i < 16; i += 2) { // leave holes between dirty sectors
+            auto sector = mmap_file_driver.readSector(i).value();
+            strncpy((char *) sector->write_ptr(0), message, mess_len);
+        }
+        mmap_file_driver.clear();
+    }
+
+    device::LinuxFileDriver linux_file_driver(regular_file, SECTOR_SIZE);
+    for (u32 i = 8; i < 16; i += 2) {
+        auto r_sector = linux_file_driver.readSector(i).value();
+        ASSERT_EQ(strncmp(message, (const char *) r_sector->read_ptr(0), mess_len), 0);
+    }
+}
+
+/**
+ * UringFileDriverTest
+ * */
+TEST(UringFileDriverTest, RegularRW) {
+    device::UringFileDriver uring_file_driver(regular_file, SECTOR_SIZE);
+    if (!uring_file_driver.isUringEnabled()) {
+        printf("io_uring is unavailable, the synchronous driver is tested instead.\n");
+    }
+    testRegularRWOnDevice(uring_file_driver);
+    testBatchRWOnDevice(uring_file_driver);
+}
+
+TEST(UringFileDriverTest, ManyRequestsInFlight) {
+    // a small queue forces the batch to be split into several rounds of submission
+    device::UringFileDriver uring_file_driver(regular_file, SECTOR_SIZE, 2);
+    std::vector<u8> value(SECTOR_SIZE * sector_num);
+    std::vector<const u8 *> bufs;
+    for (u32 i = 0; i < sector_num; ++i) {
+        memset(&value[i * SECTOR_SIZE], (int) i, SECTOR_SIZE);
+        bufs.push_back(&value[i * SECTOR_SIZE]);
+    }
+    ASSERT_TRUE(uring_file_driver.writeSectors(0, bufs));
+
+    auto sectors = uring_file_driver.readSectors(0, sector_num).value();
+    for (u32 i = 0; i < sector_num; ++i) {
+        ASSERT_EQ(memcmp(sectors[i]->read_ptr(0), &value[i * SECTOR_SIZE], SECTOR_SIZE), 0);
+    }
+}
+
+TEST(UringFileDriverTest, ConcurrentCallers) {
+    // each thread waits on a ring of its own, the runs of sectors don't overlap
+    device::UringFileDriver uring_file_driver(regular_file, SECTOR_SIZE, 2);
+    u32 thread_cnt = 4, run_sec_cnt = sector_num / thread_cnt;
+    std::vector<std::thread> threads;
+    std::atomic<u32> mismatch_cnt{0};
+    for (u32 t = 0; t < thread_cnt; ++t) {
+        threads.emplace_back([&, t] {
+            std::vector<u8> value(SECTOR_SIZE, (u8) (0x70 + t));
+            for (int round = 0; round < 20; ++round) {
+                uring_file_driver.writeSectors(t * run_sec_cnt, std::vector<const u8 *>(run_sec_cnt, &value[0]));
+                auto sectors = uring_file_driver.readSectors(t * run_sec_cnt, run_sec_cnt).value();
+                for (auto &sector: sectors) {
+                    mismatch_cnt += memcmp(sector->read_ptr(0), &value[0], SECTOR_SIZE) != 0;
+                }
+            }
+        });
+    }
+    for (auto &thread: threads) {
+        thread.join();
+    }
+    ASSERT_EQ(mismatch_cnt, 0);
+}
+
+TEST(UringFileDriverTest, Fallback) {
+    device::UringFileDriver uring_file_driver(regular_file, SECTOR_SIZE, 0); // an empty ring can't be set up
+    ASSERT_FALSE(uring_file_driver.isUringEnabled());
+    testRegularRWOnDevice(uring_file_driver);
+    testBatchRWOnDevice(uring_file_driver);
+}
+
 /**
  * SectorTest
  * */
@@ -249,12 +718,421 @@ TEST(CacheManagerTest, LRU) {
     ASSERT_TRUE(cacheManager.contains(4));
 }
 
+TEST(CacheManagerTest, BatchRead) {
+    auto real_device = std::make_shared<device::LinuxFileDriver>(regular_file, SECTOR_SIZE);
+    device::CacheManager cacheManager(std::move(real_device), 8);
+    auto sec2 = cacheManager.readSector(2).value();
+    auto sec4 = cacheManager.readSector(4).value();
+
+    // cached sectors are returned as they are, missing ones are fetched and cached
+    auto sectors = cacheManager.readSectors(1, 6).value();
+    ASSERT_EQ(sectors.size(), 6);
+    ASSERT_EQ(sectors[1], sec2);
+    ASSERT_EQ(sectors[3], sec4);
+    for (u32 i = 1; i < 7; ++i) {
+        ASSERT_TRUE(cacheManager.contains(i));
+    }
+    ASSERT_FALSE(cacheManager.readSectors(sector_num - 1, 2).has_value());
+}
+
+TEST(CacheManagerTest, Block) {
+    auto real_device = std::make_shared<device::LinuxFileDriver>(regular_file, SECTOR_SIZE);
+    device::CacheManager cacheManager(real_device, 16, 8);
+    auto mess_len = strlen(message);
+
+    // the whole block is fetched, and sectors of the same block share it
+    auto sec3 = cacheManager.readSector(3).value();
+    for (u32 i = 0; i < 8; ++i) {
+        ASSERT_TRUE(cacheManager.contains(i));
+    }
+    ASSERT_FALSE(cacheManager.contains(8));
+    auto sec5 = cacheManager.readSector(5).value();
+    ASSERT_EQ((const u8 *) sec5->read_ptr(0) - (const u8 *) sec3->read_ptr(0), 2 * SECTOR_SIZE);
+
+    // two blocks at most, the first block is referenced by the hit, so the second one is evicted instead
+    cacheManager.readSector(8);
+    cacheManager.readSector(16);
+    ASSERT_FALSE(cacheManager.contains(8));
+    ASSERT_TRUE(cacheManager.contains(0));
+
+    // dirty sectors are written back by `flush`
+    memset(sec3->write_ptr(0), 0, SECTOR_SIZE);
+    strncpy((char *) sec3->write_ptr(0), message, mess_len);
+    memset(sec5->write_ptr(0), 0, SECTOR_SIZE);
+    sec3.reset();
+    sec5.reset();
+    ASSERT_EQ(cacheManager.dirtyBlkCnt(), 1);
+    cacheManager.flush();
+    ASSERT_EQ(cacheManager.dirtyBlkCnt(), 0);
+    auto r_sector = real_device->readSector(3).value();
+    ASSERT_EQ(strncmp(message, (const char *) r_sector->read_ptr(0), mess_len), 0);
+}
+
+TEST(CacheManagerTest, EvictCleanOnly) {
+    auto real_device = std::make_shared<device::LinuxFileDriver>(regular_file, SECTOR_SIZE);
+    device::CacheManager cacheManager(real_device, 16, 8);
+    memset(cacheManager.readSector(0).value()->write_ptr(0), 0x11, SECTOR_SIZE);
+    memset(real_device->readSector(0).value()->write_ptr(0), 0x22, SECTOR_SIZE);
+
+    // the dirty block is kept after being evicted, and it's found again instead of being read from device
+    cacheManager.readSector(8);
+    cacheManager.readSector(16);
+    ASSERT_FALSE(cacheManager.contains(0));
+    ASSERT_EQ(*(const u8 *) cacheManager.readSector(0).value()->read_ptr(0), 0x11);
+
+    cacheManager.clear();
+    ASSERT_EQ(*(const u8 *) real_device->readSector(0).value()->read_ptr(0), 0x11);
+}
+
+TEST(CacheManagerTest, FlushKeepsBlocks) {
+    auto real_device = std::make_shared<device::MmapFileDriver>(regular_file, SECTOR_SIZE);
+    device::CacheManager cacheManager(real_device, 16, 8);
+    memset(cacheManager.readSector(0).value()->write_ptr(0), 0x44, SECTOR_SIZE);
+
+    // the dirty block is written through the mapping to the file, and unlike `clear` it stays cached
+    cacheManager.flush();
+    ASSERT_EQ(cacheManager.dirtyBlkCnt(), 0);
+    ASSERT_TRUE(cacheManager.contains(0));
+    device::LinuxFileDriver linux_file_driver(regular_file, SECTOR_SIZE);
+    ASSERT_EQ(*(const u8 *) linux_file_driver.readSector(0).value()->read_ptr(0), 0x44);
+}
+
+TEST(CacheManagerTest, BackgroundFlush) {
+    auto real_device = std::make_shared<device::LinuxFileDriver>(regular_file, SECTOR_SIZE);
+    device::CacheManager cacheManager(real_device, 16, 8);
+    memset(real_device->readSector(0).value()->write_ptr(0), 0, SECTOR_SIZE);
+    cacheManager.setWriteBack(20, 5);
+
+    // a held block is never written back by the flusher
+    auto sector = cacheManager.readSector(0).value();
+    memset(sector->write_ptr(0), 0x33, SECTOR_SIZE);
+    usleep(100 * 1000);
+    ASSERT_EQ(cacheManager.dirtyBlkCnt(), 1);
+    ASSERT_EQ(*(const u8 *) real_device->readSector(0).value()->read_ptr(0), 0);
+
+    sector.reset();
+    for (int i = 0; i < 100 && cacheManager.dirtyBlkCnt() > 0; ++i) {
+        usleep(10 * 1000);
+    }
+    ASSERT_EQ(cacheManager.dirtyBlkCnt(), 0);
+    ASSERT_EQ(*(const u8 *) real_device->readSector(0).value()->read_ptr(0), 0x33);
+}
+
+class CountingFileDriver : public device::LinuxFileDriver {
+public:
+    using device::LinuxFileDriver::LinuxFileDriver;
+
+    bool writeSectors(u32 sec_num, const std::vector<const u8 *> &bufs) noexcept override {
+        write_cnt++;
+        return device::LinuxFileDriver::writeSectors(sec_num, bufs);
+    }
+
+    std::atomic<u32> write_cnt{0};
+};
+
+TEST(CacheManagerTest, CoalescedFlush) {
+    auto real_device = std::make_shared<CountingFileDriver>(regular_file, SECTOR_SIZE);
+    device::CacheManager cacheManager(real_device, 64, 8);
+
+    // the held sectors are skipped by the flusher, they are written back by the two runs [0, 32) and [40, 44)
+    auto sectors = cacheManager.readSectors(0, 48).value();
+    for (u32 i = 0; i < 44; ++i) {
+        if (i < 32 || i >= 40) {
+            memset(sectors[i]->write_ptr(0), (int) i, SECTOR_SIZE);
+        }
+    }
+    cacheManager.flush();
+    ASSERT_EQ(real_device->write_cnt, 2);
+    ASSERT_EQ(cacheManager.dirtyBlkCnt(), 0);
+    for (u32 i = 0; i < 44; ++i) {
+        if (i < 32 || i >= 40) {
+            ASSERT_EQ(*(const u8 *) real_device->readSector(i).value()->read_ptr(SECTOR_SIZE - 1), i);
+        }
+    }
+}
+
+TEST(CacheManagerTest, RecycleArena) {
+    auto real_device = std::make_shared<device::LinuxFileDriver>(regular_file, SECTOR_SIZE);
+    device::CacheManager cacheManager(std::move(real_device), 16, 8);
+    auto &arena = cacheManager.valueArena();
+    u32 free_slot_cnt = arena.freeSlotCnt();
+
+    auto sector = cacheManager.readSector(0).value();
+    ASSERT_TRUE(arena.owns(sector->read_ptr(0)));
+    ASSERT_EQ(arena.freeSlotCnt(), free_slot_cnt - 1);
+
+    // the slot of evicted block is reused
+    cacheManager.readSector(8);
+    sector.reset();
+    cacheManager.readSector(16);
+    ASSERT_FALSE(cacheManager.contains(0));
+    ASSERT_EQ(arena.freeSlotCnt(), free_slot_cnt - 2);
+    cacheManager.clear();
+    ASSERT_EQ(arena.freeSlotCnt(), free_slot_cnt);
+}
+
+TEST(CacheManagerTest, PartialBlock) {
+    auto real_device = std::make_shared<device::LinuxFileDriver>(regular_file, SECTOR_SIZE);
+    device::CacheManager cacheManager(std::move(real_device), 96, 48);
+
+    // the second block only covers the sectors left in the device
+    ASSERT_TRUE(cacheManager.readSector(sector_num - 1).has_value());
+    ASSERT_FALSE(cacheManager.readSector(sector_num).has_value());
+    ASSERT_EQ(cacheManager.readSectors(40, sector_num - 40).value().size(), sector_num - 40);
+    ASSERT_FALSE(cacheManager.readSectors(40, sector_num - 39).has_value());
+}
+
+TEST(CacheManagerTest, Readahead) {
+    auto real_device = std::make_shared<device::LinuxFileDriver>(regular_file, SECTOR_SIZE);
+    device::CacheManager cacheManager(real_device, 32);
+    cacheManager.setReadahead(8);
+
+    // the second sequential read queues the next 8 sectors
+    cacheManager.readSector(0);
+    cacheManager.readSector(1);
+    for (int i = 0; i < 100 && !cacheManager.contains(9); ++i) {
+        usleep(10 * 1000);
+    }
+    ASSERT_TRUE(cacheManager.contains(9));
+    for (u32 i = 2; i < sector_num; ++i) {
+        auto sector = cacheManager.readSector(i).value();
+        ASSERT_EQ(memcmp(sector->read_ptr(0), real_device->readSector(i).value()->read_ptr(0), SECTOR_SIZE), 0);
+    }
+    auto stats = cacheManager.readaheadStats();
+    ASSERT_GE(stats.hit_blk_cnt, 8);
+    ASSERT_GE(stats.issued_blk_cnt, stats.hit_blk_cnt);
+
+    // random reads don't read ahead
+    device::CacheManager randomCacheManager(real_device, 32);
+    randomCacheManager.setReadahead(8);
+    for (u32 i = 0; i < sector_num; i += 7) {
+        randomCacheManager.readSector(i);
+    }
+    randomCacheManager.readSectors(3, 2);
+    ASSERT_EQ(randomCacheManager.readaheadStats().issued_blk_cnt, 0);
+    ASSERT_FALSE(randomCacheManager.contains(1));
+}
+
+TEST(CacheManagerTest, Stats) {
+    auto real_device = std::make_shared<device::LinuxFileDriver>(regular_file, SECTOR_SIZE);
+    device::CacheManager cacheManager(real_device, 3);
+    cacheManager.readSector(0);
+    cacheManager.readSector(1);
+    auto sector = cacheManager.readSector(2).value();
+    cacheManager.readSector(0);
+    memset(sector->write_ptr(0), 0x44, SECTOR_SIZE);
+
+    // sector 1 is evicted at first, then the dirty sector 2
+    cacheManager.readSector(3);
+    cacheManager.readSector(4);
+    auto &stats = cacheManager.cacheStats();
+    ASSERT_EQ(stats.hit_cnt, 1);
+    ASSERT_EQ(stats.miss_cnt, 5);
+    ASSERT_EQ(stats.evict_cnt, 2);
+    ASSERT_EQ(stats.dirty_evict_cnt, 1);
+    ASSERT_EQ(stats.read_latency.count(), 6);
+    ASSERT_EQ(real_device->ioStats().read_cnt, 5);
+    ASSERT_EQ(real_device->ioStats().read_bytes, 5 * SECTOR_SIZE);
+    ASSERT_EQ(real_device->ioStats().syscall_cnt, 5);
+
+    cacheManager.flush();
+    ASSERT_EQ(real_device->ioStats().write_cnt, 1);
+    ASSERT_EQ(real_device->ioStats().write_latency.count(), 1);
+}
+
+TEST(CacheManagerTest, Discard) {
+    auto real_device = std::make_shared<device::LinuxFileDriver>(regular_file, SECTOR_SIZE);
+    std::vector<u8> value(SECTOR_SIZE, 0x6b), zero(SECTOR_SIZE, 0);
+    // large enough that the flusher isn't woken up by the dirty blocks
+    device::CacheManager cacheManager(real_device, sector_num * 4, 4);
+    for (u32 i = 4; i < 13; ++i) {
+        memcpy(cacheManager.readSector(i).value()->write_ptr(0), &value[0], SECTOR_SIZE);
+    }
+    ASSERT_EQ(cacheManager.dirtyBlkCnt(), 3);
+
+    // the blocks of [4, 12) are dropped without being written, the block of sector 12 is only partly discarded
+    ASSERT_TRUE(cacheManager.discardSectors(4, 10));
+    ASSERT_EQ(cacheManager.dirtyBlkCnt(), 1);
+    cacheManager.flush();
+    ASSERT_EQ(memcmp(real_device->readSector(4).value()->read_ptr(0), &zero[0], SECTOR_SIZE), 0);
+    ASSERT_EQ(memcmp(real_device->readSector(12).value()->read_ptr(0), &value[0], SECTOR_SIZE), 0);
+}
+
+TEST(CacheManagerTest, ZeroSectors) {
+    auto real_device = std::make_shared<device::LinuxFileDriver>(regular_file, SECTOR_SIZE);
+    std::vector<u8> value(SECTOR_SIZE, 0x1e), zero(SECTOR_SIZE, 0);
+    ASSERT_TRUE(real_device->writeSectors(0, std::vector<const u8 *>(24, &value[0])));
+    device::CacheManager cacheManager(real_device, sector_num * 4, 4);
+    auto sector = cacheManager.readSector(9).value();
+    memset(sector->write_ptr(0), 0x55, SECTOR_SIZE);
+
+    // the cached block is zeroed and made clean, the blocks missing are made without being read
+    ASSERT_TRUE(cacheManager.zeroSectors(8, 14));
+    u64 read_cnt = real_device->ioStats().read_cnt;
+    ASSERT_FALSE(sector->is_dirty());
+    for (u32 i = 8; i < 20; ++i) {
+        ASSERT_EQ(memcmp(cacheManager.readSector(i).value()->read_ptr(0), &zero[0], SECTOR_SIZE), 0);
+    }
+    ASSERT_EQ(real_device->ioStats().read_cnt, read_cnt);
+    ASSERT_FALSE(cacheManager.contains(20));
+    cacheManager.flush();
+    for (u32 i = 0; i < 24; ++i) {
+        auto &expected = i >= 8 && i < 22 ? zero : value;
+        ASSERT_EQ(memcmp(real_device->readSector(i).value()->read_ptr(0), &expected[0], SECTOR_SIZE), 0);
+    }
+}
+
+class NoZeroFileDriver : public device::LinuxFileDriver {
+public:
+    using device::LinuxFileDriver::LinuxFileDriver;
+
+    bool zeroSectors(u32 sec_num, u32 cnt) noexcept override { return false; }
+};
+
+TEST(CacheManagerTest, ZeroSectorsFallback) {
+    auto real_device = std::make_shared<NoZeroFileDriver>(regular_file, SECTOR_SIZE);
+    std::vector<u8> value(SECTOR_SIZE, 0x2f), zero(SECTOR_SIZE, 0);
+    ASSERT_TRUE(real_device->writeSectors(0, std::vector<const u8 *>(16, &value[0])));
+    device::CacheManager cacheManager(real_device, sector_num * 4, 4);
+
+    // the device can't zero them, the zeros are written through the cache instead
+    ASSERT_TRUE(cacheManager.zeroSectors(4, 8));
+    ASSERT_EQ(real_device->ioStats().zero_cnt, 0);
+    cacheManager.flush();
+    for (u32 i = 0; i < 16; ++i) {
+        auto &expected = i >= 4 && i < 12 ? zero : value;
+        ASSERT_EQ(memcmp(real_device->readSector(i).value()->read_ptr(0), &expected[0], SECTOR_SIZE), 0);
+    }
+}
+
+TEST(CacheManagerTest, WarmUp) {
+    const char warm_list[] = "warm_list";
+    auto real_device = std::make_shared<device::LinuxFileDriver>(regular_file, SECTOR_SIZE);
+    {
+        device::CacheManager cacheManager(real_device, 16, 2);
+        for (u32 i: {30, 2, 20, 50}) {
+            cacheManager.readSector(i);
+        }
+        ASSERT_TRUE(cacheManager.saveWarmList(warm_list, 4));
+    }
+
+    // the metadata block of sectors [2, 4) is loaded first, then the blocks used most recently
+    device::CacheManager cacheManager(real_device, 6, 2);
+    ASSERT_TRUE(cacheManager.warmUp(warm_list));
+    for (int i = 0; i < 100 && cacheManager.warmBlkCnt() < 3; ++i) {
+        usleep(10 * 1000);
+    }
+    ASSERT_EQ(cacheManager.warmBlkCnt(), 3);
+    ASSERT_TRUE(cacheManager.contains(3));
+    ASSERT_TRUE(cacheManager.contains(51));
+    ASSERT_FALSE(cacheManager.contains(30));
+    auto sector = cacheManager.readSector(20).value();
+    ASSERT_EQ(memcmp(sector->read_ptr(0), real_device->readSector(20).value()->read_ptr(0), SECTOR_SIZE), 0);
+    ASSERT_EQ(cacheManager.cacheStats().hit_cnt, 1);
+
+    // a truncated list is refused
+    ASSERT_EQ(truncate(warm_list, 10), 0);
+    ASSERT_FALSE(cacheManager.warmUp(warm_list));
+    ASSERT_EQ(unlink(warm_list), 0);
+    ASSERT_FALSE(cacheManager.warmUp(warm_list));
+}
+
+/**
+ * Each thread owns the sectors congruent to its index modulo `thread_cnt`. It writes them through the cached
+ * sectors or the device, checks that it reads back what it wrote, and reads the other sectors at the same time.
+ * The values written last must reach the device.
+ * */
+static void stressCacheManager(device::LinuxFileDriver &real_device, device::CacheManager &cacheManager,
+                               u32 thread_cnt, u32 op_cnt) {
+    std::vector<u8> values(sector_num, 0);
+    u8 zero[SECTOR_SIZE] = {0};
+    for (u32 i = 0; i < sector_num; ++i) {
+        ASSERT_TRUE(real_device.writeSectorValue(i, zero));
+    }
+
+    std::atomic<u32> error_cnt{0};
+    std::vector<std::thread> threads;
+    for (u32 t = 0; t < thread_cnt; ++t) {
+        threads.emplace_back([&, t] {
+            u64 state = t + 1;
+            u8 buf[SECTOR_SIZE];
+            for (u32 i = 0; i < op_cnt; ++i) {
+                state = state * 6364136223846793005ull + 1442695040888963407ull;
+                u32 r = state >> 32;
+                u32 own_sec = r % (sector_num / thread_cnt) * thread_cnt + t;
+                u8 value = (u8) (i % 255 + 1);
+                switch (r >> 24 & 3) {
+                    case 0: { // write through the cached sector
+                        auto sector = cacheManager.readSector(own_sec).value();
+                        error_cnt += *(u8 *) sector->read_ptr(SECTOR_SIZE - 1) != values[own_sec];
+                        memset(sector->write_ptr(0), value, SECTOR_SIZE);
+                        values[own_sec] = value;
+                        break;
+                    }
+                    case 1: // write through to the device
+                        memset(buf, value, SECTOR_SIZE);
+                        error_cnt += !cacheManager.writeSectorValue(own_sec, buf);
+                        values[own_sec] = value;
+                        break;
+                    case 2: { // read a run of sectors, checking the owned ones
+                        u32 sec_num = r % (sector_num - 8), cnt = r / sector_num % 8 + 1;
+                        auto sectors = cacheManager.readSectors(sec_num, cnt).value();
+                        for (u32 j = 0; j < cnt; ++j) {
+                            if ((sec_num + j) % thread_cnt == t) {
+                                error_cnt += *(u8 *) sectors[j]->read_ptr(0) != values[sec_num + j];
+                            }
+                        }
+                        break;
+                    }
+                    default:
+                        error_cnt += !cacheManager.readSector(r % sector_num).has_value();
+                }
+            }
+        });
+    }
+    for (auto &thread: threads) {
+        thread.join();
+    }
+    ASSERT_EQ(error_cnt, 0);
+
+    cacheManager.flush();
+    for (u32 i = 0; i < sector_num; ++i) {
+        auto sector = real_device.readSector(i).value();
+        ASSERT_EQ(*(u8 *) sector->read_ptr(0), values[i]);
+        ASSERT_EQ(*(u8 *) sector->read_ptr(SECTOR_SIZE - 1), values[i]);
+    }
+}
+
+TEST(CacheManagerTest, ParallelAccess) {
+    auto real_device = std::make_shared<device::LinuxFileDriver>(regular_file, SECTOR_SIZE);
+    {
+        // a shard for every 4 blocks of one sector, the blocks are evicted all the time
+        device::CacheManager cacheManager(real_device, sector_num / 2);
+        ASSERT_EQ(cacheManager.shardCnt(), CACHE_SHARD_NUM);
+        stressCacheManager(*real_device, cacheManager, 8, 4000);
+    }
+    {
+        // the threads share blocks, and readahead loads blocks at the same time
+        device::CacheManager cacheManager(real_device, sector_num / 2, 4);
+        cacheManager.setReadahead(16);
+        ASSERT_EQ(cacheManager.shardCnt(), 2);
+        stressCacheManager(*real_device, cacheManager, 8, 4000);
+    }
+}
+
 TEST(CacheManagerTest, RegularRW) {
     auto real_device = std::make_shared<device::LinuxFileDriver>(regular_file, SECTOR_SIZE);
     device::CacheManager cacheManager(std::move(real_device));
     testRegularRWOnDevice(cacheManager);
 }
 
+TEST(CacheManagerTest, BlockRW) {
+    auto real_device = std::make_shared<device::LinuxFileDriver>(regular_file, SECTOR_SIZE);
+    device::CacheManager cacheManager(std::move(real_device), CACHED_SECTOR_NUM, 8);
+    testRegularRWOnDevice(cacheManager);
+    testBatchRWOnDevice(cacheManager);
+}
+
 TEST(CacheManagerTest, BlkDevRW) {
     if (!enable_loop) {
         GTEST_SKIP();
@@ -265,6 +1143,76 @@ TEST(CacheManagerTest, BlkDevRW) {
     testBlkDevRWOnDevice(cacheManager);
 }
 
+/**
+ * DiscardQueueTest
+ * */
+TEST(DiscardQueueTest, MergeAndCancel) {
+    auto real_device = std::make_shared<device::LinuxFileDriver>(regular_file, SECTOR_SIZE);
+    std::vector<u8> value(SECTOR_SIZE, 0x3c), zero(SECTOR_SIZE, 0);
+    ASSERT_TRUE(real_device->writeSectors(0, std::vector<const u8 *>(32, &value[0])));
+    {
+        device::DiscardQueue discard_queue(real_device, sector_num, 60 * 1000);
+        discard_queue.add(0, 8);
+        discard_queue.add(8, 8);
+        discard_queue.add(20, 4);
+        ASSERT_EQ(discard_queue.pendingSecCnt(), 20);
+
+        // the sectors used again are taken out of the middle of a range
+        discard_queue.cancel(4, 2);
+        ASSERT_EQ(discard_queue.pendingSecCnt(), 18);
+        // nothing is discarded before the ranges are committed
+        discard_queue.flush();
+        ASSERT_EQ(discard_queue.discardedSecCnt(), 0);
+        discard_queue.commit();
+        discard_queue.flush();
+        ASSERT_EQ(discard_queue.pendingSecCnt(), 0);
+        ASSERT_EQ(discard_queue.discardedSecCnt(), 18);
+    }
+    ASSERT_EQ(real_device->ioStats().discard_cnt, 3);
+    auto sectors = real_device->readSectors(0, 32).value();
+    for (u32 i = 0; i < 32; ++i) {
+        bool discarded = (i < 16 && (i < 4 || i >= 6)) || (i >= 20 && i < 24);
+        ASSERT_EQ(memcmp(sectors[i]->read_ptr(0), discarded ? &zero[0] : &value[0], SECTOR_SIZE), 0);
+    }
+
+    // a full batch is discarded in the background
+    device::DiscardQueue discard_queue(real_device, 8, 60 * 1000);
+    discard_queue.add(32, 8);
+    discard_queue.commit();
+    for (int i = 0; i < 100 && discard_queue.discardedSecCnt() < 8; ++i) {
+        usleep(10 * 1000);
+    }
+    ASSERT_EQ(discard_queue.discardedSecCnt(), 8);
+}
+
+TEST(DiscardQueueTest, AfterWriteBack) {
+    auto real_device = std::make_shared<device::LinuxFileDriver>(regular_file, SECTOR_SIZE);
+    std::vector<u8> value(SECTOR_SIZE, 0x4d), fat_value(SECTOR_SIZE, 0x0f), zero(SECTOR_SIZE, 0);
+    ASSERT_TRUE(real_device->writeSectors(0, std::vector<const u8 *>(16, &value[0])));
+    // large enough that the flusher isn't woken up by the dirty blocks
+    auto cache_manager = std::make_shared<device::CacheManager>(real_device, sector_num * 4, 4);
+    device::DiscardQueue discard_queue(cache_manager, 8, 1);
+
+    // sector 0 stands for the FAT which frees [8, 16), it's still dirty in the cache
+    memcpy(cache_manager->readSector(0).value()->write_ptr(0), &fat_value[0], SECTOR_SIZE);
+    discard_queue.add(8, 8);
+    usleep(50 * 1000);
+    discard_queue.flush();
+    ASSERT_EQ(discard_queue.discardedSecCnt(), 0);
+    ASSERT_EQ(real_device->ioStats().discard_cnt, 0);
+    ASSERT_EQ(memcmp(real_device->readSector(8).value()->read_ptr(0), &value[0], SECTOR_SIZE), 0);
+
+    // it's discarded in the background once the FAT is on the inner device
+    cache_manager->clear();
+    ASSERT_EQ(memcmp(real_device->readSector(0).value()->read_ptr(0), &fat_value[0], SECTOR_SIZE), 0);
+    discard_queue.commit();
+    for (int i = 0; i < 100 && discard_queue.discardedSecCnt() < 8; ++i) {
+        usleep(10 * 1000);
+    }
+    ASSERT_EQ(discard_queue.discardedSecCnt(), 8);
+    ASSERT_EQ(memcmp(real_device->readSector(8).value()->read_ptr(0), &zero[0], SECTOR_SIZE), 0);
+}
+
 TEST(IconvTest, Utf8AndGbk) {
     util::string_utf8 utf8_str = "\xe4\xbd\xa0\xe5\xa5\xbd,\xe4\xb8\x96\xe7\x95\x8c!"; // encoding of "你好,世界!" in utf8
     util::string_gbk gbk_str = "\xc4\xe3\xba\xc3,\xca\xc0\xbd\xe7!"; // encoding of "你好,世界!" in gbk